@@ -5,47 +5,128 @@
 #include "bluez/uuid.h"
 #include "bluez/gatt-db.h"
 #include "bluez/gatt-server.h"
+#include "outbound_journal.h"
+#include "ccc_store.h"
+#include "bond_store.h"
 
 #include <vector>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <type_traits>
 
 
+// characteristics of the telemetry service, in handle order
+enum class Telemetry { Pose, Battery, Blade, Errors, Count };
+
 class BleServer {
 public:
   BleServer(const std::string &deviceName, int mtu);
   ~BleServer();
   void initServices();
+  // first service of the schema marked for advertising
+  static uint16_t advertisedService();
+  // indicates the services changed since the last call, one range per run of adjacent handles
   void svcChanged();
+  // thread safe, runs update on the mainloop and indicates what it changed in one batch
+  void updateServices(std::function<void(gatt_db *db)> update);
+  void processServiceUpdates();
   bool connectionEstablished() { return fd_ >= 0; }
-  std::string getDeviceName() { return deviceName_; }
+  std::string getDeviceName();
+  // value handle of a characteristic in the schema, 0 if there is none
+  static uint16_t valueHandle(uint16_t service, uint16_t characteristic);
+  // thread safe, replaces a value gatt_db serves without calling back, false
+  // if handle has a read handler; strings go out as is, integers little endian
+  bool setStaticValue(uint16_t handle, std::vector<uint8_t> value);
+  bool setStaticValue(uint16_t handle, const std::string &value) {
+    return setStaticValue(handle, std::vector<uint8_t>(value.begin(), value.end()));
+  }
+  template <class T, class = typename std::enable_if<std::is_integral<T>::value>::type>
+  bool setStaticValue(uint16_t handle, T value) {
+    std::vector<uint8_t> bytes(sizeof(T));
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      bytes[i] = static_cast<uint8_t>(static_cast<typename std::make_unsigned<T>::type>(value) >> (8 * i));
+    }
+    return setStaticValue(handle, std::move(bytes));
+  }
+  void setDeviceName(const std::string &name);
   void response(const std::vector<uint8_t> response);
-  void notify(const std::vector<uint8_t> notification);
+  void notify(std::vector<uint8_t> notification);
   void processFifo(const std::string &data);
   void processFifoNotify();
   void processFifoResponse();
+  // thread safe, updates posted before the mainloop wakes up are sent together
+  void updateTelemetry(Telemetry which, const std::vector<uint8_t> &value);
+  void processTelemetry();
+  // ms to hold telemetry notifications for coalescing, 0 sends each batch as soon as it is drained
+  void setTelemetryWindow(unsigned int ms);
+  void setMultiNotifySupported(bool supported) { multiNotify_ = supported; }
+  // records kept while disconnected, replayed once the client enables the journal ccc
+  void setJournal(OutboundJournal *journal) { journal_ = journal; }
+  // subscriptions of bonded peers, restored by initServices so they apply from the first event
+  void setCccStore(CccStore *store) { cccStore_ = store; }
+  // bonds of the adapter, only their identity addresses have subscriptions kept
+  void setBondStore(BondStore *bonds) { bondStore_ = bonds; }
+  // -1 until something has been notified on this connection
+  int64_t acceptToFirstNotifyUs() const { return firstNotifyUs_; }
+  // journal stream of a fifo message and its payload, -1 if it is not journaled
+  static int journalStream(const std::string &msg, std::vector<uint8_t> *payload);
+  void journalSent();
+  void deviceNameWrite(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
+                    const uint8_t* value, size_t len);
+  void svcChangedRead(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  // robust caching, see Core Vol 3 Part G 2.5.2.1
+  uint8_t authorize(uint8_t opcode, uint16_t handle);
+  void svcChangedConfirmed();
+  void dbChanged(gatt_db_attribute* attrib);
+  void dbHashRead(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  void cliFeatRead(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  void cliFeatWrite(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
+                    const uint8_t* value, size_t len);
+  void journalCccRead(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  void journalCccWrite(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
+                    const uint8_t* value, size_t len);
+  void journalAck(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
+                    const uint8_t* value, size_t len);
+  void telemetryReadResponse(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  void telemetryCccRead(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
+  void telemetryCccWrite(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
+                    const uint8_t* value, size_t len);
   void transReadResponse(gatt_db_attribute* attrib, unsigned int id, uint16_t offset);
   void transWriteResponse(gatt_db_attribute* attrib, unsigned int id, uint16_t offset,
                     const uint8_t* value, size_t len, uint8_t opcode, bt_att* att);             
 
 private:
-  void populateGapService();
-  void populateGattService();
-  void populateCustomService();
+  void sendTelemetry(Telemetry which);
+  void pumpJournal();
+  void restoreClientState();
+  void saveClientState();
+  bool bondedIdentity(RpaIdentity *identity);
+  void notified();
 
 private:
-  const std::string deviceName_;
+  // written by setDeviceName under serviceMutex_
+  std::string deviceName_;
   int fd_;
+  bdaddr_t peerAddr_;
+  uint8_t peerType_;
+  CccStore *cccStore_;
+  BondStore *bondStore_;
+  bool cccRestored_;
+  std::chrono::steady_clock::time_point acceptTime_;
+  int64_t firstNotifyUs_;
   gatt_db *db_;
   bt_att *att_;
   bt_gatt_server *gatt_;
+  // mtu we offer, what the client settled on is asked from att per packet
   int mtuSize_;
-  gatt_db_attribute *svcChngd_;
-  gatt_db_attribute *attrib_;
-  uint16_t handle_;
-  uint16_t gattSvcChngdHandle_;
+  uint8_t cliFeatures_;
+  // a client starts change-aware and loses it when the database changes under it
+  bool changeAware_;
+  bool outOfSyncSent_;
   bool indicate_;
 
   const int kResponseSize = 1024;
@@ -64,6 +145,35 @@ private:
   int readfd_;
   std::vector<uint8_t> fifoRespQueue_;
   std::mutex readMutex_;
+
+  struct TelemetryChar {
+    uint16_t cccValue;
+    std::vector<uint8_t> value;
+  };
+  TelemetryChar telemetry_[static_cast<int>(Telemetry::Count)];
+  // set once the client reports support for Handle Value Multiple Notifications
+  bool multiNotify_;
+  unsigned int telemetryWindowMs_;
+
+  int telemetryfd_;
+  std::vector<std::pair<Telemetry, std::vector<uint8_t>>> fifoTelemetryQueue_;
+  std::mutex telemetryMutex_;
+
+  int svcUpdatefd_;
+  std::vector<std::function<void(gatt_db *db)>> fifoServiceUpdates_;
+  std::mutex serviceMutex_;
+  // handle ranges added, removed or (de)activated and not yet indicated
+  std::vector<std::pair<uint16_t, uint16_t>> changedRanges_;
+
+  OutboundJournal *journal_;
+  uint16_t journalCccValue_;
+  // replay position, the record being sent and how much of it went out, and
+  // notifications handed to att but not written yet
+  uint64_t journalCursor_;
+  OutboundJournal::Record journalRecord_;
+  size_t journalOffset_;
+  bool journalPartial_;
+  int journalInFlight_;
 };
 
 
@@ -0,0 +1,65 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  In-process AES-128 and AES-CMAC primitives
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * All keys, blocks and MACs use the FIPS-197 / RFC 4493 byte order (most
+ * significant octet first), i.e. the same order the kernel AF_ALG
+ * "ecb(aes)" and "cmac(aes)" transforms use. Bluetooth little-endian
+ * values have to be swapped by the caller, as crypto.c does.
+ */
+
+struct bt_aes128 {
+	uint8_t rk[11][16] __attribute__((aligned(16)));
+};
+
+struct bt_aes_cmac {
+	struct bt_aes128 aes;
+	uint8_t k1[16];
+	uint8_t k2[16];
+	uint8_t x[16];
+	uint8_t buf[16];
+	size_t buf_len;
+};
+
+bool bt_aes_has_hw(void);
+
+void bt_aes128_set_key(struct bt_aes128 *ctx, const uint8_t key[16]);
+void bt_aes128_encrypt(const struct bt_aes128 *ctx, const uint8_t in[16],
+							uint8_t out[16]);
+/* ECB encryption of n consecutive 16-byte blocks under one key */
+void bt_aes128_encrypt_blocks(const struct bt_aes128 *ctx, const uint8_t *in,
+						uint8_t *out, size_t n);
+void bt_aes128_clear(struct bt_aes128 *ctx);
+
+void bt_aes_cmac_init(struct bt_aes_cmac *ctx, const uint8_t key[16]);
+void bt_aes_cmac_update(struct bt_aes_cmac *ctx, const void *data,
+							size_t len);
+void bt_aes_cmac_final(struct bt_aes_cmac *ctx, uint8_t mac[16]);
+
+#ifdef __cplusplus
+}
+#endif
@@ -32,6 +32,7 @@ extern "C" {
 
 struct bt_att;
 struct bt_att_chan;
+struct iovec;
 
 struct bt_att *bt_att_new(int fd, bool ext_signed);
 
@@ -65,6 +66,45 @@ uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 uint8_t bt_att_get_link_type(struct bt_att *att);
 
+/*
+ * Send scheduling classes. By default responses, confirmations and the MTU
+ * exchange are control, other requests and indications are interactive,
+ * commands and notifications are bulk. Classes are served deficit round
+ * robin: each sends up to its quantum of PDUs per turn, so a queued op
+ * waits for at most the quanta of the other classes.
+ */
+enum bt_att_prio {
+	BT_ATT_PRIO_CONTROL,
+	BT_ATT_PRIO_INTERACTIVE,
+	BT_ATT_PRIO_BULK,
+};
+
+#define BT_ATT_PRIO_COUNT		3
+
+/* Applies to ops sent after the call */
+bool bt_att_set_opcode_prio(struct bt_att *att, uint8_t opcode,
+						enum bt_att_prio prio);
+bool bt_att_set_prio_quantum(struct bt_att *att, enum bt_att_prio prio,
+							unsigned int quantum);
+
+/* Bucket i counts PDUs that were queued for less than 2^i us */
+#define BT_ATT_LATENCY_BUCKETS		20
+
+struct bt_att_stats {
+	uint64_t rx_wakeups;		/* Read handler invocations */
+	uint64_t rx_pdus;
+	uint64_t rx_syscalls;
+	uint32_t rx_max_batch;		/* Most PDUs read in one wakeup */
+	uint64_t tx_wakeups;		/* Write handler invocations */
+	uint64_t tx_pdus;
+	uint64_t tx_syscalls;
+	uint32_t tx_max_batch;		/* Most PDUs written in one wakeup */
+	uint64_t tx_replaced;		/* Overwritten by bt_att_sendv_latest */
+	uint64_t queue_latency[BT_ATT_PRIO_COUNT][BT_ATT_LATENCY_BUCKETS];
+};
+
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats);
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
@@ -74,6 +114,32 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 					bt_att_response_func_t callback,
 					void *user_data,
 					bt_att_destroy_func_t destroy);
+/* Gathers the PDU parameters from iov into one (pooled) buffer */
+unsigned int bt_att_sendv(struct bt_att *att, uint8_t opcode,
+					const struct iovec *iov, int iovcnt,
+					bt_att_response_func_t callback,
+					void *user_data,
+					bt_att_destroy_func_t destroy);
+/*
+ * Commands and notifications are written straight from the caller's
+ * buffers, which must stay valid until destroy is called. Leading entries
+ * that fit in a few bytes (e.g. the handle) are copied. Any other PDU type,
+ * signed writes and more than 4 entries fall back to copying.
+ */
+unsigned int bt_att_sendv_ref(struct bt_att *att, uint8_t opcode,
+					const struct iovec *iov, int iovcnt,
+					void *user_data,
+					bt_att_destroy_func_t destroy);
+/*
+ * For commands and notifications whose older values are worthless once a
+ * newer one exists. While the op last queued with the same non-zero key is
+ * still unwritten its PDU is replaced in place, keeping its queue position
+ * and id, so at most one op per key is ever queued. Ops sent any other way
+ * are never touched.
+ */
+unsigned int bt_att_sendv_latest(struct bt_att *att, uint16_t key,
+					uint8_t opcode, const struct iovec *iov,
+					int iovcnt);
 unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 					const void *pdu, uint16_t len,
 					bt_att_response_func_t callback,
@@ -103,6 +169,12 @@ bool bt_att_unregister_disconnect(struct bt_att *att, unsigned int id);
 bool bt_att_unregister_all(struct bt_att *att);
 
 int bt_att_get_security(struct bt_att *att, uint8_t *enc_size);
+/*
+ * The security level is cached per channel. Call this after the link
+ * security may have changed behind our back (e.g. an encryption change
+ * event), returns true if the level differs from the cached one.
+ */
+bool bt_att_refresh_security(struct bt_att *att);
 bool bt_att_set_security(struct bt_att *att, int level);
 void bt_att_set_enc_key_size(struct bt_att *att, uint8_t enc_size);
 
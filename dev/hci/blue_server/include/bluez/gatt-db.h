@@ -31,6 +31,7 @@ extern "C" {
 
 struct gatt_db;
 struct gatt_db_attribute;
+struct gatt_db_snapshot;
 
 struct gatt_db *gatt_db_new(void);
 
@@ -285,8 +286,57 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 bool gatt_db_attribute_write_result(struct gatt_db_attribute *attrib,
 						unsigned int id, int err);
 
+/*
+ * Replaces the value stored in the db, which reads are served from when the
+ * attribute has no read callback. Changing a value the Database Hash covers
+ * is reported to gatt_db_register() watchers as a change of its service.
+ */
+bool gatt_db_attribute_set_value(struct gatt_db_attribute *attrib,
+					const uint8_t *value, size_t len);
+
 bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib);
 
+/*
+ * Read-only snapshots of the attribute index for lookups from other threads.
+ *
+ * Once enabled the db publishes a new immutable snapshot of its active
+ * services whenever one is activated, deactivated or removed, the same
+ * points that fire gatt_db_register() callbacks. Everything else above stays
+ * single threaded. gatt_db_snapshot_get() is lock free and safe from any
+ * thread while the db is alive; the caller owns a reference and may keep
+ * using the snapshot after newer ones are published. A replaced snapshot is
+ * freed once its last reference is dropped and no reader can still be
+ * taking one. Declaration values are copied in, other values are not.
+ */
+bool gatt_db_enable_snapshots(struct gatt_db *db);
+/* For changes made without activating, e.g. attributes added to a service */
+void gatt_db_snapshot_publish(struct gatt_db *db);
+
+struct gatt_db_snapshot *gatt_db_snapshot_get(struct gatt_db *db);
+struct gatt_db_snapshot *gatt_db_snapshot_ref(struct gatt_db_snapshot *snap);
+void gatt_db_snapshot_unref(struct gatt_db_snapshot *snap);
+
+/* Bumped by every publish */
+unsigned int gatt_db_snapshot_get_generation(
+				const struct gatt_db_snapshot *snap);
+
+bool gatt_db_snapshot_get_attribute(const struct gatt_db_snapshot *snap,
+					uint16_t handle, bt_uuid_t *type,
+					uint32_t *permissions);
+bool gatt_db_snapshot_get_service_handles(const struct gatt_db_snapshot *snap,
+					uint16_t handle,
+					uint16_t *start_handle,
+					uint16_t *end_handle);
+const uint8_t *gatt_db_snapshot_get_value(const struct gatt_db_snapshot *snap,
+					uint16_t handle, size_t *len);
+/* Handles of attributes of type within the range, at most max of them */
+unsigned int gatt_db_snapshot_find_by_type(const struct gatt_db_snapshot *snap,
+					uint16_t start_handle,
+					uint16_t end_handle,
+					const bt_uuid_t *type,
+					uint16_t *handles,
+					unsigned int max);
+
 void *gatt_db_attribute_get_user_data(struct gatt_db_attribute *attrib);
 
 
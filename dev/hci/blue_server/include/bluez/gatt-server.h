@@ -49,6 +49,19 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					void *user_data,
 					bt_gatt_server_destroy_func_t destroy);
 
+/*
+ * Bytes of queued Prepare Write values the client may hold on this server,
+ * at least BT_ATT_MAX_VALUE_LEN so one long write always fits.
+ */
+bool bt_gatt_server_set_prep_budget(struct bt_gatt_server *server,
+							uint16_t budget);
+
+/*
+ * Called before every request that addresses attributes by handle (reads,
+ * writes, prepared writes and Read By Type except for the Database Hash).
+ * A non-zero ATT error code fails the request, e.g. Database Out Of Sync
+ * for a change-unaware client.
+ */
 typedef uint8_t (*bt_gatt_server_authorize_cb_t)(struct bt_att *att,
 					uint8_t opcode, uint16_t handle,
 					void *user_data);
@@ -56,6 +69,23 @@ bool bt_gatt_server_set_authorize(struct bt_gatt_server *server,
 					bt_gatt_server_authorize_cb_t cb,
 					void *user_data);
 
+/*
+ * Notifications sent with multiple set are held for up to window ms (at
+ * least 1) and go out as one Handle Value Multiple Notification, earlier
+ * once the MTU is full or when flushed explicitly.
+ */
+bool bt_gatt_server_set_nfy_mult_window(struct bt_gatt_server *server,
+							unsigned int window);
+void bt_gatt_server_flush_notifications(struct bt_gatt_server *server);
+
+/*
+ * Notifications on a conflated handle carry state rather than events: a
+ * value still waiting to be sent is replaced by a newer one instead of
+ * queueing behind it, in the ATT queue and in a pending multiple batch.
+ */
+bool bt_gatt_server_set_conflate(struct bt_gatt_server *server,
+						uint16_t handle, bool enable);
+
 bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length, bool multiple);
@@ -31,8 +31,10 @@ extern "C" {
 typedef void (*io_destroy_func_t)(void *data);
 
 struct io;
+struct mainloop;
 
 struct io *io_new(int fd);
+struct io *io_new_loop(struct mainloop *loop, int fd);
 void io_destroy(struct io *io);
 
 int io_get_fd(struct io *io);
@@ -35,17 +35,53 @@ typedef void (*mainloop_event_func) (int fd, uint32_t events, void *user_data);
 typedef void (*mainloop_timeout_func) (int id, void *user_data);
 typedef void (*mainloop_signal_func) (int signum, void *user_data);
 
+struct mainloop;
+
+/*
+ * A struct mainloop is one epoll reactor with its own fds and timeouts.
+ * Each thread has a default loop, which the calls without a loop argument
+ * (and so io_new() and timeout_add()) use. Running bt_att and friends on
+ * another thread only needs mainloop_init() or mainloop_set_default() on
+ * that thread.
+ */
+struct mainloop *mainloop_new(void);
+void mainloop_free(struct mainloop *loop);
+struct mainloop *mainloop_get_default(void);
+void mainloop_set_default(struct mainloop *loop);
+
+int mainloop_loop_run(struct mainloop *loop);
+void mainloop_loop_quit(struct mainloop *loop);
+void mainloop_loop_exit(struct mainloop *loop, int status);
+int mainloop_loop_set_max_events(struct mainloop *loop,
+						unsigned int max_events);
+
+int mainloop_loop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy);
+int mainloop_loop_modify_fd(struct mainloop *loop, int fd, uint32_t events);
+int mainloop_loop_remove_fd(struct mainloop *loop, int fd);
+int mainloop_loop_defer_fd(struct mainloop *loop, int fd, uint32_t events);
+
+int mainloop_loop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy);
+int mainloop_loop_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec);
+int mainloop_loop_remove_timeout(struct mainloop *loop, int id);
+
 void mainloop_init(void);
 void mainloop_quit(void);
 void mainloop_exit_success(void);
 void mainloop_exit_failure(void);
 int mainloop_run(void);
 int mainloop_run_with_signal(mainloop_signal_func func, void *user_data);
+int mainloop_set_max_events(unsigned int max_events);
 
 int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy);
 int mainloop_modify_fd(int fd, uint32_t events);
 int mainloop_remove_fd(int fd);
+int mainloop_defer_fd(int fd, uint32_t events);
 
 int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 				void *user_data, mainloop_destroy_func destroy);
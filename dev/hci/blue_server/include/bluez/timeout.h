@@ -30,6 +30,14 @@ unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
 			void *user_data, timeout_destroy_func_t destroy);
 void timeout_remove(unsigned int id);
 
+struct mainloop;
+
+/* Timeout ids are per loop, remove with the loop the timeout was added to */
+unsigned int timeout_add_loop(struct mainloop *loop, unsigned int timeout,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy);
+void timeout_remove_loop(struct mainloop *loop, unsigned int id);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Minimal io_uring ring handling for the mainloop
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/io_uring.h>
+
+/*
+ * Only what mainloop.c needs on top of the raw syscalls, so there is no
+ * dependency on liburing. A ring must only be used from one thread.
+ */
+struct uring;
+
+struct uring *uring_new(unsigned int entries);
+void uring_free(struct uring *ring);
+
+/* Never fails, a full submission queue is submitted first */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/*
+ * Submits all queued entries and, unless completions are already
+ * pending, waits for one or until timeout (NULL waits forever).
+ */
+int uring_submit_and_wait(struct uring *ring, const struct timespec *timeout);
+
+/* Copies up to max completions out of the ring and consumes them */
+unsigned int uring_get_cqes(struct uring *ring, struct io_uring_cqe *cqes,
+							unsigned int max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef DM_BOND_STORE_H
+#define DM_BOND_STORE_H
+
+#include "bluez/bluetooth.h"
+#include "rpa_resolver.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * LE bonds of the local adapter as bluetoothd keeps them, one directory per
+ * peer identity address under <storage>/<adapter>/ with an info file that
+ * holds the keys. A peer counts as bonded once a long term key is stored.
+ *
+ * The IRKs go into an RpaResolver, so a peer connecting from a Resolvable
+ * Private Address is found under its identity address. Bonds are read at
+ * load() and read again when a lookup misses after pairing changed them on
+ * disk, since a peer that pairs on the current connection is only stored
+ * once pairing has finished. A miss otherwise costs a few stat() calls.
+ */
+class BondStore {
+public:
+  BondStore();
+
+  // adapter is the local address as "AA:BB:CC:DD:EE:FF"
+  bool load(const std::string &adapter, const std::string &storage = "/var/lib/bluetooth");
+  size_t count() const { return bonds_.size(); }
+
+  // identity of a connected peer, false unless it is bonded
+  bool identify(const bdaddr_t &addr, uint8_t type, RpaIdentity *identity);
+
+  // loads the bonded IRKs into the controller resolving list, see RpaResolver
+  int programResolvingList(int dd, int timeout);
+  // controller whose resolving list is programmed again when identify() reads new bonds
+  void setController(int dd, int timeout) { dd_ = dd; timeout_ = timeout; }
+
+private:
+  bool reload();
+  bool changedOnDisk() const;
+  bool lookup(const bdaddr_t &addr, uint8_t type, RpaIdentity *identity);
+
+private:
+  std::string dir_;
+  std::vector<RpaIdentity> bonds_;
+  // mtimes as of the last reload of the adapter directory, where pairing a new peer adds
+  // a directory, and of the peers' info files, which pairing again rewrites
+  std::map<std::string, struct timespec> mtimes_;
+  int dd_;
+  int timeout_;
+  // our irk as bluetoothd stored it, all zero (no local privacy) without one
+  uint8_t localIrk_[16];
+  RpaResolver resolver_;
+};
+
+#endif // DM_BOND_STORE_H
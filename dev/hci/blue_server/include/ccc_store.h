@@ -0,0 +1,57 @@
+#ifndef DM_CCC_STORE_H
+#define DM_CCC_STORE_H
+
+#include "bluez/bluetooth.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Per-peer Client Characteristic Configuration values and client features,
+ * keyed by identity address, so a bonded client finds its subscriptions in
+ * place when it reconnects instead of rewriting every CCC first.
+ *
+ * The file is a small header and a fixed array of 48 byte records read once
+ * at open. Updates rewrite the one record in place; when all slots are taken
+ * the peer seen least recently loses its slot.
+ */
+class CccStore {
+public:
+  static const int kMaxPeers = 32;
+  static const int kMaxCccs = 8;
+
+  struct Peer {
+    uint8_t features;
+    uint16_t ccc[kMaxCccs];
+    // database hash the client is aware of, all zero while it is change-unaware
+    uint8_t hash[16];
+  };
+
+  CccStore();
+  ~CccStore();
+
+  bool open(const std::string &path);
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+
+  // only public and static random addresses are stable enough to key on
+  static bool isIdentity(const bdaddr_t &addr, uint8_t type);
+
+  bool load(const bdaddr_t &addr, uint8_t type, Peer *peer);
+  bool store(const bdaddr_t &addr, uint8_t type, const Peer &peer);
+  void remove(const bdaddr_t &addr, uint8_t type);
+
+private:
+  struct Record;
+
+  int find(const bdaddr_t &addr, uint8_t type);
+  bool write(int slot);
+
+private:
+  int fd_;
+  uint32_t clock_;
+  std::vector<Record> records_;
+};
+
+#endif // DM_CCC_STORE_H
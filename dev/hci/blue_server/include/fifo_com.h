@@ -2,6 +2,8 @@
 #include <fstream>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <atomic>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -12,19 +14,27 @@ class FifoCom
 {
 public:
   ~FifoCom() { }
+  // one reader for the whole process, started before the first connection
   static void startFifoThread(const std::string &fifoName);
+  // the connected server messages go to, nullptr while there is none
   static void initServer(std::shared_ptr<BleServer> server);
+  // messages that arrive while no client is connected are appended here
+  static void initJournal(OutboundJournal *journal);
   static void sendFifo(const std::string &data);
   static void closeFifo();
 
 private:
   FifoCom(const std::string &fifoName);
   void readFifo();
+  void dispatch(const std::string &data);
 
 private:
+  // guards ins_ and server_, shared by the fifo thread and the main one
+  static std::mutex mutex_;
   static FifoCom* ins_;
+  static std::shared_ptr<BleServer> server_;
+  static OutboundJournal* journal_;
   std::string fifoName_;
-  std::shared_ptr<BleServer> server_;
-  bool isReading_;
+  std::atomic<bool> isReading_;
   std::fstream fifoStream_;
 };
\ No newline at end of file
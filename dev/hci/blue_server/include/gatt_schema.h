@@ -0,0 +1,294 @@
+#ifndef DM_GATT_SCHEMA_H
+#define DM_GATT_SCHEMA_H
+
+#include "bluez/uuid.h"
+#include "bluez/gatt-db.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#include <iostream>
+#include <type_traits>
+
+/*
+ * Compile-time description of a GATT database.
+ *
+ * A schema is a flat constexpr list of services, each followed by its
+ * characteristics and their descriptors. Services are laid out back to back
+ * from handle 1, so every handle and every service's handle count is a
+ * constant expression and populate() fills an empty gatt_db in one pass,
+ * inserting each service at its precomputed handle. Handlers are member
+ * functions of the owner passed to populate(), wrapped in thunks here so no
+ * caller casts user_data itself. An attribute without a read handler is
+ * read straight from gatt_db, starting out with the constant value given
+ * here if any.
+ */
+namespace gatt {
+
+// BT_ATT_MAX_VALUE_LEN, att.h has no include guard
+constexpr uint16_t kMaxValueLen = 512;
+
+enum class Kind : uint8_t { Service, Characteristic, Descriptor };
+
+struct Entry {
+  Kind kind;
+  uint16_t uuid;
+  uint32_t permissions;
+  uint8_t properties;
+  bool advertise; // services listed in the advertising data
+  gatt_db_read_t read;
+  gatt_db_write_t write;
+  const uint8_t *value;
+  uint16_t valueLen;
+};
+
+constexpr Entry service(uint16_t uuid, bool advertise = false) {
+  return Entry{ Kind::Service, uuid, 0, 0, advertise, nullptr, nullptr, nullptr, 0 };
+}
+
+constexpr Entry characteristic(uint16_t uuid, uint32_t permissions, uint8_t properties,
+                               gatt_db_read_t read = nullptr, gatt_db_write_t write = nullptr) {
+  return Entry{ Kind::Characteristic, uuid, permissions, properties, false, read, write, nullptr, 0 };
+}
+
+// value kept in gatt_db, only writes reach the owner
+template <size_t L>
+constexpr Entry characteristic(uint16_t uuid, uint32_t permissions, uint8_t properties,
+                               const uint8_t (&value)[L], gatt_db_write_t write = nullptr) {
+  return Entry{ Kind::Characteristic, uuid, permissions, properties, false, nullptr, write, value, L };
+}
+
+constexpr Entry descriptor(uint16_t uuid, uint32_t permissions,
+                           gatt_db_read_t read = nullptr, gatt_db_write_t write = nullptr) {
+  return Entry{ Kind::Descriptor, uuid, permissions, 0, false, read, write, nullptr, 0 };
+}
+
+template <size_t L>
+constexpr Entry descriptor(uint16_t uuid, uint32_t permissions, const uint8_t (&value)[L],
+                           gatt_db_write_t write = nullptr) {
+  return Entry{ Kind::Descriptor, uuid, permissions, 0, false, nullptr, write, value, L };
+}
+
+template <class F> struct MemberOf;
+template <class T, class R, class... Args> struct MemberOf<R (T::*)(Args...)> { using type = T; };
+
+// handlers take (attrib, id, offset) and may also take (opcode, att)
+template <auto Fn>
+void readThunk(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+               uint8_t opcode, bt_att *att, void *user_data) {
+  using T = typename MemberOf<decltype(Fn)>::type;
+  T *owner = static_cast<T *>(user_data);
+  if constexpr (std::is_invocable_v<decltype(Fn), T *, gatt_db_attribute *, unsigned int,
+                                    uint16_t, uint8_t, bt_att *>) {
+    (owner->*Fn)(attrib, id, offset, opcode, att);
+  } else {
+    (owner->*Fn)(attrib, id, offset);
+  }
+}
+
+// handlers take (attrib, id, offset, value, len) and may also take (opcode, att)
+template <auto Fn>
+void writeThunk(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                const uint8_t *value, size_t len, uint8_t opcode, bt_att *att, void *user_data) {
+  using T = typename MemberOf<decltype(Fn)>::type;
+  T *owner = static_cast<T *>(user_data);
+  if constexpr (std::is_invocable_v<decltype(Fn), T *, gatt_db_attribute *, unsigned int,
+                                    uint16_t, const uint8_t *, size_t, uint8_t, bt_att *>) {
+    (owner->*Fn)(attrib, id, offset, value, len, opcode, att);
+  } else {
+    (owner->*Fn)(attrib, id, offset, value, len);
+  }
+}
+
+template <auto Fn> constexpr gatt_db_read_t onRead = &readThunk<Fn>;
+template <auto Fn> constexpr gatt_db_write_t onWrite = &writeThunk<Fn>;
+
+template <size_t N>
+struct Schema {
+  std::array<Entry, N> entries;
+
+  static constexpr size_t kNotFound = N;
+
+  constexpr size_t size() const { return N; }
+
+  // starts with a service, every descriptor follows a characteristic and
+  // constant values fit an attribute
+  constexpr bool valid() const {
+    for (size_t i = 0; i < N; ++i) {
+      if (i == 0 && entries[i].kind != Kind::Service) {
+        return false;
+      }
+      if (entries[i].kind == Kind::Descriptor && entries[i - 1].kind == Kind::Service) {
+        return false;
+      }
+      if (entries[i].valueLen > kMaxValueLen) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // declaration handle of a service, value handle of a characteristic
+  constexpr uint16_t handle(size_t index) const {
+    uint16_t next = 1;
+    uint16_t handle = 0;
+    for (size_t i = 0; i <= index && i < N; ++i) {
+      handle = entries[i].kind == Kind::Characteristic ? next + 1 : next;
+      next += entries[i].kind == Kind::Characteristic ? 2 : 1;
+    }
+    return handle;
+  }
+
+  // handles used by the service starting at index, as gatt_db_insert_service wants it
+  constexpr uint16_t serviceHandles(size_t index) const {
+    uint16_t count = 1;
+    for (size_t i = index + 1; i < N && entries[i].kind != Kind::Service; ++i) {
+      count += entries[i].kind == Kind::Characteristic ? 2 : 1;
+    }
+    return count;
+  }
+
+  // entry whose handle() is handle, declarations have none
+  constexpr size_t find(uint16_t handle) const {
+    for (size_t i = 0; i < N; ++i) {
+      if (this->handle(i) == handle) {
+        return i;
+      }
+    }
+    return kNotFound;
+  }
+
+  // attributes read straight from gatt_db
+  constexpr bool isStatic(uint16_t handle) const {
+    size_t i = find(handle);
+    return i < N && entries[i].kind != Kind::Service && !entries[i].read;
+  }
+
+  constexpr size_t findService(uint16_t uuid) const {
+    for (size_t i = 0; i < N; ++i) {
+      if (entries[i].kind == Kind::Service && entries[i].uuid == uuid) {
+        return i;
+      }
+    }
+    return kNotFound;
+  }
+
+  constexpr size_t findCharacteristic(uint16_t serviceUuid, uint16_t uuid) const {
+    for (size_t i = findService(serviceUuid) + 1; i < N && entries[i].kind != Kind::Service; ++i) {
+      if (entries[i].kind == Kind::Characteristic && entries[i].uuid == uuid) {
+        return i;
+      }
+    }
+    return kNotFound;
+  }
+
+  constexpr size_t findDescriptor(uint16_t serviceUuid, uint16_t charUuid, uint16_t uuid) const {
+    size_t i = findCharacteristic(serviceUuid, charUuid);
+    for (i = i < N ? i + 1 : N; i < N && entries[i].kind == Kind::Descriptor; ++i) {
+      if (entries[i].uuid == uuid) {
+        return i;
+      }
+    }
+    return kNotFound;
+  }
+
+  // 0 if the schema has no such attribute, so a static_assert catches typos
+  constexpr uint16_t valueHandle(uint16_t serviceUuid, uint16_t uuid) const {
+    size_t i = findCharacteristic(serviceUuid, uuid);
+    return i < N ? handle(i) : 0;
+  }
+
+  constexpr uint16_t descriptorHandle(uint16_t serviceUuid, uint16_t charUuid, uint16_t uuid) const {
+    size_t i = findDescriptor(serviceUuid, charUuid, uuid);
+    return i < N ? handle(i) : 0;
+  }
+
+  constexpr size_t advertisedCount() const {
+    size_t count = 0;
+    for (size_t i = 0; i < N; ++i) {
+      count += entries[i].kind == Kind::Service && entries[i].advertise;
+    }
+    return count;
+  }
+
+  constexpr size_t serviceCount() const {
+    size_t count = 0;
+    for (size_t i = 0; i < N; ++i) {
+      count += entries[i].kind == Kind::Service;
+    }
+    return count;
+  }
+
+  constexpr uint16_t handleCount() const {
+    return N ? handle(N - 1) : 0;
+  }
+};
+
+template <class... Entries>
+constexpr Schema<sizeof...(Entries)> makeSchema(Entries... entries) {
+  static_assert(sizeof...(Entries) > 0, "empty schema");
+  return Schema<sizeof...(Entries)>{ { { entries... } } };
+}
+
+// uuids of the services marked advertise, in schema order
+template <const auto &schema>
+constexpr auto advertisedUuids() {
+  std::array<uint16_t, schema.advertisedCount()> uuids{};
+  size_t n = 0;
+  for (size_t i = 0; i < schema.size(); ++i) {
+    if (schema.entries[i].kind == Kind::Service && schema.entries[i].advertise) {
+      uuids[n++] = schema.entries[i].uuid;
+    }
+  }
+  return uuids;
+}
+
+// adds every service of schema to an empty db and activates it, false if
+// an attribute did not land on its static handle
+template <size_t N>
+bool populate(const Schema<N> &schema, gatt_db *db, void *owner) {
+  static_assert(N > 0, "empty schema");
+  gatt_db_attribute *svc = nullptr;
+  bt_uuid_t uuid;
+
+  for (size_t i = 0; i < N; ++i) {
+    const Entry &entry = schema.entries[i];
+    gatt_db_attribute *attrib = nullptr;
+    bt_uuid16_create(&uuid, entry.uuid);
+
+    switch (entry.kind) {
+    case Kind::Service:
+      if (svc) {
+        gatt_db_service_set_active(svc, true);
+      }
+      svc = attrib = gatt_db_insert_service(db, schema.handle(i), &uuid, true,
+                                            schema.serviceHandles(i));
+      break;
+    case Kind::Characteristic:
+      attrib = gatt_db_service_add_characteristic(svc, &uuid, entry.permissions, entry.properties,
+                                                  entry.read, entry.write, owner);
+      break;
+    case Kind::Descriptor:
+      attrib = gatt_db_service_add_descriptor(svc, &uuid, entry.permissions,
+                                              entry.read, entry.write, owner);
+      break;
+    }
+
+    if (attrib && entry.valueLen) {
+      gatt_db_attribute_set_value(attrib, entry.value, entry.valueLen);
+    }
+
+    if (!attrib || gatt_db_attribute_get_handle(attrib) != schema.handle(i)) {
+      std::cerr << "Failed to add attribute 0x" << std::hex << entry.uuid << " at handle 0x"
+                << schema.handle(i) << std::dec << std::endl;
+      return false;
+    }
+  }
+
+  gatt_db_service_set_active(svc, true);
+  return true;
+}
+
+} // namespace gatt
+
+#endif // DM_GATT_SCHEMA_H
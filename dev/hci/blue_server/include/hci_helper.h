@@ -76,6 +76,7 @@ public:
   HciHelper();
   ~HciHelper();
   bool valid() const { return fd_ >= 0; }
+  int fd() const { return fd_; }
   HCI_VERSION getHciVersion();
   void setLeAdvertisingData(uint16_t service, const char *deviceName);
   void setLeAdvertisingDataExt(uint16_t service, const char* data);
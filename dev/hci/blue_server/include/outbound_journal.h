@@ -0,0 +1,73 @@
+#ifndef DM_OUTBOUND_JOURNAL_H
+#define DM_OUTBOUND_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Bounded store-and-forward log for events produced while no client is
+ * connected, kept in an mmap'd ring file so it survives restarts.
+ *
+ * Records are addressed by a logical byte position that only grows; the
+ * ring offset is that position modulo the capacity, so a record may wrap
+ * around the end of the file and nothing is ever moved. Every record of a
+ * stream gets the next sequence number of that stream. When the ring is
+ * full the oldest records are dropped, which the client sees as a gap.
+ *
+ * A record is written before the header's tail is advanced over it and
+ * carries a checksum, so a process killed mid-append loses at most that
+ * record: open() walks the log and truncates at the first bad one.
+ */
+class OutboundJournal {
+public:
+  static const uint16_t kMaxStreams = 16;
+  static const uint16_t kMaxPayload = 240;
+
+  struct Record {
+    uint16_t stream;
+    uint32_t seq;
+    std::vector<uint8_t> data;
+  };
+
+  OutboundJournal();
+  ~OutboundJournal();
+
+  // creates the file if needed, an existing log is recovered as is
+  bool open(const std::string &path, size_t capacity);
+  void close();
+  bool isOpen();
+
+  // payloads over kMaxPayload are split into consecutive records,
+  // returns the sequence number of the last one or 0 if nothing was stored
+  uint32_t append(uint16_t stream, const uint8_t *data, size_t len);
+  // reads the next record at or after *cursor (0 is the oldest) that has not
+  // been acked and moves the cursor past it
+  bool read(uint64_t *cursor, Record *record);
+  // the client has everything up to and including seq on stream
+  void ack(uint16_t stream, uint32_t seq);
+  // records stored and not yet acked
+  size_t pending();
+
+private:
+  struct Header;
+
+  size_t recordSize(uint64_t pos);
+  bool readRecord(uint64_t pos, Record *record);
+  void copyIn(uint64_t pos, const void *src, size_t len);
+  void copyOut(uint64_t pos, void *dst, size_t len);
+  void reclaim();
+  void recover();
+
+private:
+  std::mutex mutex_;
+  int fd_;
+  Header *header_;
+  uint8_t *ring_;
+  size_t mapSize_;
+  uint64_t capacity_;
+};
+
+#endif // DM_OUTBOUND_JOURNAL_H
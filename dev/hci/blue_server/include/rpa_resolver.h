@@ -0,0 +1,94 @@
+#ifndef DM_RPA_RESOLVER_H
+#define DM_RPA_RESOLVER_H
+
+#include "bluez/bluetooth.h"
+#include "bluez/aes.h"
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+struct RpaIdentity {
+  bdaddr_t addr;
+  uint8_t type; // BDADDR_LE_PUBLIC or BDADDR_LE_RANDOM (static)
+};
+
+struct RpaResult {
+  bool resolved;
+  RpaIdentity identity;
+};
+
+/*
+ * Resolves Resolvable Private Addresses against the IRKs of bonded peers.
+ *
+ * The AES key schedule of every IRK is expanded once when it is added, so
+ * resolving costs one block encryption per IRK tried and no syscalls.
+ * Results, including misses, are cached per address until they expire:
+ * a phone keeps its RPA for ~15 minutes and the scanner reports the same
+ * address many times per second, so only the first report pays for the
+ * IRK walk.
+ */
+class RpaResolver {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    uint64_t lookups = 0;
+    uint64_t cacheHits = 0;
+    uint64_t resolved = 0;
+    uint64_t aesBlocks = 0;
+  };
+
+  explicit RpaResolver(std::chrono::milliseconds cacheTtl = std::chrono::minutes(15),
+                       size_t cacheSize = 1024);
+  ~RpaResolver();
+
+  static bool isResolvable(const bdaddr_t &addr) { return (addr.b[5] & 0xc0) == 0x40; }
+
+  // irk is in the same (little-endian) order as passed to bt_crypto_ah
+  bool addIrk(const RpaIdentity &identity, const uint8_t irk[16]);
+  bool removeIrk(const RpaIdentity &identity);
+  void clear();
+  size_t irkCount() const { return irks_.size(); }
+
+  bool resolve(const bdaddr_t &rpa, RpaIdentity *identity);
+  // resolves count addresses from one batch of scan reports, returns the number resolved
+  size_t resolveBatch(const bdaddr_t *rpas, size_t count, RpaResult *results);
+
+  // loads the IRKs into the controller resolving list, returns the number of entries written
+  int programResolvingList(int dd, const uint8_t *localIrk, int timeout);
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  struct Irk {
+    RpaIdentity identity;
+    uint8_t key[16];
+    bt_aes128 aes;
+  };
+
+  struct CacheEntry {
+    int irk; // index into irks_, -1 for a cached miss
+    Clock::time_point expires;
+  };
+
+  static uint64_t addrKey(const bdaddr_t &addr);
+  bool lookupCache(uint64_t key, Clock::time_point now, RpaResult *result);
+  void storeCache(uint64_t key, int irk, Clock::time_point now);
+  void expireCache(Clock::time_point now);
+
+private:
+  const std::chrono::milliseconds cacheTtl_;
+  const size_t cacheSize_;
+  std::vector<Irk> irks_;
+  std::unordered_map<uint64_t, CacheEntry> cache_;
+  // insertion order == expiry order since every entry gets the same ttl
+  std::deque<std::pair<uint64_t, Clock::time_point>> cacheOrder_;
+  std::vector<uint8_t> blocks_;
+  std::vector<size_t> pending_;
+  Stats stats_;
+};
+
+#endif // DM_RPA_RESOLVER_H
@@ -7,14 +7,17 @@
 #include "bluez/mainloop.h"
 #include "bluez/util.h"
 #include "json_packer.h"
+#include "gatt_schema.h"
 
 #include <unistd.h>
+#include <algorithm>
 #include <cstdio>
 #include <chrono>
 #include <thread>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <utility>
 #include <sys/eventfd.h>
 
 #pragma pack(push)
@@ -29,7 +32,128 @@ struct TransPdu {
 
 #define UUID_GAP  0x1800
 #define UUID_GATT	0x1801
+#define UUID_TELEMETRY  0x0b0b
+#define UUID_JOURNAL  0x0c0c
+#define UUID_JOURNAL_REPLAY  0x0c01
 const int PDU_EXCEPT = 4;
+const unsigned int kTelemetryWindowMs = 0;
+// replayed records carry stream and sequence number ahead of the payload
+const int kJournalRecordHeader = 6;
+// set in the stream of every notification of a record but its last, the client
+// concatenates fragments with the same stream and seq until one comes without it
+const uint16_t kJournalMoreFragments = 0x8000;
+// notifications kept queued in att during replay, enough to fill every connection event
+const int kJournalWindow = 8;
+const uint16_t kJournalNotifyStream = 0;
+// slot of the journal ccc in the store, after the telemetry ones
+const int kJournalCccSlot = static_cast<int>(Telemetry::Count);
+// client features we act on, eatt is not supported
+const uint8_t kCliFeatSupported = BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING | BT_GATT_CHRC_CLI_FEAT_NFY_MULTI;
+
+// characteristic uuid and topic name per Telemetry value, state values only
+// need their latest sample delivered while errors are events and stay FIFO
+static constexpr struct {
+  uint16_t uuid;
+  const char *name;
+  bool conflate;
+} kTelemetryChars[] = {
+  { 0x0b01, "pose", true },
+  { 0x0b02, "battery", true },
+  { 0x0b03, "blade", true },
+  { 0x0b04, "errors", false },
+};
+
+#define UUID_TRANS_SERVICE  0x0a0a
+#define UUID_TRANS  0x0001
+
+static constexpr uint32_t kPermRW = BT_ATT_PERM_READ | BT_ATT_PERM_WRITE;
+static constexpr uint8_t kDeviceNameExtProp[] = { BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE, 0 };
+
+static constexpr gatt::Entry telemetryChar(int i) {
+  return gatt::characteristic(kTelemetryChars[i].uuid, BT_ATT_PERM_READ,
+                              BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_NOTIFY,
+                              gatt::onRead<&BleServer::telemetryReadResponse>);
+}
+
+static constexpr gatt::Entry telemetryCcc() {
+  return gatt::descriptor(GATT_CLIENT_CHARAC_CFG_UUID, kPermRW,
+                          gatt::onRead<&BleServer::telemetryCccRead>,
+                          gatt::onWrite<&BleServer::telemetryCccWrite>);
+}
+
+// the whole database, handles follow from the order below
+static constexpr auto kSchema = gatt::makeSchema(
+  gatt::service(UUID_GAP),
+  // set from deviceName_ once populated
+  gatt::characteristic(GATT_CHARAC_DEVICE_NAME, kPermRW,
+                       BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_EXT_PROP,
+                       nullptr, gatt::onWrite<&BleServer::deviceNameWrite>),
+  gatt::descriptor(GATT_CHARAC_EXT_PROPER_UUID, BT_ATT_PERM_READ, kDeviceNameExtProp),
+
+  gatt::service(UUID_GATT),
+  gatt::characteristic(GATT_CHARAC_SERVICE_CHANGED, BT_ATT_PERM_READ,
+                       BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_INDICATE,
+                       gatt::onRead<&BleServer::svcChangedRead>),
+  // lets a reconnecting client compare against its cache instead of rediscovering
+  gatt::characteristic(GATT_CHARAC_CLI_FEAT, kPermRW,
+                       BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE,
+                       gatt::onRead<&BleServer::cliFeatRead>,
+                       gatt::onWrite<&BleServer::cliFeatWrite>),
+  gatt::characteristic(GATT_CHARAC_DB_HASH, BT_ATT_PERM_READ, BT_GATT_CHRC_PROP_READ,
+                       gatt::onRead<&BleServer::dbHashRead>),
+
+  // Device Information, no characteristics yet
+  gatt::service(0x180a),
+
+  gatt::service(UUID_TRANS_SERVICE, true),
+  gatt::characteristic(UUID_TRANS, kPermRW,
+                       BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_NOTIFY,
+                       gatt::onRead<&BleServer::transReadResponse>,
+                       gatt::onWrite<&BleServer::transWriteResponse>),
+
+  gatt::service(UUID_TELEMETRY),
+  telemetryChar(0), telemetryCcc(),
+  telemetryChar(1), telemetryCcc(),
+  telemetryChar(2), telemetryCcc(),
+  telemetryChar(3), telemetryCcc(),
+
+  // notifies replayed records, written with a stream and seq to ack them
+  gatt::service(UUID_JOURNAL),
+  gatt::characteristic(UUID_JOURNAL_REPLAY, BT_ATT_PERM_WRITE,
+                       BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP |
+                       BT_GATT_CHRC_PROP_NOTIFY,
+                       nullptr, gatt::onWrite<&BleServer::journalAck>),
+  gatt::descriptor(GATT_CLIENT_CHARAC_CFG_UUID, kPermRW,
+                   gatt::onRead<&BleServer::journalCccRead>,
+                   gatt::onWrite<&BleServer::journalCccWrite>)
+);
+static_assert(kSchema.valid(), "descriptor outside a characteristic");
+static_assert(kSchema.advertisedCount() == 1, "advertising data carries one service uuid");
+
+static constexpr uint16_t kDeviceNameHandle = kSchema.valueHandle(UUID_GAP, GATT_CHARAC_DEVICE_NAME);
+static constexpr uint16_t kSvcChangedHandle = kSchema.valueHandle(UUID_GATT, GATT_CHARAC_SERVICE_CHANGED);
+static constexpr uint16_t kTransHandle = kSchema.valueHandle(UUID_TRANS_SERVICE, UUID_TRANS);
+static constexpr uint16_t kJournalHandle = kSchema.valueHandle(UUID_JOURNAL, UUID_JOURNAL_REPLAY);
+static_assert(kSchema.isStatic(kDeviceNameHandle), "device name is served from gatt_db");
+static_assert(kSvcChangedHandle && kTransHandle && kJournalHandle, "attribute missing from schema");
+
+template <size_t... I>
+static constexpr std::array<uint16_t, sizeof...(I)> telemetryHandles(std::index_sequence<I...>) {
+  return { kSchema.valueHandle(UUID_TELEMETRY, kTelemetryChars[I].uuid)... };
+}
+static constexpr auto kTelemetryHandles =
+  telemetryHandles(std::make_index_sequence<static_cast<size_t>(Telemetry::Count)>());
+
+// a ccc directly follows its value
+static constexpr int telemetryIndex(uint16_t handle, uint16_t delta) {
+  for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+    if (kTelemetryHandles[i] + delta == handle) {
+      return i;
+    }
+  }
+  return -1;
+}
+static_assert(telemetryIndex(kTelemetryHandles[3], 0) == 3, "telemetry handles out of order");
 
 static uint8_t checksum(const uint8_t* data, size_t len) {
   uint8_t sum = 0;
@@ -61,89 +185,39 @@ static void onAttDisconnectCallback(int err, void *user_data)
   std::cout << std::endl;
 }
 
-static void onGapDeviceNameReadCallback(struct gatt_db_attribute *attrib,
-                  unsigned int id, uint16_t offset,
-                  uint8_t opcode, struct bt_att *att,
-                  void *user_data) {
+static void onConfCallback(void *user_data)
+{
+	std::cout << "received svc changed confirmation" << std::endl;
   BleServer* server = (BleServer*)user_data;
-  uint8_t error = 0;
-  size_t len = 0;
-  const uint8_t *value = NULL;
-  std::string name = server->getDeviceName();
-  len = name.size();
-  do
-  {
-    if (offset > len) {
-      error = BT_ATT_ERROR_INVALID_OFFSET;
-      break;
-    }
-    len -= offset;
-    value = len ? (const uint8_t*) name.c_str() : NULL;
-  } while (false);
-  gatt_db_attribute_read_result(attrib, id, error, value, len);
-}
-
-static void onGapDeviceNameWriteCallback(struct gatt_db_attribute *attrib,
-					unsigned int id, uint16_t offset,
-					const uint8_t *value, size_t len,
-					uint8_t opcode, struct bt_att *att,
-					void *user_data) {
-  uint8_t error = 0;
-  std::cout << "GAP Device Name Write called" << std::endl;
-  gatt_db_attribute_write_result(attrib, id, error);
-}
-
-static void onGapDeviceNameExtPropReadCallback(struct gatt_db_attribute *attrib,
-					unsigned int id, uint16_t offset,
-					uint8_t opcode, struct bt_att *att,
-					void *user_data) {
-  uint8_t value[2];
-  std::cout << "Device Name Extended Properties Read called" << std::endl;
-	value[0] = BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE;
-	value[1] = 0;
-	gatt_db_attribute_read_result(attrib, id, 0, value, sizeof(value));
+  server->svcChangedConfirmed();
 }
 
-static void onGattServiceChangedCallback(struct gatt_db_attribute *attrib,
-					unsigned int id, uint16_t offset,
-					uint8_t opcode, struct bt_att *att,
-					void *user_data)
-{
-	std::cout << "Service Changed Read called" << std::endl;
-	gatt_db_attribute_read_result(attrib, id, 0, NULL, 0);
+static uint8_t onAuthorizeCallback(bt_att *att, uint8_t opcode, uint16_t handle, void *user_data) {
+  BleServer* server = (BleServer*)user_data;
+  return server->authorize(opcode, handle);
 }
 
-static void onConfCallback(void *user_data)
-{
-	std::cout << "received svc changed confirmation" << std::endl;
+static void onDbServiceCallback(gatt_db_attribute *attrib, void *user_data) {
+  BleServer* server = (BleServer*)user_data;
+  server->dbChanged(attrib);
 }
 
-static void onTransReadCallback(gatt_db_attribute *attrib, unsigned int id, uint16_t offset, 
-					          uint8_t opcode, bt_att *att, void *user_data) {
+static void onJournalSentCallback(void *user_data) {
   BleServer* server = (BleServer*)user_data;
-  if (!attrib) {
-    std::cerr << "gatt attrib is null" << std::endl;
-    return;
-  }
-  if (!server) {
-    std::cerr << "blue server is null" << std::endl;
-    return;
-  }
-  server->transReadResponse(attrib, id, offset);
+  server->journalSent();
 }
 
-static void onTransWriteCallback(gatt_db_attribute *attrib, unsigned int id, uint16_t offset, 
-					          const uint8_t *value, size_t len, uint8_t opcode, bt_att *att, void *user_data) {
-  BleServer* server = (BleServer*)user_data;
-  if (!attrib) {
-    std::cerr << "gatt attrib is null" << std::endl;
-    return;
-  }
-  if (!server) {
-    std::cerr << "blue server is null" << std::endl;
-    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+// one notification's data, shared by all of its packets and freed after the last is written
+struct NotifyBuffer {
+  std::vector<uint8_t> data;
+  int refs;
+};
+
+static void onNotifySentCallback(void *user_data) {
+  NotifyBuffer *buffer = (NotifyBuffer*)user_data;
+  if (!--buffer->refs) {
+    delete buffer;
   }
-  server->transWriteResponse(attrib, id, offset, value, len, opcode, att);
 }
 
 static void confCallback(void *user_data)
@@ -161,6 +235,26 @@ static void onNotifyTask(int fd, uint32_t events, void *user_data) {
   server->processFifoNotify();
 }
 
+static void onTelemetryTask(int fd, uint32_t events, void *user_data) {
+  uint64_t one;
+  if (read(fd, &one, sizeof(one)) != sizeof(one)) {
+    std::cerr << "telemetry read error" << std::endl;
+    return;
+  }
+  BleServer* server = (BleServer*)user_data;
+  server->processTelemetry();
+}
+
+static void onServiceUpdateTask(int fd, uint32_t events, void *user_data) {
+  uint64_t one;
+  if (read(fd, &one, sizeof(one)) != sizeof(one)) {
+    std::cerr << "service update read error" << std::endl;
+    return;
+  }
+  BleServer* server = (BleServer*)user_data;
+  server->processServiceUpdates();
+}
+
 static void onReadTask(int fd, uint32_t events, void *user_data) {
   uint64_t one;
   if (read(fd, &one, sizeof(one)) != sizeof(one)) {
@@ -172,12 +266,21 @@ static void onReadTask(int fd, uint32_t events, void *user_data) {
 }
 
 BleServer::BleServer(const std::string &deviceName, int mtu)
-  : fd_(-1), att_(NULL), db_(NULL), indicate_(false), mtuSize_(mtu) {
+  : fd_(-1), peerAddr_(), peerType_(0), cccStore_(nullptr), bondStore_(nullptr), cccRestored_(false), firstNotifyUs_(-1),
+    att_(NULL), db_(NULL), indicate_(false), mtuSize_(mtu),
+    cliFeatures_(0), changeAware_(true), outOfSyncSent_(false), telemetry_(), multiNotify_(false),
+    telemetryWindowMs_(kTelemetryWindowMs), journal_(nullptr),
+    journalCccValue_(0), journalCursor_(0), journalRecord_(), journalOffset_(0), journalPartial_(false),
+    journalInFlight_(0) {
   notifyfd_ = eventfd(0, EFD_NONBLOCK);
   readfd_ = eventfd(0, EFD_NONBLOCK);
+  telemetryfd_ = eventfd(0, EFD_NONBLOCK);
+  svcUpdatefd_ = eventfd(0, EFD_NONBLOCK);
 
   mainloop_add_fd(notifyfd_, EPOLLIN | EPOLLERR | EPOLLET, onNotifyTask, this, NULL);
   mainloop_add_fd(readfd_, EPOLLIN | EPOLLERR | EPOLLET, onReadTask, this, NULL);
+  mainloop_add_fd(telemetryfd_, EPOLLIN | EPOLLERR | EPOLLET, onTelemetryTask, this, NULL);
+  mainloop_add_fd(svcUpdatefd_, EPOLLIN | EPOLLERR | EPOLLET, onServiceUpdateTask, this, NULL);
   
   int fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
   if (fd < 0) {
@@ -227,6 +330,9 @@ BleServer::BleServer(const std::string &deviceName, int mtu)
       std::cerr << "Failed to accept L2CAP connection" << std::endl;
       break;
     }
+    acceptTime_ = std::chrono::steady_clock::now();
+    bacpy(&peerAddr_, &peer.l2_bdaddr);
+    peerType_ = peer.l2_bdaddr_type;
   } while (0);
 
   close(fd);
@@ -263,25 +369,35 @@ BleServer::BleServer(const std::string &deviceName, int mtu)
     std::cerr << "Failed to allocate GATT server" << std::endl;
     return;
   }
-
-  mtuSize_ = bt_att_get_mtu(att_) - 1;
-  if (!mtuSize_) {
-    std::cerr << "Failed to get MTU size" << std::endl;
-    return;
-  }
+  setTelemetryWindow(telemetryWindowMs_);
+  bt_gatt_server_set_authorize(gatt_, onAuthorizeCallback, this);
 }
 
 BleServer::~BleServer() {
   close(notifyfd_);
   close(readfd_);
+  close(telemetryfd_);
+  close(svcUpdatefd_);
   close(fd_);
 }
 
 void BleServer::initServices() {
   std::cout << ">>>>>>>> begin init bluetooth services <<<<<<<<" << std::endl;
-  populateGapService();
-  populateGattService();
-  populateCustomService();
+  if (!gatt::populate(kSchema, db_, this)) {
+    return;
+  }
+  for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+    bt_gatt_server_set_conflate(gatt_, kTelemetryHandles[i], kTelemetryChars[i].conflate);
+  }
+  {
+    std::lock_guard<std::mutex> guard(serviceMutex_);
+    gatt_db_attribute_set_value(gatt_db_get_attribute(db_, kDeviceNameHandle),
+                                (const uint8_t *)deviceName_.data(), deviceName_.size());
+  }
+  std::cout << kSchema.serviceCount() << " services, " << kSchema.handleCount() << " handles" << std::endl;
+  // changes from here on happen under a connected client
+  gatt_db_register(db_, onDbServiceCallback, onDbServiceCallback, this, NULL);
+  restoreClientState();
   std::cout << ">>>>>>>> init bluetooth services end <<<<<<<<" << std::endl;
 }
 
@@ -307,33 +423,42 @@ void BleServer::response(const std::vector<uint8_t> response) {
   }
   condResp_.notify_one();
 
-  std::vector<uint8_t> notification(1, 0);
-  notify(notification);
+  notify(std::vector<uint8_t>(1, 0));
 }
 
-void BleServer::notify(const std::vector<uint8_t> notification) {
-  std::vector<std::vector<uint8_t>> packets;
-  for (auto it = notification.begin(); it < notification.end(); it += mtuSize_) {
-    if (it + mtuSize_ < notification.end()) {
-      packets.push_back(std::vector<uint8_t>(it, it + mtuSize_));
-    } else {
-      packets.push_back(std::vector<uint8_t>(it, notification.end()));
-    }
-  }
-
-  for (const auto& packet : packets) {
-    if (indicate_) {
-      if (!bt_gatt_server_send_indication(gatt_, handle_, packet.data(), packet.size(), confCallback, NULL, NULL)) {
+void BleServer::notify(std::vector<uint8_t> notification) {
+  size_t maxLen = bt_att_get_mtu(att_) - 3;
+  if (indicate_) {
+    for (size_t offset = 0; offset < notification.size(); offset += maxLen) {
+      uint16_t len = std::min(maxLen, notification.size() - offset);
+      if (!bt_gatt_server_send_indication(gatt_, kTransHandle, notification.data() + offset, len,
+                                          confCallback, NULL, NULL)) {
         std::cerr << "Failed to initiate indication" << std::endl;
         return;
       }
-    } else {
-      if (!bt_gatt_server_send_notification(gatt_, handle_, packet.data(), packet.size(), false)) {
-        std::cerr << "Failed to initiate notification" << std::endl;
-        return;
-      }
+      notified();
     }
+    return;
   }
+
+  // att writes each packet straight out of the buffer, only the handle gets copied
+  NotifyBuffer *buffer = new NotifyBuffer{std::move(notification), 1};
+  uint8_t handle[2];
+  put_le16(kTransHandle, handle);
+  for (size_t offset = 0; offset < buffer->data.size(); offset += maxLen) {
+    struct iovec iov[2] = {
+      { handle, sizeof(handle) },
+      { buffer->data.data() + offset, std::min(maxLen, buffer->data.size() - offset) },
+    };
+    ++buffer->refs;
+    if (!bt_att_sendv_ref(att_, BT_ATT_OP_HANDLE_NFY, iov, 2, buffer, onNotifySentCallback)) {
+      --buffer->refs;
+      std::cerr << "Failed to initiate notification" << std::endl;
+      break;
+    }
+    notified();
+  }
+  onNotifySentCallback(buffer);
 }
 
 void BleServer::processFifo(const std::string &msg) {
@@ -344,8 +469,10 @@ void BleServer::processFifo(const std::string &msg) {
     return;
   }
 
-  if (!doc.HasMember("topic")) {
-    std::cerr << "no topic, messgae: " << msg << std::endl;
+  // rapidjson asserts on a missing member or one of another type, a malformed message is dropped
+  if (!doc.IsObject() || !doc.HasMember("topic") || !doc["topic"].IsString() || !doc.HasMember("data") ||
+      !doc["data"].IsString()) {
+    std::cerr << "no topic or data, messgae: " << msg << std::endl;
     return;
   }
 
@@ -363,6 +490,21 @@ void BleServer::processFifo(const std::string &msg) {
     uint64_t one = 1;
     write(readfd_, &one, sizeof(one));
     
+  } else if (topic == "telemetry") {
+    if (!doc.HasMember("name") || !doc["name"].IsString()) {
+      std::cerr << "telemetry without name, messgae: " << msg << std::endl;
+      return;
+    }
+    std::string name(doc["name"].GetString());
+    std::string data(doc["data"].GetString());
+    for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+      if (name == kTelemetryChars[i].name) {
+        updateTelemetry(static_cast<Telemetry>(i), std::vector<uint8_t>(data.begin(), data.end()));
+        return;
+      }
+    }
+    std::cerr << "unknown telemetry: " << name << std::endl;
+
   } else if (topic == "notification") {
     std::string data(doc["data"].GetString());
     std::vector<uint8_t> vec(data.begin(), data.end());
@@ -383,7 +525,7 @@ void BleServer::processFifoNotify() {
     std::lock_guard<std::mutex> guard(notifyMutex_);
     vec.swap(fifoNotifyQueue_);
   }
-  notify(vec);
+  notify(std::move(vec));
 }
 
 void BleServer::processFifoResponse() {
@@ -395,6 +537,343 @@ void BleServer::processFifoResponse() {
   response(vec);
 }
 
+void BleServer::updateTelemetry(Telemetry which, const std::vector<uint8_t> &value) {
+  bool wake;
+  {
+    std::lock_guard<std::mutex> guard(telemetryMutex_);
+    wake = fifoTelemetryQueue_.empty();
+    fifoTelemetryQueue_.emplace_back(which, value);
+  }
+
+  // one wakeup per batch, the mainloop drains everything queued until then
+  if (wake) {
+    uint64_t one = 1;
+    write(telemetryfd_, &one, sizeof(one));
+  }
+}
+
+void BleServer::processTelemetry() {
+  std::vector<std::pair<Telemetry, std::vector<uint8_t>>> updates;
+  {
+    std::lock_guard<std::mutex> guard(telemetryMutex_);
+    updates.swap(fifoTelemetryQueue_);
+  }
+
+  for (auto &update : updates) {
+    telemetry_[static_cast<int>(update.first)].value.swap(update.second);
+    sendTelemetry(update.first);
+  }
+
+  if (!telemetryWindowMs_) {
+    bt_gatt_server_flush_notifications(gatt_);
+  }
+}
+
+void BleServer::sendTelemetry(Telemetry which) {
+  TelemetryChar &chr = telemetry_[static_cast<int>(which)];
+  if (!(chr.cccValue & 0x0001)) {
+    return;
+  }
+
+  // with multiple set gatt-server packs everything sent in this window into one pdu
+  if (!bt_gatt_server_send_notification(gatt_, kTelemetryHandles[static_cast<int>(which)], chr.value.data(), chr.value.size(),
+                                        multiNotify_)) {
+    std::cerr << "Failed to send telemetry notification" << std::endl;
+    return;
+  }
+  notified();
+}
+
+void BleServer::setTelemetryWindow(unsigned int ms) {
+  telemetryWindowMs_ = ms;
+  if (ms) {
+    bt_gatt_server_set_nfy_mult_window(gatt_, ms);
+  }
+}
+
+void BleServer::telemetryReadResponse(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  int i = telemetryIndex(gatt_db_attribute_get_handle(attrib), 0);
+  if (i < 0) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_UNLIKELY, nullptr, 0);
+    return;
+  }
+  TelemetryChar &chr = telemetry_[i];
+  if (offset > chr.value.size()) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+    return;
+  }
+  gatt_db_attribute_read_result(attrib, id, 0, chr.value.data() + offset, chr.value.size() - offset);
+}
+
+void BleServer::telemetryCccRead(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  int i = telemetryIndex(gatt_db_attribute_get_handle(attrib), 1);
+  if (i < 0) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_UNLIKELY, nullptr, 0);
+    return;
+  }
+  uint8_t value[2];
+  put_le16(telemetry_[i].cccValue, value);
+  if (offset > sizeof(value)) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+    return;
+  }
+  gatt_db_attribute_read_result(attrib, id, 0, value + offset, sizeof(value) - offset);
+}
+
+void BleServer::telemetryCccWrite(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                    const uint8_t *value, size_t len) {
+  int i = telemetryIndex(gatt_db_attribute_get_handle(attrib), 1);
+  if (i < 0) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_UNLIKELY);
+    return;
+  }
+  if (offset || len != 2) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+    return;
+  }
+  telemetry_[i].cccValue = get_le16(value);
+  gatt_db_attribute_write_result(attrib, id, 0);
+  saveClientState();
+}
+
+int BleServer::journalStream(const std::string &msg, std::vector<uint8_t> *payload) {
+  rapidjson::Document doc;
+  doc.Parse(msg.c_str());
+  if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("topic") || !doc["topic"].IsString() ||
+      !doc.HasMember("data") || !doc["data"].IsString()) {
+    return -1;
+  }
+
+  // responses answer a request of the previous connection, only events are kept
+  std::string topic(doc["topic"].GetString());
+  std::string data(doc["data"].GetString());
+  int stream = -1;
+  if (topic == "notification") {
+    stream = kJournalNotifyStream;
+  } else if (topic == "telemetry" && doc.HasMember("name") && doc["name"].IsString()) {
+    std::string name(doc["name"].GetString());
+    for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+      if (name == kTelemetryChars[i].name) {
+        stream = kJournalNotifyStream + 1 + i;
+        break;
+      }
+    }
+  }
+
+  if (stream >= 0) {
+    payload->assign(data.begin(), data.end());
+  }
+  return stream;
+}
+
+void BleServer::pumpJournal() {
+  if (!journal_ || !(journalCccValue_ & 0x0001)) {
+    return;
+  }
+
+  // handle, stream and seq followed by as much of the record as the current mtu allows,
+  // a record that does not fit is carried on over further notifications
+  uint8_t pdu[2 + kJournalRecordHeader + OutboundJournal::kMaxPayload];
+  size_t maxLen = bt_att_get_mtu(att_) - 3 - kJournalRecordHeader;
+  while (journalInFlight_ < kJournalWindow) {
+    if (!journalPartial_) {
+      if (!journal_->read(&journalCursor_, &journalRecord_)) {
+        return;
+      }
+      journalOffset_ = 0;
+    }
+    size_t len = std::min(maxLen, journalRecord_.data.size() - journalOffset_);
+    bool more = journalOffset_ + len < journalRecord_.data.size();
+    put_le16(kJournalHandle, pdu);
+    put_le16(journalRecord_.stream | (more ? kJournalMoreFragments : 0), pdu + 2);
+    put_le32(journalRecord_.seq, pdu + 4);
+    memcpy(pdu + 2 + kJournalRecordHeader, journalRecord_.data.data() + journalOffset_, len);
+    if (!bt_att_send(att_, BT_ATT_OP_HANDLE_NFY, pdu, 2 + kJournalRecordHeader + len,
+                     NULL, this, onJournalSentCallback)) {
+      // picked up again from this fragment by the next pump
+      journalPartial_ = true;
+      std::cerr << "Failed to send journal record" << std::endl;
+      return;
+    }
+    journalOffset_ += len;
+    journalPartial_ = more;
+    ++journalInFlight_;
+    notified();
+  }
+}
+
+bool BleServer::bondedIdentity(RpaIdentity *identity) {
+  return bondStore_ && bondStore_->identify(peerAddr_, peerType_, identity);
+}
+
+void BleServer::restoreClientState() {
+  // only a bonded peer is known to be the same client again, whatever address it uses
+  RpaIdentity identity;
+  CccStore::Peer peer;
+  if (!cccStore_ || !bondedIdentity(&identity) || !cccStore_->load(identity.addr, identity.type, &peer)) {
+    return;
+  }
+
+  for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+    telemetry_[i].cccValue = peer.ccc[i];
+  }
+  journalCccValue_ = peer.ccc[kJournalCccSlot];
+  cliFeatures_ = peer.features & kCliFeatSupported;
+  setMultiNotifySupported(cliFeatures_ & BT_GATT_CHRC_CLI_FEAT_NFY_MULTI);
+  // a database changed since the client last saw it leaves it change-unaware
+  const uint8_t *hash = gatt_db_get_hash(db_);
+  changeAware_ = hash && !memcmp(peer.hash, hash, sizeof(peer.hash));
+  outOfSyncSent_ = false;
+  cccRestored_ = true;
+  std::cout << "restored subscriptions of bonded peer" << (changeAware_ ? "" : ", change-unaware") << std::endl;
+
+  // the indication for what changed while it was away is still owed, and since what changed is
+  // not known any more it covers the whole database; its confirmation makes the client aware
+  if (!changeAware_) {
+    if (changedRanges_.empty()) {
+      uint64_t one = 1;
+      write(svcUpdatefd_, &one, sizeof(one));
+    }
+    changedRanges_.emplace_back(0x0001, 0xffff);
+  }
+
+  // a subscribed journal replays without waiting for the client to ask again
+  if (journalCccValue_ & 0x0001) {
+    journalCursor_ = 0;
+    journalPartial_ = false;
+    pumpJournal();
+  }
+}
+
+void BleServer::saveClientState() {
+  // a peer that pairs on this connection is picked up by the first write after it did
+  RpaIdentity identity;
+  if (!cccStore_ || !bondedIdentity(&identity)) {
+    return;
+  }
+
+  CccStore::Peer peer = {};
+  peer.features = cliFeatures_;
+  for (int i = 0; i < static_cast<int>(Telemetry::Count); ++i) {
+    peer.ccc[i] = telemetry_[i].cccValue;
+  }
+  peer.ccc[kJournalCccSlot] = journalCccValue_;
+  const uint8_t *hash = changeAware_ ? gatt_db_get_hash(db_) : nullptr;
+  if (hash) {
+    memcpy(peer.hash, hash, sizeof(peer.hash));
+  }
+  cccStore_->store(identity.addr, identity.type, peer);
+}
+
+void BleServer::notified() {
+  if (firstNotifyUs_ >= 0) {
+    return;
+  }
+  firstNotifyUs_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - acceptTime_).count();
+  std::cout << "first notification " << firstNotifyUs_ / 1000.0 << " ms after accept"
+            << (cccRestored_ ? ", subscriptions restored" : "") << std::endl;
+}
+
+void BleServer::journalSent() {
+  --journalInFlight_;
+  pumpJournal();
+}
+
+void BleServer::journalCccRead(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  uint8_t value[2];
+  put_le16(journalCccValue_, value);
+  if (offset > sizeof(value)) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+    return;
+  }
+  gatt_db_attribute_read_result(attrib, id, 0, value + offset, sizeof(value) - offset);
+}
+
+void BleServer::journalCccWrite(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                    const uint8_t *value, size_t len) {
+  if (offset || len != 2) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+    return;
+  }
+  uint16_t ccc = get_le16(value);
+  bool enable = (ccc & 0x0001) && !(journalCccValue_ & 0x0001);
+  journalCccValue_ = ccc;
+  gatt_db_attribute_write_result(attrib, id, 0);
+  saveClientState();
+
+  // every enable replays from the oldest record not acked yet
+  if (enable) {
+    journalCursor_ = 0;
+    journalPartial_ = false;
+    std::cout << "replay " << (journal_ ? journal_->pending() : 0) << " journal records" << std::endl;
+    pumpJournal();
+  }
+}
+
+void BleServer::journalAck(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                    const uint8_t *value, size_t len) {
+  // stream and the highest seq the client has, it drops anything at or below it
+  if (offset || len != kJournalRecordHeader) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+    return;
+  }
+  if (journal_) {
+    journal_->ack(get_le16(value), get_le32(value + 2));
+  }
+  gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+uint16_t BleServer::advertisedService() {
+  return gatt::advertisedUuids<kSchema>()[0];
+}
+
+uint16_t BleServer::valueHandle(uint16_t service, uint16_t characteristic) {
+  return kSchema.valueHandle(service, characteristic);
+}
+
+std::string BleServer::getDeviceName() {
+  std::lock_guard<std::mutex> guard(serviceMutex_);
+  return deviceName_;
+}
+
+bool BleServer::setStaticValue(uint16_t handle, std::vector<uint8_t> value) {
+  if (!kSchema.isStatic(handle)) {
+    std::cerr << "handle 0x" << std::hex << handle << std::dec << " has no static value" << std::endl;
+    return false;
+  }
+  if (value.size() > BT_ATT_MAX_VALUE_LEN) {
+    std::cerr << "value of " << value.size() << " bytes too long for handle 0x" << std::hex << handle << std::dec
+              << std::endl;
+    return false;
+  }
+
+  // reads never block on us, so swapping the buffer on the mainloop is all it takes
+  updateServices([handle, value](gatt_db *db) {
+    gatt_db_attribute_set_value(gatt_db_get_attribute(db, handle), value.data(), value.size());
+  });
+  return true;
+}
+
+void BleServer::setDeviceName(const std::string &name) {
+  {
+    std::lock_guard<std::mutex> guard(serviceMutex_);
+    deviceName_ = name;
+  }
+  setStaticValue(kDeviceNameHandle, name);
+}
+
+void BleServer::deviceNameWrite(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                    const uint8_t *value, size_t len) {
+  std::cout << "GAP Device Name Write called" << std::endl;
+  gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+void BleServer::svcChangedRead(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  std::cout << "Service Changed Read called" << std::endl;
+  gatt_db_attribute_read_result(attrib, id, 0, nullptr, 0);
+}
+
 void BleServer::transReadResponse(gatt_db_attribute *attrib, unsigned int id, uint16_t offset)
 {
   if (response_.empty()) {
@@ -423,89 +902,153 @@ void BleServer::transWriteResponse(gatt_db_attribute *attrib, unsigned int id, u
 }
 
 void BleServer::svcChanged() {
+  if (changedRanges_.empty()) {
+    return;
+  }
+
+  // merge overlapping and adjacent ranges, a range covering untouched
+  // services in between would make the client rediscover those too
+  std::vector<std::pair<uint16_t, uint16_t>> ranges;
+  ranges.swap(changedRanges_);
+  std::sort(ranges.begin(), ranges.end());
+  size_t count = 0;
+  for (auto &range : ranges) {
+    if (count && range.first <= ranges[count - 1].second + 1) {
+      ranges[count - 1].second = std::max(ranges[count - 1].second, range.second);
+    } else {
+      ranges[count++] = range;
+    }
+  }
+  ranges.resize(count);
+
+  for (auto &range : ranges) {
+    uint8_t value[4];
+    put_le16(range.first, value);
+    put_le16(range.second, value + 2);
+    std::cout << "service changed 0x" << std::hex << range.first << "-0x" << range.second
+              << std::dec << std::endl;
+    bt_gatt_server_send_indication(gatt_, kSvcChangedHandle, value, sizeof(value), onConfCallback, this, NULL);
+  }
+}
+
+void BleServer::updateServices(std::function<void(gatt_db *db)> update) {
+  bool wake;
+  {
+    std::lock_guard<std::mutex> guard(serviceMutex_);
+    wake = fifoServiceUpdates_.empty();
+    fifoServiceUpdates_.push_back(std::move(update));
+  }
+
+  if (wake) {
+    uint64_t one = 1;
+    write(svcUpdatefd_, &one, sizeof(one));
+  }
+}
+
+void BleServer::processServiceUpdates() {
+  std::vector<std::function<void(gatt_db *db)>> updates;
+  {
+    std::lock_guard<std::mutex> guard(serviceMutex_);
+    updates.swap(fifoServiceUpdates_);
+  }
+
+  for (auto &update : updates) {
+    update(db_);
+  }
+  svcChanged();
+}
+
+uint8_t BleServer::authorize(uint8_t opcode, uint16_t handle) {
+  // clients without robust caching are left to the service changed indication
+  if (changeAware_ || !(cliFeatures_ & BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING)) {
+    return 0;
+  }
+
+  // the request after the error means the client knows and is aware again
+  if (outOfSyncSent_) {
+    changeAware_ = true;
+    outOfSyncSent_ = false;
+    saveClientState();
+    return 0;
+  }
+
+  std::cout << "client is change-unaware, handle " << handle << " out of sync" << std::endl;
+  outOfSyncSent_ = true;
+  return BT_ATT_ERROR_DB_OUT_OF_SYNC;
+}
+
+void BleServer::svcChangedConfirmed() {
+  changeAware_ = true;
+  outOfSyncSent_ = false;
+  saveClientState();
+}
+
+void BleServer::dbChanged(gatt_db_attribute *attrib) {
+  changeAware_ = false;
+  outOfSyncSent_ = false;
+  // a client that disconnects now must come back change-unaware
+  saveClientState();
+
   uint16_t start, end;
-	uint8_t value[4];
-  // if (!gatt_db_attribute_get_service_handles(svcChngd_, &start, &end)) {
-	// 	std::cerr << "Failed to obtain changed service handles";
-	// 	return;
-	// }
-  start = 0x0001;
-  end = 0xffff;
-
-  uint16_t handle = gatt_db_attribute_get_handle(svcChngd_);
-  if (!handle) {
-		std::cerr << "Failed to obtain handles for characteristic" << std::endl;
-		return;
-	}
+  if (!gatt_db_attribute_get_service_handles(attrib, &start, &end)) {
+    return;
+  }
 
-	put_le16(start, value);
-	put_le16(end, value + 2);
-
-  bt_gatt_server_send_indication(gatt_, handle, value, 4, onConfCallback, NULL, NULL);
-}
-
-void BleServer::populateGapService() {
-  bt_uuid_t uuid;
-
-  /* Add the GAP service */
-  bt_uuid16_create(&uuid, UUID_GAP);
-  auto svc = gatt_db_add_service(db_, &uuid, true, 6);
-  // add Device Name characteristic
-  bt_uuid16_create(&uuid, GATT_CHARAC_DEVICE_NAME);
-  gatt_db_service_add_characteristic(svc, &uuid,
-          BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-          BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_EXT_PROP,
-          onGapDeviceNameReadCallback,
-          onGapDeviceNameWriteCallback,
-          this);
-
-  bt_uuid16_create(&uuid, GATT_CHARAC_EXT_PROPER_UUID);
-	gatt_db_service_add_descriptor(svc, &uuid, 
-          BT_ATT_PERM_READ,
-					onGapDeviceNameExtPropReadCallback,
-					NULL,
-          this);
-  gatt_db_service_set_active(svc, true);
-  std::cout << "GAP service init!" << std::endl;
-}
-
-void BleServer::populateGattService() {
-  bt_uuid_t uuid;
-  /* Add the GATT service */
-	bt_uuid16_create(&uuid, UUID_GATT);
-	auto svc = gatt_db_add_service(db_, &uuid, true, 4);
-
-	bt_uuid16_create(&uuid, GATT_CHARAC_SERVICE_CHANGED);
-	svcChngd_ = gatt_db_service_add_characteristic(svc, &uuid,
-	        BT_ATT_PERM_READ,
-			    BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_INDICATE,
-			    onGattServiceChangedCallback,
-			    NULL, this);
-	gattSvcChngdHandle_ = gatt_db_attribute_get_handle(svcChngd_);
-
-	gatt_db_service_set_active(svc, true);
-
-  /* add Device Information service */
-  bt_uuid16_create(&uuid, 0x180a);
-  svc = gatt_db_add_service(db_, &uuid, true, 4);
-  gatt_db_service_set_active(svc, true);
-
-  std::cout << "GATT service init!" << std::endl;
-}
-
-void BleServer::populateCustomService() {
-  bt_uuid_t uuid;
-  /* add test service */ 
-  bt_uuid16_create(&uuid, 0x0a0a);
-  auto svc = gatt_db_add_service(db_, &uuid, true, 4);
-
-  // add trans characteristic
-  bt_uuid16_create(&uuid, 0x0001);
-  attrib_ = gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
-                  BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_NOTIFY, onTransReadCallback, onTransWriteCallback, this);
-  handle_ = gatt_db_attribute_get_handle(attrib_);
-
-  gatt_db_service_set_active(svc, true);
-  std::cout << "test service init!" << std::endl;
+  // changes made together on the mainloop are indicated once it gets back to us
+  if (changedRanges_.empty()) {
+    uint64_t one = 1;
+    write(svcUpdatefd_, &one, sizeof(one));
+  }
+  changedRanges_.emplace_back(start, end);
+}
+
+void BleServer::dbHashRead(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  const uint8_t *hash = gatt_db_get_hash(db_);
+  if (!hash) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_UNLIKELY, nullptr, 0);
+    return;
+  }
+  if (offset > 16) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+    return;
+  }
+
+  // a client that has read the current hash knows the database it talks to
+  changeAware_ = true;
+  outOfSyncSent_ = false;
+  gatt_db_attribute_read_result(attrib, id, 0, hash + offset, 16 - offset);
+  saveClientState();
+}
+
+void BleServer::cliFeatRead(gatt_db_attribute *attrib, unsigned int id, uint16_t offset) {
+  if (offset > sizeof(cliFeatures_)) {
+    gatt_db_attribute_read_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+    return;
+  }
+  gatt_db_attribute_read_result(attrib, id, 0, &cliFeatures_ + offset, sizeof(cliFeatures_) - offset);
+}
+
+void BleServer::cliFeatWrite(gatt_db_attribute *attrib, unsigned int id, uint16_t offset,
+                    const uint8_t *value, size_t len) {
+  if (offset) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_OFFSET);
+    return;
+  }
+  if (!len) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+    return;
+  }
+
+  // features can only be enabled, and octets past the first are reserved
+  uint8_t features = value[0] & kCliFeatSupported;
+  if (cliFeatures_ & ~features) {
+    gatt_db_attribute_write_result(attrib, id, BT_ATT_ERROR_VALUE_NOT_ALLOWED);
+    return;
+  }
+
+  cliFeatures_ = features;
+  setMultiNotifySupported(features & BT_GATT_CHRC_CLI_FEAT_NFY_MULTI);
+  gatt_db_attribute_write_result(attrib, id, 0);
+  saveClientState();
 }
 
@@ -0,0 +1,424 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  In-process AES-128 and AES-CMAC primitives
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "bluez/aes.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(BT_AES_NO_HW)
+#define HAVE_AESNI 1
+#include <wmmintrin.h>
+#endif
+
+/*
+ * Portable implementation
+ *
+ * No secret dependent table lookups or branches are used. SubBytes is
+ * computed algebraically (inversion in GF(2^8) as x^254 followed by the
+ * affine transform) on eight bytes at a time packed into a 64-bit word,
+ * so timing does not depend on the key or the data.
+ */
+
+#define BYTES_01	0x0101010101010101ULL
+#define BYTES_7F	0x7f7f7f7f7f7f7f7fULL
+
+static inline uint64_t xtime64(uint64_t x)
+{
+	return ((x & BYTES_7F) << 1) ^ (((x >> 7) & BYTES_01) * 0x1b);
+}
+
+static inline uint64_t gmul64(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r ^= a & (((b >> i) & BYTES_01) * 0xff);
+		a = xtime64(a);
+	}
+
+	return r;
+}
+
+static inline uint64_t rotl8x8(uint64_t x, int n)
+{
+	uint64_t hi = ((0xffu << n) & 0xff) * BYTES_01;
+	uint64_t lo = (0xffu >> (8 - n)) * BYTES_01;
+
+	return ((x << n) & hi) | ((x >> (8 - n)) & lo);
+}
+
+static uint64_t sub_bytes64(uint64_t x)
+{
+	uint64_t x2, x3, x12, x15, x240, inv;
+
+	/* x^254 == x^-1 (and 0 for 0) */
+	x2 = gmul64(x, x);
+	x3 = gmul64(x2, x);
+	x12 = gmul64(x3, x3);
+	x12 = gmul64(x12, x12);
+	x15 = gmul64(x12, x3);
+	x240 = gmul64(x15, x15);
+	x240 = gmul64(x240, x240);
+	x240 = gmul64(x240, x240);
+	x240 = gmul64(x240, x240);
+	inv = gmul64(gmul64(x240, x12), x2);
+
+	return inv ^ rotl8x8(inv, 1) ^ rotl8x8(inv, 2) ^ rotl8x8(inv, 3) ^
+				rotl8x8(inv, 4) ^ (0x63 * BYTES_01);
+}
+
+static void sub_bytes(uint8_t s[16])
+{
+	uint64_t a, b;
+
+	memcpy(&a, s, 8);
+	memcpy(&b, s + 8, 8);
+
+	a = sub_bytes64(a);
+	b = sub_bytes64(b);
+
+	memcpy(s, &a, 8);
+	memcpy(s + 8, &b, 8);
+}
+
+static void shift_rows(uint8_t s[16])
+{
+	uint8_t t;
+
+	t = s[1]; s[1] = s[5]; s[5] = s[9]; s[9] = s[13]; s[13] = t;
+	t = s[2]; s[2] = s[10]; s[10] = t;
+	t = s[6]; s[6] = s[14]; s[14] = t;
+	t = s[15]; s[15] = s[11]; s[11] = s[7]; s[7] = s[3]; s[3] = t;
+}
+
+static inline uint8_t xtime8(uint8_t x)
+{
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void mix_columns(uint8_t s[16])
+{
+	int c;
+
+	for (c = 0; c < 16; c += 4) {
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+		uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+		s[c] = a0 ^ all ^ xtime8(a0 ^ a1);
+		s[c + 1] = a1 ^ all ^ xtime8(a1 ^ a2);
+		s[c + 2] = a2 ^ all ^ xtime8(a2 ^ a3);
+		s[c + 3] = a3 ^ all ^ xtime8(a3 ^ a0);
+	}
+}
+
+static inline void xor_block(uint8_t *r, const uint8_t *a, const uint8_t *b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		r[i] = a[i] ^ b[i];
+}
+
+static void soft_set_key(struct bt_aes128 *ctx, const uint8_t key[16])
+{
+	uint8_t *w = &ctx->rk[0][0];
+	uint8_t rcon = 0x01;
+	int i, j;
+
+	memcpy(w, key, 16);
+
+	for (i = 16; i < 176; i += 16) {
+		uint64_t t = 0;
+
+		/* SubWord(RotWord(w[i - 1])) */
+		memcpy(&t, w + i - 3, 3);
+		memcpy((uint8_t *) &t + 3, w + i - 4, 1);
+		t = sub_bytes64(t);
+		memcpy(w + i, &t, 4);
+		w[i] ^= rcon;
+		rcon = xtime8(rcon);
+
+		for (j = 0; j < 4; j++)
+			w[i + j] ^= w[i + j - 16];
+
+		for (j = 4; j < 16; j++)
+			w[i + j] = w[i + j - 4] ^ w[i + j - 16];
+	}
+}
+
+static void soft_encrypt(const struct bt_aes128 *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint8_t s[16];
+	int round;
+
+	xor_block(s, in, ctx->rk[0]);
+
+	for (round = 1; round < 10; round++) {
+		sub_bytes(s);
+		shift_rows(s);
+		mix_columns(s);
+		xor_block(s, s, ctx->rk[round]);
+	}
+
+	sub_bytes(s);
+	shift_rows(s);
+	xor_block(out, s, ctx->rk[10]);
+}
+
+#ifdef HAVE_AESNI
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+static AESNI_TARGET inline __m128i aesni_expand(__m128i key, __m128i kg)
+{
+	kg = _mm_shuffle_epi32(kg, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+	return _mm_xor_si128(key, kg);
+}
+
+#define AESNI_ROUND_KEY(n, rcon) \
+	k = aesni_expand(k, _mm_aeskeygenassist_si128(k, rcon)); \
+	_mm_storeu_si128((__m128i *) ctx->rk[n], k)
+
+static AESNI_TARGET void aesni_set_key(struct bt_aes128 *ctx,
+						const uint8_t key[16])
+{
+	__m128i k = _mm_loadu_si128((const __m128i *) key);
+
+	_mm_storeu_si128((__m128i *) ctx->rk[0], k);
+	AESNI_ROUND_KEY(1, 0x01);
+	AESNI_ROUND_KEY(2, 0x02);
+	AESNI_ROUND_KEY(3, 0x04);
+	AESNI_ROUND_KEY(4, 0x08);
+	AESNI_ROUND_KEY(5, 0x10);
+	AESNI_ROUND_KEY(6, 0x20);
+	AESNI_ROUND_KEY(7, 0x40);
+	AESNI_ROUND_KEY(8, 0x80);
+	AESNI_ROUND_KEY(9, 0x1b);
+	AESNI_ROUND_KEY(10, 0x36);
+}
+
+static AESNI_TARGET void aesni_encrypt(const struct bt_aes128 *ctx,
+					const uint8_t in[16], uint8_t out[16])
+{
+	__m128i s = _mm_loadu_si128((const __m128i *) in);
+	int round;
+
+	s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *) ctx->rk[0]));
+
+	for (round = 1; round < 10; round++)
+		s = _mm_aesenc_si128(s,
+			_mm_loadu_si128((const __m128i *) ctx->rk[round]));
+
+	s = _mm_aesenclast_si128(s,
+			_mm_loadu_si128((const __m128i *) ctx->rk[10]));
+
+	_mm_storeu_si128((__m128i *) out, s);
+}
+
+/*
+ * Four independent blocks are kept in flight so the AESENC latency is
+ * hidden; a single block chain only uses a fraction of the unit.
+ */
+static AESNI_TARGET void aesni_encrypt_blocks(const struct bt_aes128 *ctx,
+					const uint8_t *in, uint8_t *out,
+					size_t n)
+{
+	__m128i rk[11];
+	int round;
+
+	for (round = 0; round < 11; round++)
+		rk[round] = _mm_loadu_si128((const __m128i *) ctx->rk[round]);
+
+	for (; n >= 4; n -= 4, in += 64, out += 64) {
+		__m128i s0 = _mm_loadu_si128((const __m128i *) in);
+		__m128i s1 = _mm_loadu_si128((const __m128i *) (in + 16));
+		__m128i s2 = _mm_loadu_si128((const __m128i *) (in + 32));
+		__m128i s3 = _mm_loadu_si128((const __m128i *) (in + 48));
+
+		s0 = _mm_xor_si128(s0, rk[0]);
+		s1 = _mm_xor_si128(s1, rk[0]);
+		s2 = _mm_xor_si128(s2, rk[0]);
+		s3 = _mm_xor_si128(s3, rk[0]);
+
+		for (round = 1; round < 10; round++) {
+			s0 = _mm_aesenc_si128(s0, rk[round]);
+			s1 = _mm_aesenc_si128(s1, rk[round]);
+			s2 = _mm_aesenc_si128(s2, rk[round]);
+			s3 = _mm_aesenc_si128(s3, rk[round]);
+		}
+
+		_mm_storeu_si128((__m128i *) out,
+					_mm_aesenclast_si128(s0, rk[10]));
+		_mm_storeu_si128((__m128i *) (out + 16),
+					_mm_aesenclast_si128(s1, rk[10]));
+		_mm_storeu_si128((__m128i *) (out + 32),
+					_mm_aesenclast_si128(s2, rk[10]));
+		_mm_storeu_si128((__m128i *) (out + 48),
+					_mm_aesenclast_si128(s3, rk[10]));
+	}
+
+	for (; n; n--, in += 16, out += 16)
+		aesni_encrypt(ctx, in, out);
+}
+
+bool bt_aes_has_hw(void)
+{
+	static int aesni = -1;
+
+	if (aesni < 0) {
+		__builtin_cpu_init();
+		aesni = __builtin_cpu_supports("aes") &&
+					__builtin_cpu_supports("sse2");
+	}
+
+	return aesni;
+}
+
+#else
+
+bool bt_aes_has_hw(void)
+{
+	return false;
+}
+
+#endif
+
+void bt_aes128_set_key(struct bt_aes128 *ctx, const uint8_t key[16])
+{
+#ifdef HAVE_AESNI
+	if (bt_aes_has_hw()) {
+		aesni_set_key(ctx, key);
+		return;
+	}
+#endif
+	soft_set_key(ctx, key);
+}
+
+void bt_aes128_encrypt(const struct bt_aes128 *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+#ifdef HAVE_AESNI
+	if (bt_aes_has_hw()) {
+		aesni_encrypt(ctx, in, out);
+		return;
+	}
+#endif
+	soft_encrypt(ctx, in, out);
+}
+
+void bt_aes128_encrypt_blocks(const struct bt_aes128 *ctx, const uint8_t *in,
+						uint8_t *out, size_t n)
+{
+#ifdef HAVE_AESNI
+	if (bt_aes_has_hw()) {
+		aesni_encrypt_blocks(ctx, in, out, n);
+		return;
+	}
+#endif
+	for (; n; n--, in += 16, out += 16)
+		soft_encrypt(ctx, in, out);
+}
+
+void bt_aes128_clear(struct bt_aes128 *ctx)
+{
+	explicit_bzero(ctx, sizeof(*ctx));
+}
+
+/* Doubling in GF(2^128) as used for the CMAC subkeys (RFC 4493 2.3) */
+static void cmac_dbl(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t msb = in[0] >> 7;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	out[15] = (in[15] << 1) ^ (0x87 & -msb);
+}
+
+void bt_aes_cmac_init(struct bt_aes_cmac *ctx, const uint8_t key[16])
+{
+	uint8_t l[16];
+
+	bt_aes128_set_key(&ctx->aes, key);
+
+	memset(l, 0, sizeof(l));
+	bt_aes128_encrypt(&ctx->aes, l, l);
+	cmac_dbl(l, ctx->k1);
+	cmac_dbl(ctx->k1, ctx->k2);
+	explicit_bzero(l, sizeof(l));
+
+	memset(ctx->x, 0, sizeof(ctx->x));
+	ctx->buf_len = 0;
+}
+
+void bt_aes_cmac_update(struct bt_aes_cmac *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len) {
+		size_t n;
+
+		/*
+		 * The last block is only processed in final() since it needs
+		 * to be combined with a subkey, so a full buffer is flushed
+		 * only once more data arrives.
+		 */
+		if (ctx->buf_len == 16) {
+			xor_block(ctx->x, ctx->x, ctx->buf);
+			bt_aes128_encrypt(&ctx->aes, ctx->x, ctx->x);
+			ctx->buf_len = 0;
+		}
+
+		n = 16 - ctx->buf_len;
+		if (n > len)
+			n = len;
+
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+void bt_aes_cmac_final(struct bt_aes_cmac *ctx, uint8_t mac[16])
+{
+	if (ctx->buf_len == 16) {
+		xor_block(ctx->x, ctx->x, ctx->k1);
+	} else {
+		ctx->buf[ctx->buf_len] = 0x80;
+		memset(ctx->buf + ctx->buf_len + 1, 0, 15 - ctx->buf_len);
+		xor_block(ctx->x, ctx->x, ctx->k2);
+	}
+
+	xor_block(ctx->x, ctx->x, ctx->buf);
+	bt_aes128_encrypt(&ctx->aes, ctx->x, mac);
+
+	explicit_bzero(ctx, sizeof(*ctx));
+}
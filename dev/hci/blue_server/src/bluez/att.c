@@ -25,9 +25,14 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "bluez/io.h"
 #include "bluez/queue.h"
@@ -39,6 +44,14 @@
 #include "bluez/att.h"
 #include "bluez/crypto.h"
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #define ATT_MIN_PDU_LEN			1  /* At least 1 byte for the opcode. */
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
@@ -47,14 +60,43 @@
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
+/* Caller buffers a referenced send op can carry, see bt_att_sendv_ref() */
+#define ATT_OP_MAX_IOV			4
+/* Opcode plus small leading fields (e.g. the handle) copied into the op */
+#define ATT_OP_HDR_LEN			8
+
+/*
+ * PDU buffers are recycled in power of two size classes from 32 up to 1024
+ * bytes, which covers any LE MTU. Longer PDUs are malloc'ed as before.
+ */
+#define ATT_PDU_CLASS_SHIFT		5
+#define ATT_PDU_CLASSES			6
+/* Free objects kept per pool, the rest go back to the allocator */
+#define ATT_POOL_MAX_FREE		128
+
+/* PDUs read per recvmmsg() call and per read wakeup */
+#define ATT_RX_BATCH			8
+#define ATT_RX_BUDGET			32
+
+/* PDUs written per sendmmsg() call and per write wakeup */
+#define ATT_TX_BATCH			16
+#define ATT_TX_BUDGET			64
+
 struct att_send_op;
 
+struct att_pool {
+	void *free;			/* Singly linked through first word */
+	unsigned int count;
+};
+
 struct bt_att_chan {
 	struct bt_att *att;
 	int fd;
 	struct io *io;
 	uint8_t type;
 	int sec_level;			/* Only used for non-L2CAP */
+	int sec_cache;			/* BT_SECURITY level, -1 to re-read */
+	uint8_t enc_size;		/* BT_SECURITY key size */
 
 	struct queue *queue;		/* Channel dedicated queue */
 
@@ -64,8 +106,10 @@ struct bt_att_chan {
 
 	bool in_req;			/* There's a pending incoming request */
 
-	uint8_t *buf;
+	uint8_t *buf;			/* ATT_RX_BATCH slots of buf_mtu */
+	uint16_t buf_mtu;
 	uint16_t mtu;
+	bool no_mmsg;			/* fd does not take recv/sendmmsg() */
 };
 
 struct bt_att {
@@ -76,14 +120,28 @@ struct bt_att {
 	uint16_t mtu;			/* Biggest possible MTU */
 
 	struct queue *notify_list;	/* List of registered callbacks */
+	struct queue *notify_index[256];	/* notify_list by opcode */
 	struct queue *disconn_list;	/* List of disconnect handlers */
 
 	unsigned int next_send_id;	/* IDs for "send" ops */
 	unsigned int next_reg_id;	/* IDs for registered callbacks */
 
-	struct queue *req_queue;	/* Queued ATT protocol requests */
-	struct queue *ind_queue;	/* Queued ATT protocol indications */
-	struct queue *write_queue;	/* Queue of PDUs ready to send */
+	/* One set of queues per enum bt_att_prio */
+	struct queue *req_queue[BT_ATT_PRIO_COUNT];	/* Queued ATT protocol
+							 * requests
+							 */
+	struct queue *ind_queue[BT_ATT_PRIO_COUNT];	/* Queued ATT protocol
+							 * indications
+							 */
+	struct queue *write_queue[BT_ATT_PRIO_COUNT];	/* Queue of PDUs ready
+							 * to send
+							 */
+	struct queue *latest_ops;	/* Unwritten ops with a key */
+
+	uint8_t opcode_prio[256];
+	unsigned int quantum[BT_ATT_PRIO_COUNT];	/* PDUs per turn */
+	unsigned int drr_prio;		/* Class being served */
+	unsigned int drr_credit;	/* PDUs it may still send this turn */
 
 	bt_att_timeout_func_t timeout_callback;
 	bt_att_destroy_func_t timeout_destroy;
@@ -97,6 +155,11 @@ struct bt_att {
 
 	struct sign_info *local_sign;
 	struct sign_info *remote_sign;
+
+	struct att_pool op_pool;	/* Recycled struct att_send_op */
+	struct att_pool pdu_pool[ATT_PDU_CLASSES];
+
+	struct bt_att_stats stats;
 };
 
 struct sign_info {
@@ -106,96 +169,121 @@ struct sign_info {
 };
 
 enum att_op_type {
+	ATT_OP_TYPE_UNKNOWN,	/* Zero, so unlisted opcodes are unknown */
 	ATT_OP_TYPE_REQ,
 	ATT_OP_TYPE_RSP,
 	ATT_OP_TYPE_CMD,
 	ATT_OP_TYPE_IND,
 	ATT_OP_TYPE_NFY,
 	ATT_OP_TYPE_CONF,
-	ATT_OP_TYPE_UNKNOWN,
 };
 
-static const struct {
-	uint8_t opcode;
-	enum att_op_type type;
-} att_opcode_type_table[] = {
-	{ BT_ATT_OP_ERROR_RSP,			ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_MTU_REQ,			ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_MTU_RSP,			ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_FIND_INFO_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_FIND_INFO_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_FIND_BY_TYPE_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_FIND_BY_TYPE_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_READ_BY_TYPE_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_READ_BY_TYPE_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_READ_REQ,			ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_READ_RSP,			ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_READ_BLOB_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_READ_BLOB_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_READ_MULT_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_READ_MULT_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_READ_BY_GRP_TYPE_RSP,	ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_WRITE_REQ,			ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_WRITE_RSP,			ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_WRITE_CMD,			ATT_OP_TYPE_CMD },
-	{ BT_ATT_OP_SIGNED_WRITE_CMD,		ATT_OP_TYPE_CMD },
-	{ BT_ATT_OP_PREP_WRITE_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_PREP_WRITE_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_EXEC_WRITE_REQ,		ATT_OP_TYPE_REQ },
-	{ BT_ATT_OP_EXEC_WRITE_RSP,		ATT_OP_TYPE_RSP },
-	{ BT_ATT_OP_HANDLE_NFY,			ATT_OP_TYPE_NFY },
-	{ BT_ATT_OP_HANDLE_NFY_MULT,		ATT_OP_TYPE_NFY },
-	{ BT_ATT_OP_HANDLE_IND,			ATT_OP_TYPE_IND },
-	{ BT_ATT_OP_HANDLE_CONF,		ATT_OP_TYPE_CONF },
-	{ }
+/* Indexed by opcode, every PDU sent and received is looked up here */
+static const uint8_t att_opcode_type_table[256] = {
+	[BT_ATT_OP_ERROR_RSP]			= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_MTU_REQ]			= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_MTU_RSP]			= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_FIND_INFO_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_FIND_INFO_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_FIND_BY_TYPE_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_FIND_BY_TYPE_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_READ_BY_TYPE_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_READ_BY_TYPE_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_READ_REQ]			= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_READ_RSP]			= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_READ_BLOB_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_READ_BLOB_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_READ_MULT_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_READ_MULT_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_READ_BY_GRP_TYPE_REQ]	= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_READ_BY_GRP_TYPE_RSP]	= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_WRITE_REQ]			= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_WRITE_RSP]			= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_PREP_WRITE_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_PREP_WRITE_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_EXEC_WRITE_REQ]		= ATT_OP_TYPE_REQ,
+	[BT_ATT_OP_EXEC_WRITE_RSP]		= ATT_OP_TYPE_RSP,
+	[BT_ATT_OP_HANDLE_NFY]			= ATT_OP_TYPE_NFY,
+	[BT_ATT_OP_HANDLE_NFY_MULT]		= ATT_OP_TYPE_NFY,
+	[BT_ATT_OP_HANDLE_IND]			= ATT_OP_TYPE_IND,
+	[BT_ATT_OP_HANDLE_CONF]			= ATT_OP_TYPE_CONF,
+	/*
+	 * Any opcode with the command flag set is a command, this includes
+	 * BT_ATT_OP_WRITE_CMD and BT_ATT_OP_SIGNED_WRITE_CMD.
+	 */
+	[0x40 ... 0x7f]				= ATT_OP_TYPE_CMD,
+	[0xc0 ... 0xff]				= ATT_OP_TYPE_CMD,
 };
 
 static enum att_op_type get_op_type(uint8_t opcode)
 {
-	int i;
-
-	for (i = 0; att_opcode_type_table[i].opcode; i++) {
-		if (att_opcode_type_table[i].opcode == opcode)
-			return att_opcode_type_table[i].type;
-	}
-
-	if (opcode & ATT_OP_CMD_MASK)
-		return ATT_OP_TYPE_CMD;
+	return att_opcode_type_table[opcode];
+}
+
+/* Request opcode indexed by response opcode */
+static const uint8_t att_req_opcode_table[256] = {
+	[BT_ATT_OP_MTU_RSP]		= BT_ATT_OP_MTU_REQ,
+	[BT_ATT_OP_FIND_INFO_RSP]	= BT_ATT_OP_FIND_INFO_REQ,
+	[BT_ATT_OP_FIND_BY_TYPE_RSP]	= BT_ATT_OP_FIND_BY_TYPE_REQ,
+	[BT_ATT_OP_READ_BY_TYPE_RSP]	= BT_ATT_OP_READ_BY_TYPE_REQ,
+	[BT_ATT_OP_READ_RSP]		= BT_ATT_OP_READ_REQ,
+	[BT_ATT_OP_READ_BLOB_RSP]	= BT_ATT_OP_READ_BLOB_REQ,
+	[BT_ATT_OP_READ_MULT_RSP]	= BT_ATT_OP_READ_MULT_REQ,
+	[BT_ATT_OP_READ_BY_GRP_TYPE_RSP]	= BT_ATT_OP_READ_BY_GRP_TYPE_REQ,
+	[BT_ATT_OP_WRITE_RSP]		= BT_ATT_OP_WRITE_REQ,
+	[BT_ATT_OP_PREP_WRITE_RSP]	= BT_ATT_OP_PREP_WRITE_REQ,
+	[BT_ATT_OP_EXEC_WRITE_RSP]	= BT_ATT_OP_EXEC_WRITE_REQ,
+};
 
-	return ATT_OP_TYPE_UNKNOWN;
+static uint8_t get_req_opcode(uint8_t rsp_opcode)
+{
+	return att_req_opcode_table[rsp_opcode];
 }
 
-static const struct {
-	uint8_t req_opcode;
-	uint8_t rsp_opcode;
-} att_req_rsp_mapping_table[] = {
-	{ BT_ATT_OP_MTU_REQ,			BT_ATT_OP_MTU_RSP },
-	{ BT_ATT_OP_FIND_INFO_REQ,		BT_ATT_OP_FIND_INFO_RSP},
-	{ BT_ATT_OP_FIND_BY_TYPE_REQ,		BT_ATT_OP_FIND_BY_TYPE_RSP },
-	{ BT_ATT_OP_READ_BY_TYPE_REQ,		BT_ATT_OP_READ_BY_TYPE_RSP },
-	{ BT_ATT_OP_READ_REQ,			BT_ATT_OP_READ_RSP },
-	{ BT_ATT_OP_READ_BLOB_REQ,		BT_ATT_OP_READ_BLOB_RSP },
-	{ BT_ATT_OP_READ_MULT_REQ,		BT_ATT_OP_READ_MULT_RSP },
-	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	BT_ATT_OP_READ_BY_GRP_TYPE_RSP },
-	{ BT_ATT_OP_WRITE_REQ,			BT_ATT_OP_WRITE_RSP },
-	{ BT_ATT_OP_PREP_WRITE_REQ,		BT_ATT_OP_PREP_WRITE_RSP },
-	{ BT_ATT_OP_EXEC_WRITE_REQ,		BT_ATT_OP_EXEC_WRITE_RSP },
-	{ }
+/*
+ * With all classes backlogged an interactive op goes out within 12 PDUs
+ * and bulk traffic still gets half of the link.
+ */
+static const unsigned int default_quantum[BT_ATT_PRIO_COUNT] = {
+	[BT_ATT_PRIO_CONTROL]		= 4,
+	[BT_ATT_PRIO_INTERACTIVE]	= 4,
+	[BT_ATT_PRIO_BULK]		= 8,
 };
 
-static uint8_t get_req_opcode(uint8_t rsp_opcode)
+static uint8_t get_default_prio(uint8_t opcode)
 {
-	int i;
-
-	for (i = 0; att_req_rsp_mapping_table[i].rsp_opcode; i++) {
-		if (att_req_rsp_mapping_table[i].rsp_opcode == rsp_opcode)
-			return att_req_rsp_mapping_table[i].req_opcode;
+	switch (get_op_type(opcode)) {
+	case ATT_OP_TYPE_RSP:
+	case ATT_OP_TYPE_CONF:
+		return BT_ATT_PRIO_CONTROL;
+	case ATT_OP_TYPE_REQ:
+		if (opcode == BT_ATT_OP_MTU_REQ)
+			return BT_ATT_PRIO_CONTROL;
+		/* fall through */
+	case ATT_OP_TYPE_IND:
+		return BT_ATT_PRIO_INTERACTIVE;
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_NFY:
+	case ATT_OP_TYPE_UNKNOWN:
+	default:
+		return BT_ATT_PRIO_BULK;
 	}
+}
 
-	return 0;
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+struct timeout_data {
+	struct bt_att_chan *chan;
+	unsigned int id;
+};
+
 struct att_send_op {
 	unsigned int id;
 	unsigned int timeout_id;
@@ -206,20 +294,142 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	struct bt_att *att;
+	struct timeout_data timeout;
+	uint8_t prio;
+	uint16_t key;			/* Set while in latest_ops */
+	uint64_t queued_at;		/* Monotonic time in us */
+
+	/* Referenced PDU, only used when pdu is NULL */
+	uint8_t hdr[ATT_OP_HDR_LEN];
+	uint8_t hdr_len;
+	int iovcnt;
+	struct iovec iov[ATT_OP_MAX_IOV];
 };
 
+static void *att_pool_get(struct att_pool *pool)
+{
+	void *obj = pool->free;
+
+	if (!obj)
+		return NULL;
+
+	pool->free = *(void **) obj;
+	pool->count--;
+
+	return obj;
+}
+
+static void att_pool_put(struct att_pool *pool, void *obj)
+{
+	if (pool->count >= ATT_POOL_MAX_FREE) {
+		free(obj);
+		return;
+	}
+
+	*(void **) obj = pool->free;
+	pool->free = obj;
+	pool->count++;
+}
+
+static void att_pool_clear(struct att_pool *pool)
+{
+	void *obj;
+
+	while ((obj = att_pool_get(pool)))
+		free(obj);
+}
+
+static int pdu_class(uint16_t len)
+{
+	int class = 0;
+
+	while ((1U << (ATT_PDU_CLASS_SHIFT + class)) < len) {
+		if (++class == ATT_PDU_CLASSES)
+			return -1;
+	}
+
+	return class;
+}
+
+static void *pdu_alloc(struct bt_att *att, uint16_t len)
+{
+	int class = pdu_class(len);
+	void *pdu;
+
+	if (class < 0)
+		return malloc(len);
+
+	pdu = att_pool_get(&att->pdu_pool[class]);
+	if (!pdu)
+		pdu = malloc(1U << (ATT_PDU_CLASS_SHIFT + class));
+
+	return pdu;
+}
+
+static void pdu_free(struct bt_att *att, void *pdu, uint16_t len)
+{
+	int class = pdu_class(len);
+
+	if (!pdu)
+		return;
+
+	if (class < 0) {
+		free(pdu);
+		return;
+	}
+
+	att_pool_put(&att->pdu_pool[class], pdu);
+}
+
+static struct att_send_op *alloc_att_send_op(struct bt_att *att)
+{
+	struct att_send_op *op;
+
+	op = att_pool_get(&att->op_pool);
+	if (op)
+		memset(op, 0, offsetof(struct att_send_op, iov));
+	else
+		op = new0(struct att_send_op, 1);
+
+	op->att = att;
+
+	return op;
+}
+
+static void latest_op_unlink(struct att_send_op *op)
+{
+	if (!op->key)
+		return;
+
+	queue_remove(op->att->latest_ops, op);
+	op->key = 0;
+}
+
+static void free_att_send_op(struct att_send_op *op)
+{
+	struct bt_att *att = op->att;
+
+	latest_op_unlink(op);
+
+	pdu_free(att, op->pdu, op->len);
+	att_pool_put(&att->op_pool, op);
+}
+
 static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
 
+	/* Written or dropped, the next op with this key is queued anew */
+	latest_op_unlink(op);
+
 	if (op->timeout_id)
 		timeout_remove(op->timeout_id);
 
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->pdu);
-	free(op);
+	free_att_send_op(op);
 }
 
 static void cancel_att_send_op(struct att_send_op *op)
@@ -285,29 +495,57 @@ static bool match_disconn_id(const void *a, const void *b)
 }
 
 static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
-					const void *pdu, uint16_t length)
+				const struct iovec *iov, int iovcnt, bool ref)
 {
 	uint16_t pdu_len = 1;
 	struct sign_info *sign = att->local_sign;
 	uint32_t sign_cnt;
+	size_t length = 0;
+	uint8_t *pdu;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
 
 	if (sign && (op->opcode & ATT_OP_SIGNED_MASK))
 		pdu_len += BT_ATT_SIGNATURE_LEN;
 
-	if (length && pdu)
-		pdu_len += length;
-
-	if (pdu_len > att->mtu)
+	if (length > (size_t) att->mtu - pdu_len)
 		return false;
 
+	pdu_len += length;
 	op->len = pdu_len;
-	op->pdu = malloc(op->len);
+
+	if (ref) {
+		op->hdr[0] = op->opcode;
+		op->hdr_len = 1;
+
+		/* Small leading fields may live on the caller's stack */
+		for (i = 0; i < iovcnt; i++) {
+			if (op->hdr_len + iov[i].iov_len > ATT_OP_HDR_LEN)
+				break;
+
+			memcpy(op->hdr + op->hdr_len, iov[i].iov_base,
+							iov[i].iov_len);
+			op->hdr_len += iov[i].iov_len;
+		}
+
+		op->iovcnt = iovcnt - i;
+		memcpy(op->iov, iov + i, op->iovcnt * sizeof(*iov));
+
+		return true;
+	}
+
+	op->pdu = pdu_alloc(att, op->len);
 	if (!op->pdu)
 		return false;
 
-	((uint8_t *) op->pdu)[0] = op->opcode;
-	if (pdu_len > 1)
-		memcpy(op->pdu + 1, pdu, length);
+	pdu = op->pdu;
+	*pdu++ = op->opcode;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(pdu, iov[i].iov_base, iov[i].iov_len);
+		pdu += iov[i].iov_len;
+	}
 
 	if (!sign || !(op->opcode & ATT_OP_SIGNED_MASK) || !att->crypto)
 		return true;
@@ -323,24 +561,31 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 					"ATT unable to generate signature");
 
 fail:
-	free(op->pdu);
+	pdu_free(att, op->pdu, op->len);
+	op->pdu = NULL;
 	return false;
 }
 
 static struct att_send_op *create_att_send_op(struct bt_att *att,
 						uint8_t opcode,
-						const void *pdu,
-						uint16_t length,
+						const struct iovec *iov,
+						int iovcnt, bool ref,
 						bt_att_response_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy)
 {
 	struct att_send_op *op;
 	enum att_op_type type;
+	int i;
 
-	if (length && !pdu)
+	if (iovcnt < 0 || (iovcnt && !iov))
 		return NULL;
 
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len && !iov[i].iov_base)
+			return NULL;
+	}
+
 	type = get_op_type(opcode);
 	if (type == ATT_OP_TYPE_UNKNOWN)
 		return NULL;
@@ -358,52 +603,98 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	if (!callback && (type == ATT_OP_TYPE_REQ || type == ATT_OP_TYPE_IND))
 		return NULL;
 
-	op = new0(struct att_send_op, 1);
+	/* Only fire-and-forget PDUs are sent in place, everything that can
+	 * be retried or has to be signed is copied.
+	 */
+	if (ref && (iovcnt > ATT_OP_MAX_IOV ||
+			(opcode & ATT_OP_SIGNED_MASK) ||
+			(type != ATT_OP_TYPE_CMD && type != ATT_OP_TYPE_NFY)))
+		ref = false;
+
+	op = alloc_att_send_op(att);
 	op->type = type;
 	op->opcode = opcode;
+	op->prio = att->opcode_prio[opcode];
+	op->queued_at = get_time_us();
 	op->callback = callback;
 	op->destroy = destroy;
 	op->user_data = user_data;
 
-	if (!encode_pdu(att, op, pdu, length)) {
-		free(op);
+	if (!encode_pdu(att, op, iov, iovcnt, ref)) {
+		free_att_send_op(op);
 		return NULL;
 	}
 
 	return op;
 }
 
-static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan)
+static struct att_send_op *pick_prio_send_op(struct bt_att_chan *chan,
+							unsigned int prio,
+							struct queue **from)
 {
 	struct bt_att *att = chan->att;
 	struct att_send_op *op;
 
-	/* Check if there is anything queued on the channel */
-	op = queue_pop_head(chan->queue);
-	if (op)
-		return op;
-
 	/* See if any operations are already in the write queue */
-	op = queue_peek_head(att->write_queue);
+	*from = att->write_queue[prio];
+	op = queue_peek_head(*from);
 	if (op && op->len <= chan->mtu)
-		return queue_pop_head(att->write_queue);
+		return queue_pop_head(*from);
 
 	/* If there is no pending request, pick an operation from the
 	 * request queue.
 	 */
 	if (!chan->pending_req) {
-		op = queue_peek_head(att->req_queue);
+		*from = att->req_queue[prio];
+		op = queue_peek_head(*from);
 		if (op && op->len <= chan->mtu)
-			return queue_pop_head(att->req_queue);
+			return queue_pop_head(*from);
 	}
 
 	/* There is either a request pending or no requests queued. If there is
 	 * no pending indication, pick an operation from the indication queue.
 	 */
 	if (!chan->pending_ind) {
-		op = queue_peek_head(att->ind_queue);
+		*from = att->ind_queue[prio];
+		op = queue_peek_head(*from);
 		if (op && op->len <= chan->mtu)
-			return queue_pop_head(att->ind_queue);
+			return queue_pop_head(*from);
+	}
+
+	return NULL;
+}
+
+static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan,
+							struct queue **from)
+{
+	struct bt_att *att = chan->att;
+	struct att_send_op *op;
+	int i;
+
+	/* Check if there is anything queued on the channel */
+	*from = chan->queue;
+	op = queue_pop_head(chan->queue);
+	if (op)
+		return op;
+
+	/*
+	 * Deficit round robin, counted in PDUs, across the priority classes.
+	 * The class being served sends up to its quantum, then the turn moves
+	 * on; a class with nothing it can send gives up its turn. An op that
+	 * can be sent thus waits for at most the quanta of the other classes,
+	 * however much bulk traffic is queued ahead of it.
+	 */
+	for (i = 0; i <= BT_ATT_PRIO_COUNT; i++) {
+		if (att->drr_credit) {
+			op = pick_prio_send_op(chan, att->drr_prio, from);
+			if (op) {
+				att->drr_credit--;
+				return op;
+			}
+		}
+
+		att->drr_prio = (att->drr_prio + 1) % BT_ATT_PRIO_COUNT;
+		att->drr_credit = att->quantum[att->drr_prio];
 	}
 
 	return NULL;
@@ -419,11 +710,6 @@ static void disc_att_send_op(void *data)
 	destroy_att_send_op(op);
 }
 
-struct timeout_data {
-	struct bt_att_chan *chan;
-	unsigned int id;
-};
-
 static bool timeout_cb(void *user_data)
 {
 	struct timeout_data *timeout = user_data;
@@ -469,90 +755,330 @@ static void write_watch_destroy(void *user_data)
 	chan->writer_active = false;
 }
 
-static ssize_t bt_att_chan_write(struct bt_att_chan *chan, uint8_t opcode,
-					const void *pdu, uint16_t len)
+struct att_tx_slot {
+	struct att_send_op *op;
+	struct queue *from;
+	bool pending;			/* Made the chan's pending req/ind */
+	unsigned int drr_prio;		/* Scheduler state before the pick */
+	unsigned int drr_credit;
+	struct iovec iov[ATT_OP_MAX_IOV + 1];
+	int iovcnt;
+	size_t len;			/* Bytes written */
+};
+
+static void att_tx_slot_init(struct att_tx_slot *slot)
+{
+	struct att_send_op *op = slot->op;
+
+	if (op->pdu) {
+		slot->iov[0].iov_base = op->pdu;
+		slot->iov[0].iov_len = op->len;
+		slot->iovcnt = 1;
+		return;
+	}
+
+	slot->iov[0].iov_base = op->hdr;
+	slot->iov[0].iov_len = op->hdr_len;
+	memcpy(&slot->iov[1], op->iov, op->iovcnt * sizeof(struct iovec));
+	slot->iovcnt = op->iovcnt + 1;
+}
+
+/*
+ * Writes the PDUs of n slots, returns how many went out or a negative
+ * errno if the first one failed.
+ */
+static int bt_att_chan_write(struct bt_att_chan *chan,
+					struct att_tx_slot *slots, int n)
 {
 	struct bt_att *att = chan->att;
+	struct mmsghdr msgs[ATT_TX_BATCH];
 	ssize_t ret;
-	struct iovec iov;
+	int i;
 
-	iov.iov_base = (void *) pdu;
-	iov.iov_len = len;
+	att->stats.tx_syscalls++;
+
+	if (!chan->no_mmsg) {
+		memset(msgs, 0, n * sizeof(*msgs));
+
+		for (i = 0; i < n; i++) {
+			msgs[i].msg_hdr.msg_iov = slots[i].iov;
+			msgs[i].msg_hdr.msg_iovlen = slots[i].iovcnt;
+		}
+
+		ret = sendmmsg(chan->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret >= 0) {
+			for (i = 0; i < ret; i++)
+				slots[i].len = msgs[i].msg_len;
+
+			return ret;
+		}
+
+		if (errno != ENOTSOCK && errno != ENOSYS &&
+							errno != EOPNOTSUPP)
+			return -errno;
+
+		/* Not a socket, fall back to one write per PDU */
+		chan->no_mmsg = true;
+	}
+
+	ret = io_send(chan->io, slots[0].iov, slots[0].iovcnt);
+	if (ret < 0)
+		return ret;
+
+	slots[0].len = ret;
+
+	return 1;
+}
+
+static void att_tx_slot_dump(struct bt_att_chan *chan,
+						struct att_tx_slot *slot)
+{
+	struct bt_att *att = chan->att;
+	size_t left = slot->len;
+	int i;
 
 	util_debug(att->debug_callback, att->debug_data,
 					"(chan %p) ATT op 0x%02x",
-					chan, opcode);
+					chan, slot->op->opcode);
 
-	ret = io_send(chan->io, &iov, 1);
-	if (ret < 0) {
-		util_debug(att->debug_callback, att->debug_data,
-					"(chan %p) write failed: %s",
-					chan, strerror(-ret));
+	for (i = 0; i < slot->iovcnt && left; i++) {
+		size_t len = MIN(slot->iov[i].iov_len, left);
 
-		return ret;
+		util_hexdump('<', slot->iov[i].iov_base, len,
+					att->debug_callback, att->debug_data);
+		left -= len;
 	}
+}
 
-	util_hexdump('<', pdu, ret, att->debug_callback, att->debug_data);
+/*
+ * Puts an op that could not be written back where it was picked from.
+ * Ops are put back last picked first, so the scheduler ends up where it
+ * was before the first of them was picked and they cost their class none
+ * of its turn.
+ */
+static void unpick_send_op(struct bt_att_chan *chan, struct att_tx_slot *slot)
+{
+	struct bt_att *att = chan->att;
 
-	return ret;
+	att->drr_prio = slot->drr_prio;
+	att->drr_credit = slot->drr_credit;
+
+	if (chan->pending_req == slot->op)
+		chan->pending_req = NULL;
+
+	if (chan->pending_ind == slot->op)
+		chan->pending_ind = NULL;
+
+	queue_push_head(slot->from, slot->op);
+}
+
+static void record_latency(struct bt_att *att, struct att_send_op *op,
+								uint64_t now)
+{
+	uint64_t latency = now > op->queued_at ? now - op->queued_at : 0;
+	int bucket = latency ? 64 - __builtin_clzll(latency) : 0;
+
+	if (bucket >= BT_ATT_LATENCY_BUCKETS)
+		bucket = BT_ATT_LATENCY_BUCKETS - 1;
+
+	att->stats.queue_latency[op->prio][bucket]++;
+}
+
+static void write_done(struct bt_att_chan *chan, struct att_send_op *op)
+{
+	/* Requests and indications were made pending when picked, they now
+	 * wait for the response or confirmation. Anything else is done.
+	 */
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+	case ATT_OP_TYPE_IND:
+		break;
+	case ATT_OP_TYPE_RSP:
+		/* Set in_req to false to indicate that no request is pending */
+		chan->in_req = false;
+		/* fall through */
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_NFY:
+	case ATT_OP_TYPE_CONF:
+	case ATT_OP_TYPE_UNKNOWN:
+	default:
+		destroy_att_send_op(op);
+		return;
+	}
+
+	/* The timer is always removed before the op is released */
+	op->timeout.chan = chan;
+	op->timeout.id = op->id;
+	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
+							&op->timeout, NULL);
+}
+
+static void write_failed(struct bt_att_chan *chan, struct att_send_op *op,
+								int err)
+{
+	struct bt_att *att = chan->att;
+
+	util_debug(att->debug_callback, att->debug_data,
+					"(chan %p) write failed: %s",
+					chan, strerror(-err));
+
+	if (chan->pending_req == op)
+		chan->pending_req = NULL;
+
+	if (chan->pending_ind == op)
+		chan->pending_ind = NULL;
+
+	if (op->callback)
+		op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0, op->user_data);
+
+	destroy_att_send_op(op);
 }
 
 static bool can_write_data(struct io *io, void *user_data)
 {
 	struct bt_att_chan *chan = user_data;
-	struct att_send_op *op;
-	struct timeout_data *timeout;
+	struct bt_att *att = chan->att;
+	struct att_tx_slot slots[ATT_TX_BATCH];
+	unsigned int count = 0;
+	bool result = true;
+	uint64_t now;
+	int n, sent, i;
 
-	op = pick_next_send_op(chan);
-	if (!op)
-		return false;
+	/* The completions below may drop the last reference to att */
+	bt_att_ref(att);
+
+	att->stats.tx_wakeups++;
+
+	/*
+	 * Write everything that is allowed to go out, up to ATT_TX_BUDGET
+	 * PDUs, instead of one PDU per EPOLLOUT. Picking a request or an
+	 * indication makes it pending right away so the rest of the batch
+	 * still honours one outstanding of each.
+	 */
+	while (count < ATT_TX_BUDGET) {
+		for (n = 0; n < ATT_TX_BATCH && count + n < ATT_TX_BUDGET;) {
+			struct att_tx_slot *slot = &slots[n];
+
+			slot->drr_prio = att->drr_prio;
+			slot->drr_credit = att->drr_credit;
+			slot->op = pick_next_send_op(chan, &slot->from);
+			if (!slot->op)
+				break;
+
+			slot->pending = true;
+			if (slot->op->type == ATT_OP_TYPE_REQ)
+				chan->pending_req = slot->op;
+			else if (slot->op->type == ATT_OP_TYPE_IND)
+				chan->pending_ind = slot->op;
+			else
+				slot->pending = false;
+
+			att_tx_slot_init(slot);
+			n++;
+
+			/* Without sendmmsg() only one PDU per wakeup */
+			if (chan->no_mmsg)
+				break;
+		}
+
+		if (!n) {
+			/* Nothing left that can be sent */
+			result = false;
+			break;
+		}
+
+		sent = bt_att_chan_write(chan, slots, n);
+
+		/* Requeue what did not go out ahead of anything the
+		 * callbacks below may queue.
+		 */
+		for (i = n - 1; i >= MAX(sent, 1); i--)
+			unpick_send_op(chan, &slots[i]);
+
+		if (sent < 0) {
+			if (sent == -EAGAIN || sent == -EWOULDBLOCK) {
+				unpick_send_op(chan, &slots[0]);
+				break;
+			}
+
+			write_failed(chan, slots[0].op, sent);
+			break;
+		}
+
+		count += sent;
+		now = get_time_us();
+
+		/* Written ops take no more replacements, a callback below
+		 * sending under the same key must queue a new op instead.
+		 */
+		for (i = 0; i < sent; i++)
+			latest_op_unlink(slots[i].op);
+
+		for (i = 0; i < sent; i++) {
+			/* A completion took the channel down, which released
+			 * its pending ops; the others are still ours to free.
+			 */
+			if (!queue_find(att->chans, NULL, chan)) {
+				if (!slots[i].pending)
+					destroy_att_send_op(slots[i].op);
+				continue;
+			}
+
+			att_tx_slot_dump(chan, &slots[i]);
+			record_latency(att, slots[i].op, now);
+			write_done(chan, slots[i].op);
+		}
+
+		if (!queue_find(att->chans, NULL, chan))
+			break;
+
+		/* Socket buffer is full, wait for the next EPOLLOUT */
+		if (sent < n)
+			break;
+	}
+
+	att->stats.tx_pdus += count;
+	if (count > att->stats.tx_max_batch)
+		att->stats.tx_max_batch = count;
+
+	/*
+	 * Once the channel is gone its io has dropped the write handler and
+	 * run write_watch_destroy already, returning false would run it again
+	 * on the freed channel. The same happens if this is the last reference.
+	 */
+	if (att->ref_count == 1 || !queue_find(att->chans, NULL, chan))
+		result = true;
+
+	bt_att_unref(att);
+
+	return result;
+}
 
-	if (!bt_att_chan_write(chan, op->opcode, op->pdu, op->len)) {
-		if (op->callback)
-			op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
-							op->user_data);
-		destroy_att_send_op(op);
-		return true;
-	}
+static bool chan_can_send(struct bt_att_chan *chan)
+{
+	struct bt_att *att = chan->att;
+	int i;
 
-	/* Based on the operation type, set either the pending request or the
-	 * pending indication. If it came from the write queue, then there is
-	 * no need to keep it around.
-	 */
-	switch (op->type) {
-	case ATT_OP_TYPE_REQ:
-		chan->pending_req = op;
-		break;
-	case ATT_OP_TYPE_IND:
-		chan->pending_ind = op;
-		break;
-	case ATT_OP_TYPE_RSP:
-		/* Set in_req to false to indicate that no request is pending */
-		chan->in_req = false;
-		/* fall through */
-	case ATT_OP_TYPE_CMD:
-	case ATT_OP_TYPE_NFY:
-	case ATT_OP_TYPE_CONF:
-	case ATT_OP_TYPE_UNKNOWN:
-	default:
-		destroy_att_send_op(op);
+	if (!queue_isempty(chan->queue))
 		return true;
-	}
 
-	timeout = new0(struct timeout_data, 1);
-	timeout->chan = chan;
-	timeout->id = op->id;
-	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		if (!queue_isempty(att->write_queue[i]))
+			return true;
 
-	/* Return true as there may be more operations ready to write. */
-	return true;
+		if (!chan->pending_req && !queue_isempty(att->req_queue[i]))
+			return true;
+
+		if (!chan->pending_ind && !queue_isempty(att->ind_queue[i]))
+			return true;
+	}
+
+	return false;
 }
 
 static void wakeup_chan_writer(void *data, void *user_data)
 {
 	struct bt_att_chan *chan = data;
-	struct bt_att *att = chan->att;
 
 	if (chan->writer_active)
 		return;
@@ -560,11 +1086,8 @@ static void wakeup_chan_writer(void *data, void *user_data)
 	/* Set the write handler only if there is anything that can be sent
 	 * at all.
 	 */
-	if (queue_isempty(chan->queue) && queue_isempty(att->write_queue)) {
-		if ((chan->pending_req || queue_isempty(att->req_queue)) &&
-			(chan->pending_ind || queue_isempty(att->ind_queue)))
-			return;
-	}
+	if (!chan_can_send(chan))
+		return;
 
 	if (!io_set_write_handler(chan->io, can_write_data, chan,
 							write_watch_destroy))
@@ -612,7 +1135,7 @@ static bool disconnect_cb(struct io *io, void *user_data)
 {
 	struct bt_att_chan *chan = user_data;
 	struct bt_att *att = chan->att;
-	int err;
+	int err, i;
 	socklen_t len;
 
 	len = sizeof(err);
@@ -632,9 +1155,14 @@ static bool disconnect_cb(struct io *io, void *user_data)
 	queue_remove(att->chans, chan);
 
 	/* Notify request callbacks */
-	queue_remove_all(att->req_queue, NULL, NULL, disc_att_send_op);
-	queue_remove_all(att->ind_queue, NULL, NULL, disc_att_send_op);
-	queue_remove_all(att->write_queue, NULL, NULL, disc_att_send_op);
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		queue_remove_all(att->req_queue[i], NULL, NULL,
+							disc_att_send_op);
+		queue_remove_all(att->ind_queue[i], NULL, NULL,
+							disc_att_send_op);
+		queue_remove_all(att->write_queue[i], NULL, NULL,
+							disc_att_send_op);
+	}
 
 	if (chan->pending_req) {
 		disc_att_send_op(chan->pending_req);
@@ -662,6 +1190,12 @@ static bool disconnect_cb(struct io *io, void *user_data)
 	return false;
 }
 
+/*
+ * The level only changes through bt_att_chan_set_security() or when the
+ * link gets encrypted, so it is read from the socket once and cached
+ * until one of those invalidates it; permission checks on every PDU then
+ * cost no syscall.
+ */
 static int bt_att_chan_get_security(struct bt_att_chan *chan)
 {
 	struct bt_security sec;
@@ -670,11 +1204,17 @@ static int bt_att_chan_get_security(struct bt_att_chan *chan)
 	if (chan->type == BT_ATT_LOCAL)
 		return chan->sec_level;
 
+	if (chan->sec_cache >= 0)
+		return chan->sec_cache;
+
 	memset(&sec, 0, sizeof(sec));
 	len = sizeof(sec);
 	if (getsockopt(chan->fd, SOL_BLUETOOTH, BT_SECURITY, &sec, &len) < 0)
 		return -EIO;
 
+	chan->sec_cache = sec.level;
+	chan->enc_size = sec.key_size;
+
 	return sec.level;
 }
 
@@ -694,6 +1234,9 @@ static bool bt_att_chan_set_security(struct bt_att_chan *chan, int level)
 							sizeof(sec)) < 0)
 		return false;
 
+	/* Raising the level starts pairing, the new level applies later */
+	chan->sec_cache = -1;
+
 	return true;
 }
 
@@ -758,7 +1301,7 @@ static bool handle_error_rsp(struct bt_att_chan *chan, uint8_t *pdu,
 	chan->pending_req = NULL;
 
 	/* Push operation back to request queue */
-	return queue_push_head(att->req_queue, op);
+	return queue_push_head(att->req_queue[op->prio], op);
 }
 
 static void handle_rsp(struct bt_att_chan *chan, uint8_t opcode, uint8_t *pdu,
@@ -934,16 +1477,13 @@ static void handle_notify(struct bt_att_chan *chan, uint8_t opcode,
 	bt_att_ref(att);
 
 	found = false;
-	entry = queue_get_entries(att->notify_list);
+	entry = queue_get_entries(att->notify_index[opcode]);
 
 	while (entry) {
 		struct att_notify *notify = entry->data;
 
 		entry = entry->next;
 
-		if (!opcode_match(notify->opcode, opcode))
-			continue;
-
 		/* BLUETOOTH CORE SPECIFICATION Version 5.1 | Vol 3, Part G
 		 * page 2370
 		 *
@@ -967,7 +1507,7 @@ static void handle_notify(struct bt_att_chan *chan, uint8_t opcode,
 							notify->user_data);
 
 		/* callback could remove all entries from notify list */
-		if (queue_isempty(att->notify_list))
+		if (queue_isempty(att->notify_index[opcode]))
 			break;
 	}
 
@@ -982,33 +1522,24 @@ not_supported:
 	bt_att_unref(att);
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+static bool handle_pdu(struct bt_att_chan *chan, uint8_t *pdu,
+							ssize_t bytes_read)
 {
-	struct bt_att_chan *chan = user_data;
 	struct bt_att *att = chan->att;
 	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t bytes_read;
-
-	bytes_read = read(chan->fd, chan->buf, chan->mtu);
-	if (bytes_read < 0)
-		return false;
 
 	util_debug(att->debug_callback, att->debug_data,
 				"(chan %p) ATT received: %zd",
 				chan, bytes_read);
 
-	util_hexdump('>', chan->buf, bytes_read,
+	util_hexdump('>', pdu, bytes_read,
 				att->debug_callback, att->debug_data);
 
 	if (bytes_read < ATT_MIN_PDU_LEN)
 		return true;
 
-	pdu = chan->buf;
 	opcode = pdu[0];
 
-	bt_att_ref(att);
-
 	/* Act on the received PDU based on the opcode type */
 	switch (get_op_type(opcode)) {
 	case ATT_OP_TYPE_RSP:
@@ -1035,7 +1566,6 @@ static bool can_read_data(struct io *io, void *user_data)
 					"another is pending: 0x%02x",
 					chan, opcode);
 			io_shutdown(chan->io);
-			bt_att_unref(chan->att);
 
 			return false;
 		}
@@ -1058,9 +1588,119 @@ static bool can_read_data(struct io *io, void *user_data)
 		break;
 	}
 
+	return true;
+}
+
+/*
+ * Reads up to max PDUs into the slots of chan->buf and stores their
+ * lengths in msgs. Returns the number of PDUs, 0 at end of file or a
+ * negative errno.
+ */
+static int chan_recv(struct bt_att_chan *chan, struct mmsghdr *msgs, int max)
+{
+	struct iovec iov[ATT_RX_BATCH];
+	ssize_t ret;
+	int i;
+
+	chan->att->stats.rx_syscalls++;
+
+	if (!chan->no_mmsg) {
+		memset(msgs, 0, max * sizeof(*msgs));
+
+		for (i = 0; i < max; i++) {
+			iov[i].iov_base = chan->buf + i * chan->buf_mtu;
+			iov[i].iov_len = chan->buf_mtu;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(chan->fd, msgs, max, MSG_DONTWAIT, NULL);
+		if (ret >= 0)
+			return ret;
+
+		if (errno != ENOTSOCK && errno != ENOSYS &&
+							errno != EOPNOTSUPP)
+			return -errno;
+
+		/* Not a socket, fall back to one read() per wakeup */
+		chan->no_mmsg = true;
+	}
+
+	ret = read(chan->fd, chan->buf, chan->buf_mtu);
+	if (ret < 0)
+		return -errno;
+
+	msgs[0].msg_len = ret;
+
+	return ret ? 1 : 0;
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
+	struct mmsghdr msgs[ATT_RX_BATCH];
+	unsigned int count = 0;
+	bool result = true;
+	int i, ret;
+
+	bt_att_ref(att);
+
+	att->stats.rx_wakeups++;
+
+	/*
+	 * Drain the socket so that a burst of write commands costs one
+	 * wakeup per ATT_RX_BUDGET PDUs instead of one per PDU, anything
+	 * left is picked up by the next (level triggered) wakeup.
+	 */
+	while (count < ATT_RX_BUDGET) {
+		/* The MTU may have been raised by the last batch */
+		if (chan->buf_mtu != chan->mtu) {
+			uint8_t *buf = malloc(chan->mtu * ATT_RX_BATCH);
+
+			if (buf) {
+				free(chan->buf);
+				chan->buf = buf;
+				chan->buf_mtu = chan->mtu;
+			}
+		}
+
+		ret = chan_recv(chan, msgs,
+				MIN(ATT_RX_BATCH, ATT_RX_BUDGET - count));
+		if (ret < 0) {
+			/* Only fail the way a single read() used to */
+			if (!count && ret != -EAGAIN && ret != -EINTR)
+				result = false;
+			break;
+		}
+
+		if (!ret)
+			break;
+
+		count += ret;
+
+		for (i = 0; i < ret; i++) {
+			uint8_t *pdu = chan->buf + i * chan->buf_mtu;
+
+			if (!handle_pdu(chan, pdu, msgs[i].msg_len)) {
+				result = false;
+				goto done;
+			}
+		}
+
+		/* A short batch means the queue is empty, skip the EAGAIN */
+		if (chan->no_mmsg || ret < ATT_RX_BATCH)
+			break;
+	}
+
+done:
+	att->stats.rx_pdus += count;
+	if (count > att->stats.rx_max_batch)
+		att->stats.rx_max_batch = count;
+
 	bt_att_unref(att);
 
-	return true;
+	return result;
 }
 
 static bool is_io_l2cap_based(int fd)
@@ -1090,6 +1730,8 @@ static bool is_io_l2cap_based(int fd)
 
 static void bt_att_free(struct bt_att *att)
 {
+	int i;
+
 	bt_crypto_unref(att->crypto);
 
 	if (att->timeout_destroy)
@@ -1101,12 +1743,22 @@ static void bt_att_free(struct bt_att *att)
 	free(att->local_sign);
 	free(att->remote_sign);
 
-	queue_destroy(att->req_queue, NULL);
-	queue_destroy(att->ind_queue, NULL);
-	queue_destroy(att->write_queue, NULL);
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		queue_destroy(att->req_queue[i], NULL);
+		queue_destroy(att->ind_queue[i], NULL);
+		queue_destroy(att->write_queue[i], NULL);
+	}
+
 	queue_destroy(att->notify_list, NULL);
+	for (i = 0; i < 256; i++)
+		queue_destroy(att->notify_index[i], NULL);
 	queue_destroy(att->disconn_list, NULL);
 	queue_destroy(att->chans, bt_att_chan_free);
+	queue_destroy(att->latest_ops, NULL);
+
+	att_pool_clear(&att->op_pool);
+	for (i = 0; i < ATT_PDU_CLASSES; i++)
+		att_pool_clear(&att->pdu_pool[i]);
 
 	free(att);
 }
@@ -1166,6 +1818,7 @@ static struct bt_att_chan *bt_att_chan_new(int fd, uint8_t type)
 		goto fail;
 
 	chan->type = type;
+	chan->sec_cache = -1;
 	switch (chan->type) {
 	case BT_ATT_LOCAL:
 		chan->sec_level = BT_ATT_SECURITY_LOW;
@@ -1180,10 +1833,12 @@ static struct bt_att_chan *bt_att_chan_new(int fd, uint8_t type)
 	if (chan->mtu < BT_ATT_DEFAULT_LE_MTU)
 		goto fail;
 
-	chan->buf = malloc(chan->mtu);
+	chan->buf = malloc(chan->mtu * ATT_RX_BATCH);
 	if (!chan->buf)
 		goto fail;
 
+	chan->buf_mtu = chan->mtu;
+
 	chan->queue = queue_new();
 
 	return chan;
@@ -1215,6 +1870,7 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 {
 	struct bt_att *att;
 	struct bt_att_chan *chan;
+	int i;
 
 	chan = bt_att_chan_new(fd, io_get_type(fd));
 	if (!chan)
@@ -1228,11 +1884,19 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	if (!ext_signed)
 		att->crypto = bt_crypto_new();
 
-	att->req_queue = queue_new();
-	att->ind_queue = queue_new();
-	att->write_queue = queue_new();
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		att->req_queue[i] = queue_new();
+		att->ind_queue[i] = queue_new();
+		att->write_queue[i] = queue_new();
+		att->quantum[i] = default_quantum[i];
+	}
+
+	for (i = 0; i < 256; i++)
+		att->opcode_prio[i] = get_default_prio(i);
+
 	att->notify_list = queue_new();
 	att->disconn_list = queue_new();
+	att->latest_ops = queue_new();
 
 	bt_att_attach_chan(att, chan);
 
@@ -1349,7 +2013,6 @@ uint16_t bt_att_get_mtu(struct bt_att *att)
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 {
 	struct bt_att_chan *chan;
-	void *buf;
 
 	if (!att)
 		return false;
@@ -1362,14 +2025,12 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 	if (!chan)
 		return -ENOTCONN;
 
-	buf = malloc(mtu);
-	if (!buf)
-		return false;
-
-	free(chan->buf);
-
+	/*
+	 * This is usually called while a batch of received PDUs is being
+	 * handled, so the receive buffer is only resized before the next
+	 * read.
+	 */
 	chan->mtu = mtu;
-	chan->buf = buf;
 
 	if (chan->mtu > att->mtu)
 		att->mtu = chan->mtu;
@@ -1377,6 +2038,38 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 	return true;
 }
 
+bool bt_att_set_opcode_prio(struct bt_att *att, uint8_t opcode,
+							enum bt_att_prio prio)
+{
+	if (!att || prio >= BT_ATT_PRIO_COUNT)
+		return false;
+
+	att->opcode_prio[opcode] = prio;
+
+	return true;
+}
+
+bool bt_att_set_prio_quantum(struct bt_att *att, enum bt_att_prio prio,
+							unsigned int quantum)
+{
+	if (!att || prio >= BT_ATT_PRIO_COUNT || !quantum)
+		return false;
+
+	att->quantum[prio] = quantum;
+
+	return true;
+}
+
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->stats;
+
+	return true;
+}
+
 uint8_t bt_att_get_link_type(struct bt_att *att)
 {
 	struct bt_att_chan *chan;
@@ -1463,34 +2156,23 @@ bool bt_att_unregister_disconnect(struct bt_att *att, unsigned int id)
 	return true;
 }
 
-unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
-				const void *pdu, uint16_t length,
-				bt_att_response_func_t callback, void *user_data,
-				bt_att_destroy_func_t destroy)
+static unsigned int queue_att_send_op(struct bt_att *att,
+						struct att_send_op *op)
 {
-	struct att_send_op *op;
 	bool result;
 
-	if (!att || queue_isempty(att->chans))
-		return 0;
-
-	op = create_att_send_op(att, opcode, pdu, length, callback, user_data,
-								destroy);
-	if (!op)
-		return 0;
-
 	if (att->next_send_id < 1)
 		att->next_send_id = 1;
 
 	op->id = att->next_send_id++;
 
-	/* Add the op to the correct queue based on its type */
+	/* Add the op to the correct queue based on its type and class */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
-		result = queue_push_tail(att->req_queue, op);
+		result = queue_push_tail(att->req_queue[op->prio], op);
 		break;
 	case ATT_OP_TYPE_IND:
-		result = queue_push_tail(att->ind_queue, op);
+		result = queue_push_tail(att->ind_queue[op->prio], op);
 		break;
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NFY:
@@ -1498,13 +2180,12 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	case ATT_OP_TYPE_RSP:
 	case ATT_OP_TYPE_CONF:
 	default:
-		result = queue_push_tail(att->write_queue, op);
+		result = queue_push_tail(att->write_queue[op->prio], op);
 		break;
 	}
 
 	if (!result) {
-		free(op->pdu);
-		free(op);
+		free_att_send_op(op);
 		return 0;
 	}
 
@@ -1513,6 +2194,106 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	return op->id;
 }
 
+static unsigned int att_send(struct bt_att *att, uint8_t opcode,
+				const struct iovec *iov, int iovcnt, bool ref,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
+{
+	struct att_send_op *op;
+
+	if (!att || queue_isempty(att->chans))
+		return 0;
+
+	op = create_att_send_op(att, opcode, iov, iovcnt, ref, callback,
+							user_data, destroy);
+	if (!op)
+		return 0;
+
+	return queue_att_send_op(att, op);
+}
+
+unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
+				const void *pdu, uint16_t length,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
+{
+	struct iovec iov;
+
+	if (length && !pdu)
+		return 0;
+
+	iov.iov_base = (void *) pdu;
+	iov.iov_len = length;
+
+	return att_send(att, opcode, &iov, 1, false, callback, user_data,
+								destroy);
+}
+
+unsigned int bt_att_sendv(struct bt_att *att, uint8_t opcode,
+				const struct iovec *iov, int iovcnt,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
+{
+	return att_send(att, opcode, iov, iovcnt, false, callback, user_data,
+								destroy);
+}
+
+unsigned int bt_att_sendv_ref(struct bt_att *att, uint8_t opcode,
+				const struct iovec *iov, int iovcnt,
+				void *user_data, bt_att_destroy_func_t destroy)
+{
+	return att_send(att, opcode, iov, iovcnt, true, NULL, user_data,
+								destroy);
+}
+
+static bool match_op_key(const void *a, const void *b)
+{
+	const struct att_send_op *op = a;
+
+	return op->key == PTR_TO_UINT(b);
+}
+
+unsigned int bt_att_sendv_latest(struct bt_att *att, uint16_t key,
+				uint8_t opcode, const struct iovec *iov,
+				int iovcnt)
+{
+	struct att_send_op *op, *old;
+	enum att_op_type type = get_op_type(opcode);
+
+	if (!att || !key || queue_isempty(att->chans))
+		return 0;
+
+	if (type != ATT_OP_TYPE_CMD && type != ATT_OP_TYPE_NFY)
+		return 0;
+
+	op = create_att_send_op(att, opcode, iov, iovcnt, false, NULL, NULL,
+									NULL);
+	if (!op)
+		return 0;
+
+	old = queue_find(att->latest_ops, match_op_key, UINT_TO_PTR(key));
+	if (old && old->opcode == opcode) {
+		/* Swap the PDU, the queued op keeps its place and id */
+		pdu_free(att, old->pdu, old->len);
+		old->pdu = op->pdu;
+		old->len = op->len;
+		op->pdu = NULL;
+		free_att_send_op(op);
+
+		att->stats.tx_replaced++;
+
+		return old->id;
+	}
+
+	if (old)
+		latest_op_unlink(old);
+
+	op->key = key;
+	queue_push_tail(att->latest_ops, op);
+
+	return queue_att_send_op(att, op);
+}
+
 unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 				const void *pdu, uint16_t len,
 				bt_att_response_func_t callback,
@@ -1520,18 +2301,24 @@ unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 				bt_att_destroy_func_t destroy)
 {
 	struct att_send_op *op;
+	struct iovec iov;
 
 	if (!chan || !chan->att)
 		return -EINVAL;
 
-	op = create_att_send_op(chan->att, opcode, pdu, len, callback,
+	if (len && !pdu)
+		return -EINVAL;
+
+	iov.iov_base = (void *) pdu;
+	iov.iov_len = len;
+
+	op = create_att_send_op(chan->att, opcode, &iov, 1, false, callback,
 						user_data, destroy);
 	if (!op)
 		return -EINVAL;
 
 	if (!queue_push_tail(chan->queue, op)) {
-		free(op->pdu);
-		free(op);
+		free_att_send_op(op);
 		return 0;
 	}
 
@@ -1579,6 +2366,7 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 {
 	const struct queue_entry *entry;
 	struct att_send_op *op;
+	int i;
 
 	if (!att || !id)
 		return false;
@@ -1592,17 +2380,22 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 			return true;
 	}
 
-	op = queue_remove_if(att->req_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		op = queue_remove_if(att->req_queue[i], match_op_id,
+							UINT_TO_PTR(id));
+		if (op)
+			goto done;
 
-	op = queue_remove_if(att->ind_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
+		op = queue_remove_if(att->ind_queue[i], match_op_id,
+							UINT_TO_PTR(id));
+		if (op)
+			goto done;
 
-	op = queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
+		op = queue_remove_if(att->write_queue[i], match_op_id,
+							UINT_TO_PTR(id));
+		if (op)
+			goto done;
+	}
 
 	if (!op)
 		return false;
@@ -1618,13 +2411,19 @@ done:
 bool bt_att_cancel_all(struct bt_att *att)
 {
 	const struct queue_entry *entry;
+	int i;
 
 	if (!att)
 		return false;
 
-	queue_remove_all(att->req_queue, NULL, NULL, destroy_att_send_op);
-	queue_remove_all(att->ind_queue, NULL, NULL, destroy_att_send_op);
-	queue_remove_all(att->write_queue, NULL, NULL, destroy_att_send_op);
+	for (i = 0; i < BT_ATT_PRIO_COUNT; i++) {
+		queue_remove_all(att->req_queue[i], NULL, NULL,
+							destroy_att_send_op);
+		queue_remove_all(att->ind_queue[i], NULL, NULL,
+							destroy_att_send_op);
+		queue_remove_all(att->write_queue[i], NULL, NULL,
+							destroy_att_send_op);
+	}
 
 	for (entry = queue_get_entries(att->chans); entry;
 						entry = entry->next) {
@@ -1701,6 +2500,7 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_destroy_func_t destroy)
 {
 	struct att_notify *notify;
+	int i;
 
 	if (!att || !callback || queue_isempty(att->chans))
 		return 0;
@@ -1721,12 +2521,27 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 		return 0;
 	}
 
+	/*
+	 * Index the registration under every opcode it matches, in
+	 * registration order, so that dispatching a PDU is a single lookup.
+	 */
+	for (i = 0; i < 256; i++) {
+		if (!opcode_match(opcode, i))
+			continue;
+
+		if (!att->notify_index[i])
+			att->notify_index[i] = queue_new();
+
+		queue_push_tail(att->notify_index[i], notify);
+	}
+
 	return notify->id;
 }
 
 bool bt_att_unregister(struct bt_att *att, unsigned int id)
 {
 	struct att_notify *notify;
+	int i;
 
 	if (!att || !id)
 		return false;
@@ -1736,15 +2551,26 @@ bool bt_att_unregister(struct bt_att *att, unsigned int id)
 	if (!notify)
 		return false;
 
+	if (notify->opcode != BT_ATT_ALL_REQUESTS)
+		queue_remove(att->notify_index[notify->opcode], notify);
+	else
+		for (i = 0; i < 256; i++)
+			queue_remove(att->notify_index[i], notify);
+
 	destroy_att_notify(notify);
 	return true;
 }
 
 bool bt_att_unregister_all(struct bt_att *att)
 {
+	int i;
+
 	if (!att)
 		return false;
 
+	for (i = 0; i < 256; i++)
+		queue_remove_all(att->notify_index[i], NULL, NULL, NULL);
+
 	queue_remove_all(att->notify_list, NULL, NULL, destroy_att_notify);
 	queue_remove_all(att->disconn_list, NULL, NULL, destroy_att_disconn);
 
@@ -1767,12 +2593,31 @@ int bt_att_get_security(struct bt_att *att, uint8_t *enc_size)
 	if (ret < 0)
 		return ret;
 
+	/* A key size set by the owner wins over the one of the socket */
 	if (enc_size)
-		*enc_size = att->enc_size;
+		*enc_size = att->enc_size ? att->enc_size : chan->enc_size;
 
 	return ret;
 }
 
+bool bt_att_refresh_security(struct bt_att *att)
+{
+	struct bt_att_chan *chan;
+	int old;
+
+	if (!att)
+		return false;
+
+	chan = queue_peek_tail(att->chans);
+	if (!chan || chan->type == BT_ATT_LOCAL)
+		return false;
+
+	old = chan->sec_cache;
+	chan->sec_cache = -1;
+
+	return bt_att_chan_get_security(chan) != old;
+}
+
 bool bt_att_set_security(struct bt_att *att, int level)
 {
 	struct bt_att_chan *chan;
@@ -33,6 +33,30 @@
 #include "bluez/util.h"
 #include "bluez/crypto.h"
 
+/*
+ * Two backends are available, selected at build time:
+ *
+ *  - BT_CRYPTO_SOFT (the build default), which runs AES-128 and AES-CMAC
+ *    in-process (AES-NI when the CPU has it, a constant-time portable
+ *    implementation otherwise) and serves random bytes from small
+ *    per-thread getrandom() backed pools, and
+ *  - the kernel crypto API over AF_ALG sockets as upstream does, which
+ *    costs a socket accept plus send/read round trip per operation.
+ *
+ * Both produce identical results; only the aes_ecb() / aes_cmac_iov() and
+ * random helpers below differ.
+ */
+#ifdef BT_CRYPTO_SOFT
+#include <errno.h>
+#include <sys/random.h>
+
+#include "bluez/aes.h"
+
+/* Random bytes fetched per getrandom() call */
+#define RANDOM_POOL_SIZE	256
+
+#else
+
 #ifndef HAVE_LINUX_IF_ALG_H
 #ifndef HAVE_LINUX_TYPES_H
 typedef uint8_t __u8;
@@ -72,16 +96,121 @@ struct af_alg_iv {
 #define SOL_ALG		279
 #endif
 
+#endif /* BT_CRYPTO_SOFT */
+
 /* Maximum message length that can be passed to aes_cmac */
 #define CMAC_MSG_MAX	80
 
 struct bt_crypto {
 	int ref_count;
+#ifndef BT_CRYPTO_SOFT
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
+#endif
 };
 
+#ifdef BT_CRYPTO_SOFT
+
+/*
+ * One pool per thread rather than per bt_crypto: reactor threads share a
+ * bt_crypto through the bt_att and gatt_db they hold, and this way
+ * handing out bytes needs no lock.
+ */
+static __thread struct {
+	uint8_t bytes[RANDOM_POOL_SIZE];
+	unsigned int avail;
+} random_pool;
+
+struct bt_crypto *bt_crypto_new(void)
+{
+	struct bt_crypto *crypto;
+
+	crypto = new0(struct bt_crypto, 1);
+
+	return bt_crypto_ref(crypto);
+}
+
+static void crypto_free(struct bt_crypto *crypto)
+{
+	free(crypto);
+}
+
+static bool random_fill(uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = getrandom(buf, len, 0);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+bool bt_crypto_random_bytes(struct bt_crypto *crypto,
+					void *buf, uint8_t num_bytes)
+{
+	uint8_t *pool;
+
+	if (!crypto)
+		return false;
+
+	if (random_pool.avail < num_bytes) {
+		if (!random_fill(random_pool.bytes, sizeof(random_pool.bytes)))
+			return false;
+
+		random_pool.avail = sizeof(random_pool.bytes);
+	}
+
+	/* Consume from the end of the pool and never hand out bytes twice */
+	random_pool.avail -= num_bytes;
+	pool = random_pool.bytes + random_pool.avail;
+	memcpy(buf, pool, num_bytes);
+	explicit_bzero(pool, num_bytes);
+
+	return true;
+}
+
+/* AES-128 encryption of a single block, MSB first as with AF_ALG */
+static bool aes_ecb(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t in[16], uint8_t out[16])
+{
+	struct bt_aes128 ctx;
+
+	bt_aes128_set_key(&ctx, key);
+	bt_aes128_encrypt(&ctx, in, out);
+	bt_aes128_clear(&ctx);
+
+	return true;
+}
+
+/* AES-CMAC over the concatenation of iov, MSB first as with AF_ALG */
+static bool aes_cmac_iov(struct bt_crypto *crypto, const uint8_t key[16],
+				const struct iovec *iov, size_t iov_len,
+				uint8_t out[16])
+{
+	struct bt_aes_cmac ctx;
+	size_t i;
+
+	bt_aes_cmac_init(&ctx, key);
+
+	for (i = 0; i < iov_len; i++)
+		bt_aes_cmac_update(&ctx, iov[i].iov_base, iov[i].iov_len);
+
+	bt_aes_cmac_final(&ctx, out);
+
+	return true;
+}
+
+#else
+
 static int urandom_setup(void)
 {
 	int fd;
@@ -167,24 +296,8 @@ struct bt_crypto *bt_crypto_new(void)
 	return bt_crypto_ref(crypto);
 }
 
-struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
+static void crypto_free(struct bt_crypto *crypto)
 {
-	if (!crypto)
-		return NULL;
-
-	__sync_fetch_and_add(&crypto->ref_count, 1);
-
-	return crypto;
-}
-
-void bt_crypto_unref(struct bt_crypto *crypto)
-{
-	if (!crypto)
-		return;
-
-	if (__sync_sub_and_fetch(&crypto->ref_count, 1))
-		return;
-
 	close(crypto->urandom);
 	close(crypto->ecb_aes);
 	close(crypto->cmac_aes);
@@ -255,6 +368,78 @@ static bool alg_encrypt(int fd, const void *inbuf, size_t inlen,
 	return true;
 }
 
+/* AES-128 encryption of a single block, MSB first */
+static bool aes_ecb(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t in[16], uint8_t out[16])
+{
+	int fd;
+
+	fd = alg_new(crypto->ecb_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	if (!alg_encrypt(fd, in, 16, out, 16)) {
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+/* AES-CMAC over the concatenation of iov, MSB first */
+static bool aes_cmac_iov(struct bt_crypto *crypto, const uint8_t key[16],
+				const struct iovec *iov, size_t iov_len,
+				uint8_t out[16])
+{
+	ssize_t len;
+	int fd;
+
+	fd = alg_new(crypto->cmac_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	len = writev(fd, iov, iov_len);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	len = read(fd, out, 16);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+#endif /* BT_CRYPTO_SOFT */
+
+struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
+{
+	if (!crypto)
+		return NULL;
+
+	__sync_fetch_and_add(&crypto->ref_count, 1);
+
+	return crypto;
+}
+
+void bt_crypto_unref(struct bt_crypto *crypto)
+{
+	if (!crypto)
+		return;
+
+	if (__sync_sub_and_fetch(&crypto->ref_count, 1))
+		return;
+
+	crypto_free(crypto);
+}
+
 static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 {
 	int i;
@@ -267,12 +452,11 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
 	uint8_t tmp[16], out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
 	uint8_t msg_s[msg_len];
+	struct iovec iov;
 
 	if (!crypto)
 		return false;
@@ -286,26 +470,14 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
+	iov.iov_base = msg_s;
+	iov.iov_len = msg_len;
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!aes_cmac_iov(crypto, tmp, &iov, 1, out))
 		return false;
-	}
-
-	close(fd);
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -340,7 +512,6 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
 	uint8_t tmp[16], in[16], out[16];
-	int fd;
 
 	if (!crypto)
 		return false;
@@ -348,24 +519,15 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
-
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
-		close(fd);
+	if (!aes_ecb(crypto, tmp, in, out))
 		return false;
-	}
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -572,34 +734,22 @@ static bool aes_cmac(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t *msg, size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
+	struct iovec iov;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	iov.iov_base = msg_msb;
+	iov.iov_len = msg_len;
+
+	if (!aes_cmac_iov(crypto, key_msb, &iov, 1, out))
 		return false;
-	}
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -693,29 +843,9 @@ bool bt_crypto_gatt_hash(struct bt_crypto *crypto, struct iovec *iov,
 				size_t iov_len, uint8_t res[16])
 {
 	const uint8_t key[16] = {};
-	ssize_t len;
-	int fd;
 
 	if (!crypto)
 		return false;
 
-	fd = alg_new(crypto->cmac_aes, key, 16);
-	if (fd < 0)
-		return false;
-
-	len = writev(fd, iov, iov_len);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	len = read(fd, res, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	close(fd);
-
-	return true;
+	return aes_cmac_iov(crypto, key, iov, iov_len, res);
 }
@@ -27,6 +27,8 @@
 
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include "bluez/bluetooth.h"
 #include "bluez/uuid.h"
@@ -44,7 +46,11 @@
 #define MAX_CHAR_DECL_VALUE_LEN 19
 #define MAX_INCLUDED_VALUE_LEN 6
 #define ATTRIBUTE_TIMEOUT 5000
+#define PENDING_SLOT_BITS 16
+#define PENDING_SLOT_MASK ((1U << PENDING_SLOT_BITS) - 1)
 #define HASH_UPDATE_TIMEOUT 100
+#define SNAPSHOT_STRIPES 16
+#define SNAPSHOT_RECLAIM_TIMEOUT 10
 
 static const bt_uuid_t primary_service_uuid = { .type = BT_UUID16,
 					.value.u16 = GATT_PRIM_SVC_UUID };
@@ -70,6 +76,59 @@ struct gatt_db {
 
 	gatt_db_authorize_cb_t authorize;
 	void *authorize_data;
+
+	/*
+	 * Reads and writes waiting for their *_result call. Slots are reused
+	 * through a free list and the id handed to the attribute callback is
+	 * the slot index tagged with a generation, so completing one is O(1)
+	 * and a stale id never matches. All ops share ATTRIBUTE_TIMEOUT so
+	 * expiry order is start order: one list and one timer for its head.
+	 */
+	struct pending_op *pending;
+	unsigned int pending_size;
+	int pending_free;
+	int pending_head;
+	int pending_tail;
+	unsigned int pending_timeout_id;
+
+	/*
+	 * Published attribute index, see gatt_db_snapshot_get(). Readers
+	 * count themselves on a stripe only while taking a reference, so a
+	 * replaced snapshot has no new taker once every stripe was seen idle.
+	 */
+	struct gatt_db_snapshot *snapshot;
+	struct snapshot_stripe *stripes;	/* NULL unless enabled */
+	unsigned int snapshot_gen;
+	struct queue *retired;
+	unsigned int reclaim_id;
+};
+
+struct snapshot_stripe {
+	unsigned long readers;
+} __attribute__((aligned(64)));
+
+struct snapshot_attr {
+	uint16_t handle;
+	uint16_t svc_start;
+	uint16_t svc_end;
+	uint16_t value_len;
+	uint32_t permissions;
+	bt_uuid_t uuid;
+	const uint8_t *value;		/* Declarations only */
+};
+
+struct gatt_db_snapshot {
+	int ref_count;
+	unsigned int generation;
+	unsigned int num_attrs;
+	uint16_t last_handle;
+	struct snapshot_attr *attrs;	/* Sorted by handle */
+	uint16_t *index;		/* Handle to attrs position + 1 */
+};
+
+struct snapshot_retired {
+	struct gatt_db_snapshot *snap;
+	uint32_t busy;			/* Stripes not seen idle yet */
 };
 
 struct notify {
@@ -81,20 +140,18 @@ struct notify {
 	void *user_data;
 };
 
-struct pending_read {
-	struct gatt_db_attribute *attrib;
-	unsigned int id;
-	unsigned int timeout_id;
-	gatt_db_attribute_read_t func;
-	void *user_data;
-};
-
-struct pending_write {
-	struct gatt_db_attribute *attrib;
-	unsigned int id;
-	unsigned int timeout_id;
-	gatt_db_attribute_write_t func;
+struct pending_op {
+	struct gatt_db_attribute *attrib;	/* NULL while the slot is free */
+	bool write;
+	union {
+		gatt_db_attribute_read_t read;
+		gatt_db_attribute_write_t write;
+	} func;
 	void *user_data;
+	uint64_t expire;			/* CLOCK_MONOTONIC, ms */
+	unsigned int gen;
+	int prev;
+	int next;				/* Also links the free list */
 };
 
 struct gatt_db_attribute {
@@ -109,11 +166,7 @@ struct gatt_db_attribute {
 	gatt_db_write_t write_func;
 	void *user_data;
 
-	unsigned int read_id;
-	struct queue *pending_reads;
-
-	unsigned int write_id;
-	struct queue *pending_writes;
+	unsigned int pending;			/* Ops in db->pending */
 };
 
 struct gatt_db_service {
@@ -136,39 +189,160 @@ static void set_attribute_data(struct gatt_db_attribute *attribute,
 	attribute->user_data = user_data;
 }
 
-static void pending_read_result(struct pending_read *p, int err,
-					const uint8_t *data, size_t length)
+static uint64_t get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool pending_timeout(void *user_data);
+
+static void pending_arm(struct gatt_db *db)
+{
+	uint64_t now, expire;
+
+	if (db->pending_timeout_id || db->pending_head < 0)
+		return;
+
+	now = get_time_ms();
+	expire = db->pending[db->pending_head].expire;
+
+	db->pending_timeout_id = timeout_add(expire > now ? expire - now : 0,
+						pending_timeout, db, NULL);
+}
+
+static int pending_new(struct gatt_db *db, struct gatt_db_attribute *attrib)
+{
+	struct pending_op *p;
+	int slot;
+
+	if (db->pending_free < 0) {
+		unsigned int size, i;
+
+		size = db->pending_size ? db->pending_size * 2 : 8;
+		if (size > PENDING_SLOT_MASK)
+			return -1;
+
+		p = realloc(db->pending, size * sizeof(*p));
+		if (!p)
+			return -1;
+
+		memset(p + db->pending_size, 0,
+				(size - db->pending_size) * sizeof(*p));
+
+		for (i = db->pending_size; i < size; i++)
+			p[i].next = i + 1 < size ? (int) i + 1 : -1;
+
+		db->pending_free = db->pending_size;
+		db->pending = p;
+		db->pending_size = size;
+	}
+
+	slot = db->pending_free;
+	p = &db->pending[slot];
+	db->pending_free = p->next;
+
+	p->attrib = attrib;
+	p->expire = get_time_ms() + ATTRIBUTE_TIMEOUT;
+
+	/* Appending keeps the list sorted since the timeout is fixed */
+	p->prev = db->pending_tail;
+	p->next = -1;
+	if (db->pending_tail >= 0)
+		db->pending[db->pending_tail].next = slot;
+	else
+		db->pending_head = slot;
+	db->pending_tail = slot;
+
+	attrib->pending++;
+
+	pending_arm(db);
+
+	return slot;
+}
+
+static unsigned int pending_id(struct gatt_db *db, int slot)
+{
+	return (db->pending[slot].gen << PENDING_SLOT_BITS) | (slot + 1);
+}
+
+static int pending_lookup(struct gatt_db *db, struct gatt_db_attribute *attrib,
+						unsigned int id, bool write)
 {
-	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+	unsigned int slot = (id & PENDING_SLOT_MASK) - 1;
+	struct pending_op *p;
+
+	if (slot >= db->pending_size)
+		return -1;
 
-	p->func(p->attrib, err, data, length, p->user_data);
+	p = &db->pending[slot];
+	if (p->attrib != attrib || p->write != write ||
+				p->gen != (id >> PENDING_SLOT_BITS))
+		return -1;
 
-	free(p);
+	return slot;
 }
 
-static void pending_read_free(void *data)
+/*
+ * Releases the slot before calling back since the callback may start new
+ * operations and grow the table.
+ */
+static void pending_complete(struct gatt_db *db, int slot, int err,
+					const uint8_t *data, size_t length)
 {
-	struct pending_read *p = data;
+	struct pending_op *p = &db->pending[slot];
+	struct pending_op op = *p;
+
+	if (p->prev >= 0)
+		db->pending[p->prev].next = p->next;
+	else
+		db->pending_head = p->next;
+
+	if (p->next >= 0)
+		db->pending[p->next].prev = p->prev;
+	else
+		db->pending_tail = p->prev;
+
+	p->attrib->pending--;
+	p->attrib = NULL;
+	p->gen = (p->gen + 1) & (UINT_MAX >> PENDING_SLOT_BITS);
+	p->next = db->pending_free;
+	db->pending_free = slot;
 
-	pending_read_result(p, -ECANCELED, NULL, 0);
+	if (op.write)
+		op.func.write(op.attrib, err, op.user_data);
+	else
+		op.func.read(op.attrib, err, data, length, op.user_data);
 }
 
-static void pending_write_result(struct pending_write *p, int err)
+static bool pending_timeout(void *user_data)
 {
-	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+	struct gatt_db *db = user_data;
+	uint64_t now = get_time_ms();
+
+	db->pending_timeout_id = 0;
 
-	p->func(p->attrib, err, p->user_data);
+	while (db->pending_head >= 0 &&
+				db->pending[db->pending_head].expire <= now)
+		pending_complete(db, db->pending_head, -ETIMEDOUT, NULL, 0);
 
-	free(p);
+	pending_arm(db);
+
+	return false;
 }
 
-static void pending_write_free(void *data)
+static void pending_cancel(struct gatt_db *db,
+					struct gatt_db_attribute *attrib)
 {
-	struct pending_write *p = data;
+	unsigned int i;
 
-	pending_write_result(p, -ECANCELED);
+	for (i = 0; i < db->pending_size && attrib->pending; i++) {
+		if (db->pending[i].attrib == attrib)
+			pending_complete(db, i, -ECANCELED, NULL, 0);
+	}
 }
 
 static void attribute_destroy(struct gatt_db_attribute *attribute)
@@ -177,8 +351,8 @@ static void attribute_destroy(struct gatt_db_attribute *attribute)
 	if (!attribute)
 		return;
 
-	queue_destroy(attribute->pending_reads, pending_read_free);
-	queue_destroy(attribute->pending_writes, pending_write_free);
+	if (attribute->pending)
+		pending_cancel(attribute->service->db, attribute);
 
 	free(attribute->value);
 	free(attribute);
@@ -206,9 +380,6 @@ static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
 		memcpy(attribute->value, val, len);
 	}
 
-	attribute->pending_reads = queue_new();
-	attribute->pending_writes = queue_new();
-
 	return attribute;
 
 failed:
@@ -235,6 +406,9 @@ struct gatt_db *gatt_db_new(void)
 	db->services = queue_new();
 	db->notify_list = queue_new();
 	db->next_handle = 0x0001;
+	db->pending_free = -1;
+	db->pending_head = -1;
+	db->pending_tail = -1;
 
 	return gatt_db_ref(db);
 }
@@ -292,6 +466,7 @@ static void gen_hash_m(struct gatt_db_attribute *attr, void *user_data)
 	case GATT_SND_SVC_UUID:
 	case GATT_INCLUDE_UUID:
 	case GATT_CHARAC_UUID:
+	case GATT_CHARAC_EXT_PROPER_UUID:
 		/* Allocate space for handle + type + value */
 		len = 2 + 2 + attr->value_len;
 		data = malloc(2 + 2 + attr->value_len);
@@ -352,12 +527,18 @@ static bool db_hash_update(void *user_data)
 	return false;
 }
 
+static void snapshot_publish(struct gatt_db *db);
+
 static void notify_service_changed(struct gatt_db *db,
 						struct gatt_db_service *service,
 						bool added)
 {
 	struct notify_data data;
 
+	/* Readers see the change before anyone is told about it */
+	if (db->stripes)
+		snapshot_publish(db);
+
 	if (queue_isempty(db->notify_list))
 		return;
 
@@ -381,8 +562,11 @@ static void gatt_db_service_destroy(void *data)
 	struct gatt_db_service *service = data;
 	int i;
 
-	if (service->active)
+	if (service->active) {
+		/* Leaves the published index along with the queue */
+		service->active = false;
 		notify_service_changed(service->db, service, false);
+	}
 
 	for (i = 0; i < service->num_handles; i++)
 		attribute_destroy(service->attributes[i]);
@@ -391,11 +575,22 @@ static void gatt_db_service_destroy(void *data)
 	free(service);
 }
 
+static void snapshot_retired_free(void *data);
+
 static void gatt_db_destroy(struct gatt_db *db)
 {
 	if (!db)
 		return;
 
+	/* Reader threads are gone by now, nothing to wait for */
+	if (db->reclaim_id)
+		timeout_remove(db->reclaim_id);
+
+	queue_destroy(db->retired, snapshot_retired_free);
+	gatt_db_snapshot_unref(db->snapshot);
+	free(db->stripes);
+	db->stripes = NULL;
+
 	bt_crypto_unref(db->crypto);
 
 	/*
@@ -409,6 +604,11 @@ static void gatt_db_destroy(struct gatt_db *db)
 		timeout_remove(db->hash_id);
 
 	queue_destroy(db->services, gatt_db_service_destroy);
+
+	if (db->pending_timeout_id)
+		timeout_remove(db->pending_timeout_id);
+
+	free(db->pending);
 	free(db);
 }
 
@@ -1769,19 +1969,6 @@ gatt_db_attribute_get_permissions(const struct gatt_db_attribute *attrib)
 	return attrib->permissions;
 }
 
-static bool read_timeout(void *user_data)
-{
-	struct pending_read *p = user_data;
-
-	p->timeout_id = 0;
-
-	queue_remove(p->attrib->pending_reads, p);
-
-	pending_read_result(p, -ETIMEDOUT, NULL, 0);
-
-	return false;
-}
-
 static uint8_t attribute_authorize(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att)
 {
@@ -1803,7 +1990,8 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 		return false;
 
 	if (attrib->read_func) {
-		struct pending_read *p;
+		struct gatt_db *db = attrib->service->db;
+		int slot;
 		uint8_t err;
 
 		err = attribute_authorize(attrib, opcode, att);
@@ -1812,18 +2000,16 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 			return true;
 		}
 
-		p = new0(struct pending_read, 1);
-		p->attrib = attrib;
-		p->id = ++attrib->read_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, read_timeout,
-								p, NULL);
-		p->func = func;
-		p->user_data = user_data;
+		slot = pending_new(db, attrib);
+		if (slot < 0)
+			return false;
 
-		queue_push_tail(attrib->pending_reads, p);
+		db->pending[slot].write = false;
+		db->pending[slot].func.read = func;
+		db->pending[slot].user_data = user_data;
 
-		attrib->read_func(attrib, p->id, offset, opcode, att,
-							attrib->user_data);
+		attrib->read_func(attrib, pending_id(db, slot), offset, opcode,
+							att, attrib->user_data);
 		return true;
 	}
 
@@ -1841,46 +2027,27 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 	return true;
 }
 
-static bool find_pending(const void *a, const void *b)
-{
-	const struct pending_read *p = a;
-	unsigned int id = PTR_TO_UINT(b);
-
-	return p->id == id;
-}
-
 bool gatt_db_attribute_read_result(struct gatt_db_attribute *attrib,
 					unsigned int id, int err,
 					const uint8_t *value, size_t length)
 {
-	struct pending_read *p;
+	struct gatt_db *db;
+	int slot;
 
 	if (!attrib || !id)
 		return false;
 
-	p = queue_remove_if(attrib->pending_reads, find_pending,
-							UINT_TO_PTR(id));
-	if (!p)
+	db = attrib->service->db;
+
+	slot = pending_lookup(db, attrib, id, false);
+	if (slot < 0)
 		return false;
 
-	pending_read_result(p, err, value, length);
+	pending_complete(db, slot, err, value, length);
 
 	return true;
 }
 
-static bool write_timeout(void *user_data)
-{
-	struct pending_write *p = user_data;
-
-	p->timeout_id = 0;
-
-	queue_remove(p->attrib->pending_writes, p);
-
-	pending_write_result(p, -ETIMEDOUT);
-
-	return false;
-}
-
 bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 					const uint8_t *value, size_t len,
 					uint8_t opcode, struct bt_att *att,
@@ -1891,7 +2058,8 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 		return false;
 
 	if (attrib->write_func) {
-		struct pending_write *p;
+		struct gatt_db *db = attrib->service->db;
+		int slot;
 		uint8_t err;
 
 		err = attribute_authorize(attrib, opcode, att);
@@ -1900,18 +2068,16 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 			return true;
 		}
 
-		p = new0(struct pending_write, 1);
-		p->attrib = attrib;
-		p->id = ++attrib->write_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, write_timeout,
-								p, NULL);
-		p->func = func;
-		p->user_data = user_data;
+		slot = pending_new(db, attrib);
+		if (slot < 0)
+			return false;
 
-		queue_push_tail(attrib->pending_writes, p);
+		db->pending[slot].write = true;
+		db->pending[slot].func.write = func;
+		db->pending[slot].user_data = user_data;
 
-		attrib->write_func(attrib, p->id, offset, value, len, opcode,
-							att, attrib->user_data);
+		attrib->write_func(attrib, pending_id(db, slot), offset, value,
+						len, opcode, att, attrib->user_data);
 		return true;
 	}
 
@@ -1948,17 +2114,73 @@ done:
 bool gatt_db_attribute_write_result(struct gatt_db_attribute *attrib,
 						unsigned int id, int err)
 {
-	struct pending_write *p;
+	struct gatt_db *db;
+	int slot;
 
 	if (!attrib || !id)
 		return false;
 
-	p = queue_remove_if(attrib->pending_writes, find_pending,
-							UINT_TO_PTR(id));
-	if (!p)
+	db = attrib->service->db;
+
+	slot = pending_lookup(db, attrib, id, true);
+	if (slot < 0)
+		return false;
+
+	pending_complete(db, slot, err, NULL, 0);
+
+	return true;
+}
+
+/* Values the Database Hash covers, see Core Vol 3 Part G 7.3.1 */
+static bool value_is_hashed(const struct gatt_db_attribute *attrib)
+{
+	if (bt_uuid_len(&attrib->uuid) != 2)
+		return false;
+
+	switch (attrib->uuid.value.u16) {
+	case GATT_PRIM_SVC_UUID:
+	case GATT_SND_SVC_UUID:
+	case GATT_INCLUDE_UUID:
+	case GATT_CHARAC_UUID:
+	case GATT_CHARAC_EXT_PROPER_UUID:
+		return true;
+	}
+
+	return false;
+}
+
+bool gatt_db_attribute_set_value(struct gatt_db_attribute *attrib,
+					const uint8_t *value, size_t len)
+{
+	uint8_t *buf = NULL;
+
+	if (!attrib || len > BT_ATT_MAX_VALUE_LEN || (len && !value))
 		return false;
 
-	pending_write_result(p, err);
+	if (len == attrib->value_len &&
+			(!len || !memcmp(attrib->value, value, len)))
+		return true;
+
+	if (len) {
+		buf = malloc(len);
+		if (!buf)
+			return false;
+
+		memcpy(buf, value, len);
+	}
+
+	free(attrib->value);
+	attrib->value = buf;
+	attrib->value_len = len;
+
+	/*
+	 * A client caches what discovery returned, so a hashed value changing
+	 * under an active service is a change of that service: watchers drop
+	 * their caches and the hash is regenerated.
+	 */
+	if (value_is_hashed(attrib) && attrib->service->active)
+		notify_service_changed(attrib->service->db, attrib->service,
+									true);
 
 	return true;
 }
@@ -1985,3 +2207,394 @@ void *gatt_db_attribute_get_user_data(struct gatt_db_attribute *attrib)
 
 	return attrib->user_data;
 }
+
+static int snapshot_attr_cmp(const void *a, const void *b)
+{
+	const struct snapshot_attr *attr_a = a;
+	const struct snapshot_attr *attr_b = b;
+
+	return (int) attr_a->handle - (int) attr_b->handle;
+}
+
+static bool is_declaration(const struct gatt_db_attribute *attrib)
+{
+	return !bt_uuid_cmp(&attrib->uuid, &primary_service_uuid) ||
+		!bt_uuid_cmp(&attrib->uuid, &secondary_service_uuid) ||
+		!bt_uuid_cmp(&attrib->uuid, &included_service_uuid) ||
+		!bt_uuid_cmp(&attrib->uuid, &characteristic_uuid);
+}
+
+struct snapshot_size {
+	unsigned int num_attrs;
+	size_t values;
+	uint16_t last_handle;
+};
+
+static void snapshot_size_service(void *data, void *user_data)
+{
+	struct gatt_db_service *service = data;
+	struct snapshot_size *size = user_data;
+	int i;
+
+	if (!service->active)
+		return;
+
+	for (i = 0; i < service->num_handles; i++) {
+		struct gatt_db_attribute *attrib = service->attributes[i];
+
+		if (!attrib)
+			continue;
+
+		size->num_attrs++;
+		size->last_handle = MAX(size->last_handle, attrib->handle);
+		if (is_declaration(attrib))
+			size->values += attrib->value_len;
+	}
+}
+
+struct snapshot_fill {
+	struct gatt_db_snapshot *snap;
+	uint8_t *values;
+};
+
+static void snapshot_fill_service(void *data, void *user_data)
+{
+	struct gatt_db_service *service = data;
+	struct snapshot_fill *fill = user_data;
+	uint16_t svc_start, svc_end;
+	int i;
+
+	if (!service->active)
+		return;
+
+	gatt_db_service_get_handles(service, &svc_start, &svc_end);
+
+	for (i = 0; i < service->num_handles; i++) {
+		struct gatt_db_attribute *attrib = service->attributes[i];
+		struct snapshot_attr *attr;
+
+		if (!attrib)
+			continue;
+
+		attr = &fill->snap->attrs[fill->snap->num_attrs++];
+		attr->handle = attrib->handle;
+		attr->svc_start = svc_start;
+		attr->svc_end = svc_end;
+		attr->permissions = attrib->permissions;
+		attr->uuid = attrib->uuid;
+		attr->value = NULL;
+		attr->value_len = 0;
+
+		/* Other values may change in place, readers must not see them */
+		if (is_declaration(attrib) && attrib->value_len) {
+			memcpy(fill->values, attrib->value, attrib->value_len);
+			attr->value = fill->values;
+			attr->value_len = attrib->value_len;
+			fill->values += attrib->value_len;
+		}
+	}
+}
+
+/* One allocation: header, attributes, handle index and declaration values */
+static struct gatt_db_snapshot *snapshot_build(struct gatt_db *db)
+{
+	struct snapshot_size size = {};
+	struct snapshot_fill fill;
+	struct gatt_db_snapshot *snap;
+	size_t attrs_off, index_off, values_off;
+	unsigned int i;
+
+	queue_foreach(db->services, snapshot_size_service, &size);
+
+	attrs_off = sizeof(*snap);
+	index_off = attrs_off + size.num_attrs * sizeof(struct snapshot_attr);
+	values_off = index_off + (size.last_handle + 1) * sizeof(uint16_t);
+
+	snap = malloc(values_off + size.values);
+	if (!snap)
+		return NULL;
+
+	snap->ref_count = 1;
+	snap->generation = ++db->snapshot_gen;
+	snap->num_attrs = 0;
+	snap->last_handle = size.last_handle;
+	snap->attrs = (void *) ((uint8_t *) snap + attrs_off);
+	snap->index = (void *) ((uint8_t *) snap + index_off);
+
+	fill.snap = snap;
+	fill.values = (uint8_t *) snap + values_off;
+	queue_foreach(db->services, snapshot_fill_service, &fill);
+
+	qsort(snap->attrs, snap->num_attrs, sizeof(*snap->attrs),
+							snapshot_attr_cmp);
+
+	memset(snap->index, 0, (size.last_handle + 1) * sizeof(uint16_t));
+	for (i = 0; i < snap->num_attrs; i++)
+		snap->index[snap->attrs[i].handle] = i + 1;
+
+	return snap;
+}
+
+static void snapshot_retired_free(void *data)
+{
+	struct snapshot_retired *retired = data;
+
+	gatt_db_snapshot_unref(retired->snap);
+	free(retired);
+}
+
+static bool snapshot_retired_idle(const void *data, const void *user_data)
+{
+	struct snapshot_retired *retired = (void *) data;
+	const struct gatt_db *db = user_data;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_STRIPES; i++) {
+		if (!(retired->busy & (1U << i)))
+			continue;
+
+		if (!__atomic_load_n(&db->stripes[i].readers,
+							__ATOMIC_SEQ_CST))
+			retired->busy &= ~(1U << i);
+	}
+
+	return !retired->busy;
+}
+
+static bool snapshot_reclaim(void *user_data)
+{
+	struct gatt_db *db = user_data;
+
+	queue_remove_all(db->retired, snapshot_retired_idle, db,
+						snapshot_retired_free);
+
+	if (!queue_isempty(db->retired))
+		return true;
+
+	db->reclaim_id = 0;
+	return false;
+}
+
+static void snapshot_publish(struct gatt_db *db)
+{
+	struct gatt_db_snapshot *snap, *old;
+	struct snapshot_retired *retired;
+
+	/* Keep serving the old index rather than none */
+	snap = snapshot_build(db);
+	if (!snap)
+		return;
+
+	old = __atomic_exchange_n(&db->snapshot, snap, __ATOMIC_SEQ_CST);
+	if (!old)
+		return;
+
+	/*
+	 * A reader still counted on a stripe may have loaded the old pointer
+	 * without holding a reference yet. One seen idle after the exchange
+	 * loads the new one, so the publish reference goes once all were.
+	 */
+	retired = new0(struct snapshot_retired, 1);
+	retired->snap = old;
+	retired->busy = (1U << SNAPSHOT_STRIPES) - 1;
+	queue_push_tail(db->retired, retired);
+
+	if (snapshot_reclaim(db) && !db->reclaim_id)
+		db->reclaim_id = timeout_add(SNAPSHOT_RECLAIM_TIMEOUT,
+						snapshot_reclaim, db, NULL);
+}
+
+bool gatt_db_enable_snapshots(struct gatt_db *db)
+{
+	if (!db)
+		return false;
+
+	if (db->stripes)
+		return true;
+
+	db->stripes = aligned_alloc(__alignof__(struct snapshot_stripe),
+			SNAPSHOT_STRIPES * sizeof(struct snapshot_stripe));
+	if (!db->stripes)
+		return false;
+
+	memset(db->stripes, 0,
+			SNAPSHOT_STRIPES * sizeof(struct snapshot_stripe));
+	db->retired = queue_new();
+
+	snapshot_publish(db);
+	if (!db->snapshot) {
+		queue_destroy(db->retired, NULL);
+		db->retired = NULL;
+		free(db->stripes);
+		db->stripes = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void gatt_db_snapshot_publish(struct gatt_db *db)
+{
+	if (!db || !db->stripes)
+		return;
+
+	snapshot_publish(db);
+}
+
+static unsigned int snapshot_stripe(void)
+{
+	static unsigned int next;
+	static __thread int stripe = -1;
+
+	/* Threads spread round robin so a few readers never share one */
+	if (stripe < 0)
+		stripe = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) %
+							SNAPSHOT_STRIPES;
+
+	return stripe;
+}
+
+struct gatt_db_snapshot *gatt_db_snapshot_get(struct gatt_db *db)
+{
+	struct snapshot_stripe *stripe;
+	struct gatt_db_snapshot *snap;
+
+	if (!db || !db->stripes)
+		return NULL;
+
+	stripe = &db->stripes[snapshot_stripe()];
+
+	__atomic_fetch_add(&stripe->readers, 1, __ATOMIC_SEQ_CST);
+	snap = __atomic_load_n(&db->snapshot, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&snap->ref_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&stripe->readers, 1, __ATOMIC_RELEASE);
+
+	return snap;
+}
+
+struct gatt_db_snapshot *gatt_db_snapshot_ref(struct gatt_db_snapshot *snap)
+{
+	if (!snap)
+		return NULL;
+
+	__sync_fetch_and_add(&snap->ref_count, 1);
+
+	return snap;
+}
+
+void gatt_db_snapshot_unref(struct gatt_db_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	if (__sync_sub_and_fetch(&snap->ref_count, 1))
+		return;
+
+	free(snap);
+}
+
+unsigned int gatt_db_snapshot_get_generation(
+				const struct gatt_db_snapshot *snap)
+{
+	return snap ? snap->generation : 0;
+}
+
+static const struct snapshot_attr *
+snapshot_lookup(const struct gatt_db_snapshot *snap, uint16_t handle)
+{
+	if (!snap || !handle || handle > snap->last_handle ||
+						!snap->index[handle])
+		return NULL;
+
+	return &snap->attrs[snap->index[handle] - 1];
+}
+
+bool gatt_db_snapshot_get_attribute(const struct gatt_db_snapshot *snap,
+					uint16_t handle, bt_uuid_t *type,
+					uint32_t *permissions)
+{
+	const struct snapshot_attr *attr = snapshot_lookup(snap, handle);
+
+	if (!attr)
+		return false;
+
+	if (type)
+		*type = attr->uuid;
+
+	if (permissions)
+		*permissions = attr->permissions;
+
+	return true;
+}
+
+bool gatt_db_snapshot_get_service_handles(const struct gatt_db_snapshot *snap,
+					uint16_t handle,
+					uint16_t *start_handle,
+					uint16_t *end_handle)
+{
+	const struct snapshot_attr *attr = snapshot_lookup(snap, handle);
+
+	if (!attr)
+		return false;
+
+	if (start_handle)
+		*start_handle = attr->svc_start;
+
+	if (end_handle)
+		*end_handle = attr->svc_end;
+
+	return true;
+}
+
+const uint8_t *gatt_db_snapshot_get_value(const struct gatt_db_snapshot *snap,
+					uint16_t handle, size_t *len)
+{
+	const struct snapshot_attr *attr = snapshot_lookup(snap, handle);
+
+	if (!attr || !attr->value)
+		return NULL;
+
+	if (len)
+		*len = attr->value_len;
+
+	return attr->value;
+}
+
+unsigned int gatt_db_snapshot_find_by_type(const struct gatt_db_snapshot *snap,
+					uint16_t start_handle,
+					uint16_t end_handle,
+					const bt_uuid_t *type,
+					uint16_t *handles,
+					unsigned int max)
+{
+	unsigned int lo, hi, count = 0;
+
+	if (!snap || !type || start_handle > end_handle)
+		return 0;
+
+	/* First attribute at or after start_handle */
+	lo = 0;
+	hi = snap->num_attrs;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (snap->attrs[mid].handle < start_handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < snap->num_attrs && count < max; lo++) {
+		const struct snapshot_attr *attr = &snap->attrs[lo];
+
+		if (attr->handle > end_handle)
+			break;
+
+		if (bt_uuid_cmp(&attr->uuid, type))
+			continue;
+
+		handles[count++] = attr->handle;
+	}
+
+	return count;
+}
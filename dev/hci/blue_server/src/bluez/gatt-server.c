@@ -51,6 +51,8 @@
  * perhaps an API to set this value if there is a use case for it.
  */
 #define DEFAULT_MAX_PREP_QUEUE_LEN 30
+#define DEFAULT_PREP_BUDGET (4 * BT_ATT_MAX_VALUE_LEN)
+#define RELIABLE_CACHE_SIZE 8
 
 #define NFY_MULT_TIMEOUT 10
 
@@ -81,19 +83,25 @@ struct prep_write_data {
 	bool reliable_supported;
 };
 
+/* Values point into the server's prep buffer, only the entry is freed */
 static void prep_write_data_destroy(void *user_data)
 {
-	struct prep_write_data *data = user_data;
-
-	free(data->value);
-	free(data);
+	free(user_data);
 }
 
+struct reliable_cache {
+	uint16_t handle;			/* 0 if unused */
+	bool supported;
+};
+
 struct nfy_mult_data {
+	struct bt_gatt_server *server;	/* NULL once the server is freed */
 	unsigned int id;
 	uint8_t *pdu;
 	uint16_t offset;
 	uint16_t len;
+	unsigned int count;
+	bool due;			/* Waits for the previous PDU to go */
 };
 
 struct bt_gatt_server {
@@ -121,6 +129,20 @@ struct bt_gatt_server {
 	struct queue *prep_queue;
 	unsigned int max_prep_queue_len;
 
+	/*
+	 * Queued values are packed back to back in one buffer of prep_budget
+	 * bytes allocated on first use. Long writes only ever extend the tail
+	 * entry, which sits at the end of the buffer, so every chunk is a
+	 * plain copy. The buffer is rewound once the queue drains.
+	 */
+	uint8_t *prep_buf;
+	uint16_t prep_buf_size;
+	uint16_t prep_buf_len;
+	uint16_t prep_budget;
+
+	struct reliable_cache reliable_cache[RELIABLE_CACHE_SIZE];
+	unsigned int db_id;
+
 	struct async_read_op *pending_read_op;
 	struct async_write_op *pending_write_op;
 
@@ -132,8 +154,19 @@ struct bt_gatt_server {
 	void *authorize_data;
 
 	struct nfy_mult_data *nfy_mult;
+	unsigned int nfy_mult_window;
+	struct queue *nfy_mult_sent;	/* Batches ATT has not written yet */
+
+	struct queue *conflate;		/* Handles that only need the latest */
 };
 
+static void nfy_mult_orphan(void *data)
+{
+	struct nfy_mult_data *nfy_mult = data;
+
+	nfy_mult->server = NULL;
+}
+
 static void bt_gatt_server_free(struct bt_gatt_server *server)
 {
 	if (server->debug_destroy)
@@ -160,7 +193,18 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 		server->pending_write_op->server = NULL;
 
 	queue_destroy(server->prep_queue, prep_write_data_destroy);
+	free(server->prep_buf);
+
+	if (server->nfy_mult) {
+		timeout_remove(server->nfy_mult->id);
+		free(server->nfy_mult->pdu);
+		free(server->nfy_mult);
+	}
 
+	queue_destroy(server->nfy_mult_sent, nfy_mult_orphan);
+	queue_destroy(server->conflate, NULL);
+
+	gatt_db_unregister(server->db, server->db_id);
 	gatt_db_unref(server->db);
 	bt_att_unref(server->att);
 	free(server);
@@ -408,29 +452,9 @@ static bool check_min_key_size(uint8_t min_size, uint8_t size)
 	return min_size <= size;
 }
 
-static uint8_t check_permissions(struct bt_gatt_server *server,
-				struct gatt_db_attribute *attr, uint32_t mask)
+static uint8_t check_security(struct bt_gatt_server *server, uint32_t perm,
+					int security, uint8_t enc_size)
 {
-	uint8_t enc_size;
-	uint32_t perm;
-	int security;
-
-	perm = gatt_db_attribute_get_permissions(attr);
-
-	if (perm && mask & BT_ATT_PERM_READ && !(perm & BT_ATT_PERM_READ))
-		return BT_ATT_ERROR_READ_NOT_PERMITTED;
-
-	if (perm && mask & BT_ATT_PERM_WRITE && !(perm & BT_ATT_PERM_WRITE))
-		return BT_ATT_ERROR_WRITE_NOT_PERMITTED;
-
-	perm &= mask;
-	if (!perm)
-		return 0;
-
-	security = bt_att_get_security(server->att, &enc_size);
-	if (security < 0)
-		return BT_ATT_ERROR_UNLIKELY;
-
 	if (perm & BT_ATT_PERM_SECURE) {
 		if (security < BT_ATT_SECURITY_FIPS)
 			return BT_ATT_ERROR_AUTHENTICATION;
@@ -458,6 +482,49 @@ static uint8_t check_permissions(struct bt_gatt_server *server,
 	return 0;
 }
 
+static uint8_t check_permissions(struct bt_gatt_server *server,
+				struct gatt_db_attribute *attr, uint32_t mask)
+{
+	uint8_t enc_size;
+	uint32_t perm;
+	int security;
+	uint8_t ecode;
+
+	perm = gatt_db_attribute_get_permissions(attr);
+
+	if (perm && mask & BT_ATT_PERM_READ && !(perm & BT_ATT_PERM_READ))
+		return BT_ATT_ERROR_READ_NOT_PERMITTED;
+
+	if (perm && mask & BT_ATT_PERM_WRITE && !(perm & BT_ATT_PERM_WRITE))
+		return BT_ATT_ERROR_WRITE_NOT_PERMITTED;
+
+	perm &= mask;
+	if (!perm)
+		return 0;
+
+	security = bt_att_get_security(server->att, &enc_size);
+	if (security < 0)
+		return BT_ATT_ERROR_UNLIKELY;
+
+	ecode = check_security(server, perm, security, enc_size);
+	if (!ecode)
+		return 0;
+
+	/*
+	 * The level is cached by bt_att and only goes up during a connection,
+	 * so re-read it from the socket before denying in case the link got
+	 * encrypted since it was cached.
+	 */
+	if (!bt_att_refresh_security(server->att))
+		return ecode;
+
+	security = bt_att_get_security(server->att, &enc_size);
+	if (security < 0)
+		return BT_ATT_ERROR_UNLIKELY;
+
+	return check_security(server, perm, security, enc_size);
+}
+
 static void process_read_by_type(struct async_read_op *op)
 {
 	struct bt_gatt_server *server = op->server;
@@ -491,6 +558,25 @@ error:
 	async_read_op_destroy(op);
 }
 
+static uint8_t authorize_req(struct bt_gatt_server *server,
+					uint8_t opcode, uint16_t handle)
+{
+	if (!server->authorize)
+		return 0;
+
+	return server->authorize(server->att, opcode, handle,
+						server->authorize_data);
+}
+
+static bool is_db_hash_uuid(const bt_uuid_t *uuid)
+{
+	bt_uuid_t hash_uuid;
+
+	bt_uuid16_create(&hash_uuid, GATT_CHARAC_DB_HASH);
+
+	return !bt_uuid_cmp(uuid, &hash_uuid);
+}
+
 static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 					const void *pdu, uint16_t length,
 					void *user_data)
@@ -530,6 +616,13 @@ static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
+	/* A change-unaware client may always read the Database Hash */
+	if (!is_db_hash_uuid(&type)) {
+		ecode = authorize_req(server, opcode, start);
+		if (ecode)
+			goto error;
+	}
+
 	gatt_db_read_by_type(server->db, start, end, type, q);
 
 	if (queue_isempty(q)) {
@@ -808,16 +901,6 @@ static void write_complete_cb(struct gatt_db_attribute *attr, int err,
 	async_write_op_destroy(op);
 }
 
-static uint8_t authorize_req(struct bt_gatt_server *server,
-					uint8_t opcode, uint16_t handle)
-{
-	if (!server->authorize)
-		return 0;
-
-	return server->authorize(server->att, opcode, handle,
-						server->authorize_data);
-}
-
 static void write_cb(struct bt_att_chan *chan, uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
@@ -832,11 +915,12 @@ static void write_cb(struct bt_att_chan *chan, uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
+	handle = get_le16(pdu);
+
 	ecode = authorize_req(server, opcode, handle);
 	if (ecode)
 		goto error;
 
-	handle = get_le16(pdu);
 	attr = gatt_db_get_attribute(server->db, handle);
 	if (!attr) {
 		ecode = BT_ATT_ERROR_INVALID_HANDLE;
@@ -1182,6 +1266,10 @@ static void read_multiple_cb(struct bt_att_chan *chan, uint8_t opcode,
 			"Read Multiple" : "Read Multiple Variable Length",
 			data->num_handles, data->handles[0]);
 
+	ecode = authorize_req(server, opcode, data->handles[0]);
+	if (ecode)
+		goto error;
+
 	attr = gatt_db_get_attribute(server->db, data->handles[0]);
 
 	if (!attr) {
@@ -1200,44 +1288,70 @@ error:
 	bt_att_chan_send_error_rsp(chan, opcode, 0, ecode);
 }
 
+static bool prep_buf_reserve(struct bt_gatt_server *server, uint16_t length)
+{
+	if (queue_isempty(server->prep_queue)) {
+		server->prep_buf_len = 0;
+
+		/* Only resized while nothing points into it */
+		if (server->prep_buf_size != server->prep_budget) {
+			free(server->prep_buf);
+			server->prep_buf = malloc(server->prep_budget);
+			server->prep_buf_size = server->prep_buf ?
+						server->prep_budget : 0;
+		}
+	}
+
+	return length <= server->prep_buf_size - server->prep_buf_len;
+}
+
 static bool append_prep_data(struct prep_write_data *prep_data, uint16_t handle,
 					uint16_t length, uint8_t *value)
 {
-	uint8_t *val;
-	uint16_t len;
+	struct bt_gatt_server *server = prep_data->server;
 
 	if (!length)
 		return true;
 
-	len = prep_data->length + length;
-
-	val = realloc(prep_data->value, len);
-	if (!val)
+	if (!prep_buf_reserve(server, length))
 		return false;
 
-	memcpy(val + prep_data->length, value, length);
+	memcpy(server->prep_buf + server->prep_buf_len, value, length);
 
-	prep_data->value = val;
-	prep_data->length = len;
+	server->prep_buf_len += length;
+	prep_data->length += length;
 
 	return true;
 }
 
-static bool is_reliable_write_supported(const struct bt_gatt_server  *server,
+static bool is_reliable_write_supported(struct bt_gatt_server *server,
 							uint16_t handle)
 {
+	struct reliable_cache *cache;
 	struct gatt_db_attribute *attr;
 	uint16_t ext_prop;
 
+	cache = &server->reliable_cache[handle % RELIABLE_CACHE_SIZE];
+	if (cache->handle == handle)
+		return cache->supported;
+
 	attr = gatt_db_get_attribute(server->db, handle);
-	if (!attr)
-		return false;
+	if (!attr || !gatt_db_attribute_get_char_data(attr, NULL, NULL, NULL,
+							&ext_prop, NULL))
+		ext_prop = 0;
 
-	if (!gatt_db_attribute_get_char_data(attr, NULL, NULL, NULL, &ext_prop,
-									NULL))
-		return false;
+	cache->handle = handle;
+	cache->supported = ext_prop & BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE;
+
+	return cache->supported;
+}
 
-	return (ext_prop & BT_GATT_CHRC_EXT_PROP_RELIABLE_WRITE);
+static void reliable_cache_clear(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	memset(server->reliable_cache, 0, sizeof(server->reliable_cache));
 }
 
 static bool prep_data_new(struct bt_gatt_server *server,
@@ -1246,14 +1360,15 @@ static bool prep_data_new(struct bt_gatt_server *server,
 {
 	struct prep_write_data *prep_data;
 
-	prep_data = new0(struct prep_write_data, 1);
-
-	if (!append_prep_data(prep_data, handle, length, value)) {
-		prep_write_data_destroy(prep_data);
+	if (!prep_buf_reserve(server, length))
 		return false;
-	}
 
+	prep_data = new0(struct prep_write_data, 1);
 	prep_data->server = server;
+	prep_data->value = server->prep_buf + server->prep_buf_len;
+
+	append_prep_data(prep_data, handle, length, value);
+
 	prep_data->handle = handle;
 	prep_data->offset = offset;
 
@@ -1289,9 +1404,9 @@ static bool store_prep_data(struct bt_gatt_server *server,
 
 struct prep_write_complete_data {
 	struct bt_att_chan *chan;
-	void *pdu;
 	uint16_t length;
 	struct bt_gatt_server *server;
+	uint8_t pdu[];
 };
 
 static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
@@ -1306,7 +1421,6 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	if (err) {
 		bt_att_chan_send_error_rsp(pwcd->chan, BT_ATT_OP_PREP_WRITE_REQ,
 								handle, err);
-		free(pwcd->pdu);
 		free(pwcd);
 
 		return;
@@ -1315,15 +1429,17 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	offset = get_le16(pwcd->pdu + 2);
 
 	if (!store_prep_data(pwcd->server, handle, offset, pwcd->length - 4,
-						&((uint8_t *) pwcd->pdu)[4]))
-		bt_att_chan_send_error_rsp(pwcd->chan, BT_ATT_OP_PREP_WRITE_RSP,
-					handle,
-					BT_ATT_ERROR_INSUFFICIENT_RESOURCES);
+							pwcd->pdu + 4)) {
+		bt_att_chan_send_error_rsp(pwcd->chan, BT_ATT_OP_PREP_WRITE_REQ,
+					handle, BT_ATT_ERROR_PREPARE_QUEUE_FULL);
+		free(pwcd);
+
+		return;
+	}
 
 	bt_att_chan_send_rsp(pwcd->chan, BT_ATT_OP_PREP_WRITE_RSP, pwcd->pdu,
 								pwcd->length);
 
-	free(pwcd->pdu);
 	free(pwcd);
 }
 
@@ -1343,7 +1459,8 @@ static void prep_write_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
-	if (queue_length(server->prep_queue) >= server->max_prep_queue_len) {
+	if (queue_length(server->prep_queue) >= server->max_prep_queue_len ||
+				!prep_buf_reserve(server, length - 4)) {
 		ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
 		goto error;
 	}
@@ -1351,6 +1468,10 @@ static void prep_write_cb(struct bt_att_chan *chan, uint8_t opcode,
 	handle = get_le16(pdu);
 	offset = get_le16(pdu + 2);
 
+	ecode = authorize_req(server, opcode, handle);
+	if (ecode)
+		goto error;
+
 	attr = gatt_db_get_attribute(server->db, handle);
 	if (!attr) {
 		ecode = BT_ATT_ERROR_INVALID_HANDLE;
@@ -1366,9 +1487,8 @@ static void prep_write_cb(struct bt_att_chan *chan, uint8_t opcode,
 	if (ecode)
 		goto error;
 
-	pwcd = new0(struct prep_write_complete_data, 1);
+	pwcd = malloc(sizeof(*pwcd) + length);
 	pwcd->chan = chan;
-	pwcd->pdu = malloc(length);
 	memcpy(pwcd->pdu, pdu, length);
 	pwcd->length = length;
 	pwcd->server = server;
@@ -1673,7 +1793,14 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 	server->mtu = MAX(mtu, BT_ATT_DEFAULT_LE_MTU);
 	server->max_prep_queue_len = DEFAULT_MAX_PREP_QUEUE_LEN;
 	server->prep_queue = queue_new();
+	server->prep_budget = DEFAULT_PREP_BUDGET;
+	server->nfy_mult_window = NFY_MULT_TIMEOUT;
+	server->nfy_mult_sent = queue_new();
+	server->conflate = queue_new();
 	server->min_enc_size = min_enc_size;
+	server->db_id = gatt_db_register(db, reliable_cache_clear,
+						reliable_cache_clear, server,
+						NULL);
 
 	if (!gatt_server_register_att_handlers(server)) {
 		bt_gatt_server_free(server);
@@ -1720,6 +1847,18 @@ void bt_gatt_server_unref(struct bt_gatt_server *server)
 	bt_gatt_server_free(server);
 }
 
+bool bt_gatt_server_set_prep_budget(struct bt_gatt_server *server,
+							uint16_t budget)
+{
+	if (!server || budget < BT_ATT_MAX_VALUE_LEN)
+		return false;
+
+	/* Applied by prep_buf_reserve once the queue is empty */
+	server->prep_budget = budget;
+
+	return true;
+}
+
 bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					bt_gatt_server_debug_func_t callback,
 					void *user_data,
@@ -1738,17 +1877,143 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 	return true;
 }
 
+bool bt_gatt_server_set_nfy_mult_window(struct bt_gatt_server *server,
+							unsigned int window)
+{
+	/* A 0 ms timeout would never be armed */
+	if (!server || !window)
+		return false;
+
+	server->nfy_mult_window = window;
+
+	return true;
+}
+
+bool bt_gatt_server_set_conflate(struct bt_gatt_server *server,
+						uint16_t handle, bool enable)
+{
+	if (!server || !handle)
+		return false;
+
+	queue_remove(server->conflate, UINT_TO_PTR(handle));
+
+	if (enable)
+		queue_push_tail(server->conflate, UINT_TO_PTR(handle));
+
+	return true;
+}
+
+static bool is_conflated(struct bt_gatt_server *server, uint16_t handle)
+{
+	return queue_find(server->conflate, NULL, UINT_TO_PTR(handle));
+}
+
+static void nfy_mult_flush(struct bt_gatt_server *server, bool force);
+
+static void nfy_mult_sent_destroy(void *user_data)
+{
+	struct nfy_mult_data *data = user_data;
+	struct bt_gatt_server *server = data->server;
+
+	if (server)
+		queue_remove(server->nfy_mult_sent, data);
+
+	free(data);
+
+	if (!server)
+		return;
+
+	if (server->nfy_mult && server->nfy_mult->due &&
+				queue_isempty(server->nfy_mult_sent))
+		nfy_mult_flush(server, false);
+}
+
+/*
+ * While an earlier batch is still queued in ATT, the link is the
+ * bottleneck: unless forced, the flush is postponed until that batch is
+ * written and the pending one keeps absorbing values meanwhile.
+ */
+static void nfy_mult_flush(struct bt_gatt_server *server, bool force)
+{
+	struct nfy_mult_data *data = server->nfy_mult;
+	struct iovec iov[2];
+	unsigned int id;
+
+	if (!data)
+		return;
+
+	if (data->id) {
+		timeout_remove(data->id);
+		data->id = 0;
+	}
+
+	if (!force && !queue_isempty(server->nfy_mult_sent)) {
+		data->due = true;
+		return;
+	}
+
+	server->nfy_mult = NULL;
+
+	/* A lone value goes out as a plain notification, 2 bytes shorter */
+	if (data->count == 1) {
+		iov[0].iov_base = data->pdu;
+		iov[0].iov_len = 2;
+		iov[1].iov_base = data->pdu + 4;
+		iov[1].iov_len = data->offset - 4;
+
+		id = bt_att_sendv(server->att, BT_ATT_OP_HANDLE_NFY, iov, 2,
+					NULL, data, nfy_mult_sent_destroy);
+	} else
+		id = bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY_MULT,
+					data->pdu, data->offset, NULL, data,
+					nfy_mult_sent_destroy);
+
+	free(data->pdu);
+	data->pdu = NULL;
+
+	if (!id) {
+		free(data);
+		return;
+	}
+
+	queue_push_tail(server->nfy_mult_sent, data);
+}
+
+/* Drops the value of handle from a batch that has not been sent */
+static void nfy_mult_drop(struct nfy_mult_data *data, uint16_t handle)
+{
+	uint16_t offset = 0;
+	uint16_t len;
+
+	while (offset < data->offset) {
+		len = 4 + get_le16(data->pdu + offset + 2);
+
+		if (get_le16(data->pdu + offset) == handle) {
+			memmove(data->pdu + offset, data->pdu + offset + len,
+						data->offset - offset - len);
+			data->offset -= len;
+			data->count--;
+			return;
+		}
+
+		offset += len;
+	}
+}
+
+void bt_gatt_server_flush_notifications(struct bt_gatt_server *server)
+{
+	if (server)
+		nfy_mult_flush(server, false);
+}
+
 static bool notify_multiple(void *user_data)
 {
 	struct bt_gatt_server *server = user_data;
 
-	bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY_MULT,
-			server->nfy_mult->pdu, server->nfy_mult->offset, NULL,
-			NULL, NULL);
+	/* Returning false removes the timeout */
+	server->nfy_mult->id = 0;
 
-	free(server->nfy_mult->pdu);
-	free(server->nfy_mult);
-	server->nfy_mult = NULL;
+	nfy_mult_flush(server, false);
 
 	return false;
 }
@@ -1757,52 +2022,62 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length, bool multiple)
 {
-	struct nfy_mult_data *data = NULL;
-	bool result;
+	struct nfy_mult_data *data;
+	struct iovec iov[2];
+	uint8_t pdu[2];
 
 	if (!server || (length && !value))
 		return false;
 
-	if (multiple)
-		data = server->nfy_mult;
+	if (!multiple) {
+		put_le16(handle, pdu);
+		iov[0].iov_base = pdu;
+		iov[0].iov_len = sizeof(pdu);
+		iov[1].iov_base = (void *) value;
+		iov[1].iov_len = MIN(bt_att_get_mtu(server->att) - 3, length);
+
+		if (is_conflated(server, handle))
+			return !!bt_att_sendv_latest(server->att, handle,
+						BT_ATT_OP_HANDLE_NFY, iov, 2);
+
+		return !!bt_att_sendv(server->att, BT_ATT_OP_HANDLE_NFY, iov, 2,
+							NULL, NULL, NULL);
+	}
+
+	/* Values that do not fit in what is left start a new PDU */
+	length = MIN(bt_att_get_mtu(server->att) - 5, length);
 
+	data = server->nfy_mult;
+	if (data && is_conflated(server, handle))
+		nfy_mult_drop(data, handle);
+
+	if (data && data->offset + 4 + length > data->len)
+		nfy_mult_flush(server, true);
+
+	data = server->nfy_mult;
 	if (!data) {
 		data = new0(struct nfy_mult_data, 1);
+		data->server = server;
 		data->len = bt_att_get_mtu(server->att) - 1;
 		data->pdu = malloc(data->len);
+		server->nfy_mult = data;
 	}
 
 	put_le16(handle, data->pdu + data->offset);
 	data->offset += 2;
 
-	length = MIN(data->len - data->offset, length);
-
-	if (multiple) {
-		put_le16(length, data->pdu + data->offset);
-		data->offset += 2;
-	}
+	put_le16(length, data->pdu + data->offset);
+	data->offset += 2;
 
 	memcpy(data->pdu + data->offset, value, length);
 	data->offset += length;
+	data->count++;
 
-	if (multiple) {
-		if (!server->nfy_mult)
-			server->nfy_mult = data;
-
-		if (!server->nfy_mult->id)
-			server->nfy_mult->id = timeout_add(NFY_MULT_TIMEOUT,
-						   notify_multiple, server,
-						   NULL);
-
-		return true;
-	}
+	if (!data->id && !data->due)
+		data->id = timeout_add(server->nfy_mult_window,
+					notify_multiple, server, NULL);
 
-	result = !!bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY,
-				data->pdu, data->offset, NULL, NULL, NULL);
-	free(data->pdu);
-	free(data);
-
-	return result;
+	return true;
 }
 
 struct ind_data {
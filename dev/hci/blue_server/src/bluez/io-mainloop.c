@@ -36,6 +36,7 @@
 struct io {
 	int ref_count;
 	int fd;
+	struct mainloop *loop;
 	uint32_t events;
 	bool close_on_destroy;
 	io_callback_func_t read_callback;
@@ -87,6 +88,9 @@ static void io_cleanup(void *user_data)
 		close(io->fd);
 
 	io->fd = -1;
+
+	/* The loop may be freed next, see mainloop_free() */
+	io->loop = NULL;
 }
 
 static void io_callback(int fd, uint32_t events, void *user_data)
@@ -100,7 +104,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 		io->write_callback = NULL;
 
 		if (!io->disconnect_callback) {
-			mainloop_remove_fd(io->fd);
+			mainloop_loop_remove_fd(io->loop, io->fd);
 			io_unref(io);
 			return;
 		}
@@ -115,7 +119,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLRDHUP;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_loop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -130,7 +134,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLIN;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_loop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -143,28 +147,36 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 			io->write_destroy = NULL;
 			io->write_data = NULL;
 
-			io->events &= ~EPOLLOUT;
-
-			mainloop_modify_fd(io->fd, io->events);
+			if (io->events & EPOLLOUT) {
+				io->events &= ~EPOLLOUT;
+				mainloop_loop_modify_fd(io->loop, io->fd,
+								io->events);
+			}
+		} else if (io->write_callback && !(io->events & EPOLLOUT)) {
+			/* The optimistic write did not finish, wait for room */
+			if (!mainloop_loop_modify_fd(io->loop, io->fd,
+						io->events | EPOLLOUT))
+				io->events |= EPOLLOUT;
 		}
 	}
 
 	io_unref(io);
 }
 
-struct io *io_new(int fd)
+struct io *io_new_loop(struct mainloop *loop, int fd)
 {
 	struct io *io;
 
-	if (fd < 0)
+	if (!loop || fd < 0)
 		return NULL;
 
 	io = new0(struct io, 1);
 	io->fd = fd;
+	io->loop = loop;
 	io->events = 0;
 	io->close_on_destroy = false;
 
-	if (mainloop_add_fd(io->fd, io->events, io_callback,
+	if (mainloop_loop_add_fd(loop, io->fd, io->events, io_callback,
 						io, io_cleanup) < 0) {
 		free(io);
 		return NULL;
@@ -173,6 +185,11 @@ struct io *io_new(int fd)
 	return io_ref(io);
 }
 
+struct io *io_new(int fd)
+{
+	return io_new_loop(mainloop_get_default(), fd);
+}
+
 void io_destroy(struct io *io)
 {
 	if (!io)
@@ -182,7 +199,7 @@ void io_destroy(struct io *io)
 	io->write_callback = NULL;
 	io->disconnect_callback = NULL;
 
-	mainloop_remove_fd(io->fd);
+	mainloop_loop_remove_fd(io->loop, io->fd);
 
 	io_unref(io);
 }
@@ -228,7 +245,7 @@ bool io_set_read_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -247,19 +264,33 @@ bool io_set_write_handler(struct io *io, io_callback_func_t callback,
 	if (io->write_destroy)
 		io->write_destroy(io->write_data);
 
+	io->write_callback = callback;
+	io->write_destroy = destroy;
+	io->write_data = user_data;
+
+	/*
+	 * A socket is writable most of the time, so rather than enabling
+	 * EPOLLOUT and disabling it again once the callback is done, which
+	 * is two epoll_ctl per burst, the callback is first run from the
+	 * loop as if EPOLLOUT had fired. EPOLLOUT is only enabled when it
+	 * returns true, i.e. the socket filled up.
+	 */
+	if (callback && !(io->events & EPOLLOUT)) {
+		if (mainloop_loop_defer_fd(io->loop, io->fd, EPOLLOUT) < 0)
+			return false;
+
+		return true;
+	}
+
 	if (callback)
 		events = io->events | EPOLLOUT;
 	else
 		events = io->events & ~EPOLLOUT;
 
-	io->write_callback = callback;
-	io->write_destroy = destroy;
-	io->write_data = user_data;
-
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -290,7 +321,7 @@ bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_loop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/signalfd.h>
@@ -39,15 +40,43 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 
 #include "bluez/mainloop.h"
 // #include "bluez/mainloop-notify.h"
 
-#define MAX_EPOLL_EVENTS 10
+#ifdef HAVE_IO_URING
+#include "bluez/uring.h"
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status = EXIT_SUCCESS;
+#define URING_ENTRIES 256
+
+/* user_data of poll removals, their completions are dropped */
+#define URING_IGNORE 0
+
+/*
+ * Epoll only flags, EPOLLET and EPOLLONESHOT are emulated. Polls are
+ * single shot and re-armed after each dispatch, re-arming checks the
+ * current state, so all fds get level-triggered semantics.
+ */
+#define URING_EPOLL_FLAGS (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | \
+								EPOLLWAKEUP)
+#endif
+
+#define DEFAULT_EPOLL_EVENTS 32
+#define MAX_EPOLL_EVENTS 1024
+
+/*
+ * All timeouts share one timerfd, armed for the earliest expiry of a
+ * binary min-heap. Timeouts live in a slot array that is recycled, so
+ * adding, modifying and removing one costs no syscall unless it becomes
+ * the new earliest expiry, and no allocation once the arrays have grown.
+ *
+ * A timeout id is the slot index plus one in the low bits and the slot
+ * generation above it, so a stale id never matches a reused slot.
+ */
+#define TIMEOUT_SLOT_BITS 20
+#define TIMEOUT_SLOT_MASK ((1U << TIMEOUT_SLOT_BITS) - 1)
+#define TIMEOUT_GEN_MASK ((1U << (31 - TIMEOUT_SLOT_BITS)) - 1)
 
 struct mainloop_data {
 	int fd;
@@ -55,105 +84,442 @@ struct mainloop_data {
 	mainloop_event_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
+	uint32_t deferred;		/* Events to dispatch without polling */
+#ifdef HAVE_IO_URING
+	uint32_t poll_seq;		/* Armed poll, 0 if none */
+#endif
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
-
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
-
 struct timeout_data {
-	int fd;
-	mainloop_timeout_func callback;
+	uint64_t expire;		/* CLOCK_MONOTONIC in ns */
+	uint64_t seq;			/* Keeps equal expiries in FIFO order */
+	mainloop_timeout_func callback;	/* NULL while the slot is free */
 	mainloop_destroy_func destroy;
 	void *user_data;
+	unsigned int gen;
+	int heap_index;			/* -1 while not armed */
+	int next_free;
 };
 
-void mainloop_init(void)
+/*
+ * A loop and everything registered with it must only be used from the
+ * thread running it, there is no locking. Independent loops can run on
+ * as many threads as needed.
+ */
+struct mainloop {
+	int epoll_fd;
+	int terminate;
+	int exit_status;
+
+	/*
+	 * Indexed by fd and grown on demand, fds are allocated lowest first
+	 * so the table stays as dense as the process fd table.
+	 */
+	struct mainloop_data **list;
+	unsigned int list_size;
+
+	/*
+	 * Events of the epoll_wait batch being dispatched, a callback
+	 * removing an fd clears its not yet dispatched event so it is not
+	 * used after free.
+	 */
+	struct epoll_event *events;
+	int events_size;
+	int events_max;
+	int events_pos;
+	int events_len;
+
+	/* fds with events from mainloop_loop_defer_fd() */
+	int *deferred;
+	unsigned int deferred_len;
+	unsigned int deferred_size;
+
+	int timeout_fd;
+	struct timeout_data *timeout_slots;
+	unsigned int timeout_slots_size;
+	int timeout_free;
+	unsigned int *timeout_heap;
+	unsigned int timeout_heap_len;
+	uint64_t timeout_armed;		/* Expiry timeout_fd is set to */
+	uint64_t timeout_seq;
+
+#ifdef HAVE_IO_URING
+	/*
+	 * With a ring, fds are watched with poll requests and the timeouts
+	 * bound the wait, so an iteration is a single io_uring_enter that
+	 * also submits every interest change made since the previous one.
+	 * NULL when the kernel lacks support, epoll is used then.
+	 */
+	struct uring *ring;
+	struct io_uring_cqe *cqes;
+	uint32_t poll_seq;
+#endif
+};
+
+/* The loop the mainloop_* calls without a loop argument operate on */
+static __thread struct mainloop *default_loop;
+
+static void timeout_clear(struct mainloop *loop);
+static struct mainloop_data *mainloop_lookup(struct mainloop *loop, int fd);
+#ifdef HAVE_IO_URING
+static uint64_t timeout_now(void);
+static void timeout_expire(struct mainloop *loop);
+#endif
+
+static inline bool mainloop_uses_uring(struct mainloop *loop)
+{
+#ifdef HAVE_IO_URING
+	return loop->ring != NULL;
+#else
+	return false;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+static void poll_arm(struct mainloop *loop, struct mainloop_data *data)
+{
+	struct io_uring_sqe *sqe;
+
+	/* 0 is the disarmed value */
+	if (!++loop->poll_seq)
+		++loop->poll_seq;
+
+	data->poll_seq = loop->poll_seq;
+
+	sqe = uring_get_sqe(loop->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = data->fd;
+	sqe->poll32_events = data->events & ~URING_EPOLL_FLAGS;
+	sqe->user_data = (uint64_t) data->poll_seq << 32 | data->fd;
+}
+
+static void poll_cancel(struct mainloop *loop, struct mainloop_data *data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!data->poll_seq)
+		return;
+
+	sqe = uring_get_sqe(loop->ring);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uint64_t) data->poll_seq << 32 | data->fd;
+	sqe->user_data = URING_IGNORE;
+
+	data->poll_seq = 0;
+}
+#endif
+
+struct mainloop *mainloop_new(void)
+{
+	struct mainloop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+#ifdef HAVE_IO_URING
+	loop->ring = uring_new(URING_ENTRIES);
+#endif
+
+	if (mainloop_uses_uring(loop)) {
+		loop->epoll_fd = -1;
+	} else {
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd < 0) {
+			free(loop);
+			return NULL;
+		}
+	}
+
+	loop->exit_status = EXIT_SUCCESS;
+	loop->events_max = DEFAULT_EPOLL_EVENTS;
+	loop->timeout_fd = -1;
+	loop->timeout_free = -1;
+
+	return loop;
+}
+
+void mainloop_free(struct mainloop *loop)
 {
 	unsigned int i;
 
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!loop)
+		return;
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+	for (i = 0; i < loop->list_size; i++) {
+		struct mainloop_data *data = loop->list[i];
 
-	epoll_terminate = 0;
+		loop->list[i] = NULL;
 
-	// mainloop_notify_init();
+		if (data) {
+			if (!mainloop_uses_uring(loop))
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL,
+							data->fd, NULL);
+
+			if (data->destroy)
+				data->destroy(data->user_data);
+
+			free(data);
+		}
+	}
+
+	timeout_clear(loop);
+
+	free(loop->list);
+	free(loop->events);
+	free(loop->deferred);
+
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+#ifdef HAVE_IO_URING
+	uring_free(loop->ring);
+	free(loop->cqes);
+#endif
+
+	if (default_loop == loop)
+		default_loop = NULL;
+
+	free(loop);
 }
 
-void mainloop_quit(void)
+struct mainloop *mainloop_get_default(void)
 {
-	epoll_terminate = 1;
+	return default_loop;
+}
 
-	// mainloop_sd_notify("STOPPING=1");
+void mainloop_set_default(struct mainloop *loop)
+{
+	default_loop = loop;
 }
 
-void mainloop_exit_success(void)
+void mainloop_loop_quit(struct mainloop *loop)
 {
-	exit_status = EXIT_SUCCESS;
-	epoll_terminate = 1;
+	loop->terminate = 1;
 }
 
-void mainloop_exit_failure(void)
+void mainloop_loop_exit(struct mainloop *loop, int status)
 {
-	exit_status = EXIT_FAILURE;
-	epoll_terminate = 1;
+	loop->exit_status = status;
+	loop->terminate = 1;
 }
 
-int mainloop_run(void)
+int mainloop_loop_set_max_events(struct mainloop *loop,
+						unsigned int max_events)
 {
-	unsigned int i;
+	if (!max_events || max_events > MAX_EPOLL_EVENTS)
+		return -EINVAL;
 
-	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
+	/* Takes effect from the next epoll_wait */
+	loop->events_max = max_events;
 
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds < 0)
+	return 0;
+}
+
+static int mainloop_wait(struct mainloop *loop, int timeout)
+{
+	struct epoll_event *events;
+
+	if (loop->events_size != loop->events_max) {
+		events = realloc(loop->events,
+				loop->events_max * sizeof(*events));
+		if (!events)
+			return -ENOMEM;
+
+		loop->events = events;
+		loop->events_size = loop->events_max;
+	}
+
+	return epoll_wait(loop->epoll_fd, loop->events, loop->events_size,
+								timeout);
+}
+
+#ifdef HAVE_IO_URING
+static void mainloop_dispatch_cqe(struct mainloop *loop,
+					const struct io_uring_cqe *cqe)
+{
+	struct mainloop_data *data;
+	uint32_t events;
+	int fd;
+
+	if (cqe->user_data == URING_IGNORE)
+		return;
+
+	/* Completions of polls cancelled or re-armed since are stale */
+	fd = (uint32_t) cqe->user_data;
+	data = mainloop_lookup(loop, fd);
+	if (!data || data->poll_seq != cqe->user_data >> 32)
+		return;
+
+	data->poll_seq = 0;
+
+	if (cqe->res < 0) {
+		/* Not re-armed, it would fail the same way again */
+		data->callback(fd, EPOLLERR, data->user_data);
+		return;
+	}
+
+	events = cqe->res;
+	data->callback(fd, events, data->user_data);
+
+	/* The callback may have removed, replaced or modified the fd */
+	data = mainloop_lookup(loop, fd);
+	if (data && !data->poll_seq && !(data->events & EPOLLONESHOT))
+		poll_arm(loop, data);
+}
+
+static void mainloop_iterate_uring(struct mainloop *loop)
+{
+	struct io_uring_cqe *cqes;
+	struct timespec ts, *timeout = NULL;
+	unsigned int i, n;
+
+	if (loop->events_size != loop->events_max) {
+		cqes = realloc(loop->cqes, loop->events_max * sizeof(*cqes));
+		if (!cqes)
+			return;
+
+		loop->cqes = cqes;
+		loop->events_size = loop->events_max;
+	}
+
+	if (loop->deferred_len) {
+		memset(&ts, 0, sizeof(ts));
+		timeout = &ts;
+	} else if (loop->timeout_heap_len) {
+		uint64_t expire = loop->timeout_slots[loop->timeout_heap[0]].expire;
+		uint64_t now = timeout_now();
+		uint64_t wait = expire > now ? expire - now : 0;
+
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		timeout = &ts;
+	}
+
+	uring_submit_and_wait(loop->ring, timeout);
+
+	n = uring_get_cqes(loop->ring, loop->cqes, loop->events_size);
+	for (i = 0; i < n; i++)
+		mainloop_dispatch_cqe(loop, &loop->cqes[i]);
+
+	timeout_expire(loop);
+}
+#endif
+
+static void mainloop_run_deferred(struct mainloop *loop)
+{
+	unsigned int i, n = loop->deferred_len;
+
+	/* fds deferred from these callbacks wait for the next round */
+	for (i = 0; i < n; i++) {
+		int fd = loop->deferred[i];
+		struct mainloop_data *data = mainloop_lookup(loop, fd);
+		uint32_t events;
+
+		if (!data || !data->deferred)
 			continue;
 
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
+		events = data->deferred;
+		data->deferred = 0;
 
-			data->callback(data->fd, events[n].events,
-							data->user_data);
-		}
+		data->callback(fd, events, data->user_data);
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
-		struct mainloop_data *data = mainloop_list[i];
+	loop->deferred_len -= n;
+	memmove(loop->deferred, loop->deferred + n,
+				loop->deferred_len * sizeof(*loop->deferred));
+}
 
-		mainloop_list[i] = NULL;
+int mainloop_loop_run(struct mainloop *loop)
+{
+	loop->terminate = 0;
 
-		if (data) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+	while (!loop->terminate) {
+		int nfds;
 
-			if (data->destroy)
-				data->destroy(data->user_data);
+		if (loop->deferred_len) {
+			mainloop_run_deferred(loop);
+			if (loop->terminate)
+				break;
+		}
 
-			free(data);
+#ifdef HAVE_IO_URING
+		if (loop->ring) {
+			mainloop_iterate_uring(loop);
+			continue;
 		}
+#endif
+
+		nfds = mainloop_wait(loop, loop->deferred_len ? 0 : -1);
+		if (nfds < 0)
+			continue;
+
+		loop->events_len = nfds;
+
+		for (loop->events_pos = 0; loop->events_pos < loop->events_len;
+							loop->events_pos++) {
+			struct epoll_event *ev = &loop->events[loop->events_pos];
+			struct mainloop_data *data = ev->data.ptr;
+
+			if (!data)
+				continue;
+
+			data->callback(data->fd, ev->events, data->user_data);
+		}
+
+		loop->events_len = 0;
 	}
 
-	close(epoll_fd);
-	epoll_fd = 0;
+	return loop->exit_status;
+}
+
+static int mainloop_list_grow(struct mainloop *loop, unsigned int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size;
 
-	// mainloop_notify_exit();
+	size = loop->list_size ? loop->list_size : 64;
+	while (size <= fd)
+		size *= 2;
 
-	return exit_status;
+	list = realloc(loop->list, size * sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	memset(list + loop->list_size, 0,
+			(size - loop->list_size) * sizeof(*list));
+
+	loop->list = list;
+	loop->list_size = size;
+
+	return 0;
 }
 
-int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+static struct mainloop_data *mainloop_lookup(struct mainloop *loop, int fd)
+{
+	if (fd < 0 || (unsigned int) fd >= loop->list_size)
+		return NULL;
+
+	return loop->list[fd];
+}
+
+int mainloop_loop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (!loop || fd < 0 || !callback)
 		return -EINVAL;
 
+	if ((unsigned int) fd >= loop->list_size) {
+		err = mainloop_list_grow(loop, fd);
+		if (err < 0)
+			return err;
+	}
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -165,39 +531,64 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 	data->destroy = destroy;
 	data->user_data = user_data;
 
+#ifdef HAVE_IO_URING
+	if (loop->ring) {
+		if (loop->list[fd]) {
+			free(data);
+			return -EEXIST;
+		}
+
+		loop->list[fd] = data;
+		poll_arm(loop, data);
+
+		return 0;
+	}
+#endif
+
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
 	if (err < 0) {
 		free(data);
 		return err;
 	}
 
-	mainloop_list[fd] = data;
+	loop->list[fd] = data;
 
 	return 0;
 }
 
-int mainloop_modify_fd(int fd, uint32_t events)
+int mainloop_loop_modify_fd(struct mainloop *loop, int fd, uint32_t events)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = mainloop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
+#ifdef HAVE_IO_URING
+	if (loop->ring) {
+		/* Queued only, goes out with the next io_uring_enter */
+		poll_cancel(loop, data);
+		data->events = events;
+		poll_arm(loop, data);
+
+		return 0;
+	}
+#endif
+
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
 	if (err < 0)
 		return err;
 
@@ -206,21 +597,32 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	return 0;
 }
 
-int mainloop_remove_fd(int fd)
+int mainloop_loop_remove_fd(struct mainloop *loop, int fd)
 {
 	struct mainloop_data *data;
-	int err;
+	int i, err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = mainloop_lookup(loop, fd);
 	if (!data)
 		return -ENXIO;
 
-	mainloop_list[fd] = NULL;
+	loop->list[fd] = NULL;
+
+	for (i = loop->events_pos + 1; i < loop->events_len; i++) {
+		if (loop->events[i].data.ptr == data)
+			loop->events[i].data.ptr = NULL;
+	}
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+#ifdef HAVE_IO_URING
+	if (loop->ring) {
+		poll_cancel(loop, data);
+		err = 0;
+	} else
+#endif
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
 	if (data->destroy)
 		data->destroy(data->user_data);
@@ -230,105 +632,493 @@ int mainloop_remove_fd(int fd)
 	return err;
 }
 
-static void timeout_destroy(void *user_data)
+/*
+ * Dispatches events to the fd's callback before the loop next waits, as
+ * if they had been polled. Lets a writer try a plain write first and only
+ * ask for EPOLLOUT once the socket is actually full.
+ */
+int mainloop_loop_defer_fd(struct mainloop *loop, int fd, uint32_t events)
 {
-	struct timeout_data *data = user_data;
+	struct mainloop_data *data;
+	int *deferred;
+	unsigned int size;
 
-	close(data->fd);
-	data->fd = -1;
+	if (!loop || fd < 0 || !events)
+		return -EINVAL;
 
-	if (data->destroy)
-		data->destroy(data->user_data);
+	data = mainloop_lookup(loop, fd);
+	if (!data)
+		return -ENXIO;
 
-	free(data);
+	if (!data->deferred) {
+		if (loop->deferred_len == loop->deferred_size) {
+			size = loop->deferred_size ? loop->deferred_size * 2 : 16;
+			deferred = realloc(loop->deferred,
+						size * sizeof(*deferred));
+			if (!deferred)
+				return -ENOMEM;
+
+			loop->deferred = deferred;
+			loop->deferred_size = size;
+		}
+
+		loop->deferred[loop->deferred_len++] = fd;
+	}
+
+	data->deferred |= events;
+
+	return 0;
+}
+
+static uint64_t timeout_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct timeout_data *timeout_lookup(struct mainloop *loop, int id)
+{
+	struct timeout_data *data;
+	unsigned int slot;
+
+	if (!loop || id <= 0)
+		return NULL;
+
+	slot = (id & TIMEOUT_SLOT_MASK) - 1;
+	if (slot >= loop->timeout_slots_size)
+		return NULL;
+
+	data = &loop->timeout_slots[slot];
+	if (!data->callback ||
+			data->gen != ((unsigned int) id >> TIMEOUT_SLOT_BITS))
+		return NULL;
+
+	return data;
+}
+
+static bool timeout_before(struct mainloop *loop, unsigned int a,
+							unsigned int b)
+{
+	const struct timeout_data *da = &loop->timeout_slots[a];
+	const struct timeout_data *db = &loop->timeout_slots[b];
+
+	if (da->expire != db->expire)
+		return da->expire < db->expire;
+
+	return da->seq < db->seq;
+}
+
+static void heap_set(struct mainloop *loop, unsigned int pos,
+							unsigned int slot)
+{
+	loop->timeout_heap[pos] = slot;
+	loop->timeout_slots[slot].heap_index = pos;
+}
+
+static void heap_sift_up(struct mainloop *loop, unsigned int pos)
+{
+	unsigned int slot = loop->timeout_heap[pos];
+
+	while (pos) {
+		unsigned int parent = (pos - 1) / 2;
+
+		if (!timeout_before(loop, slot, loop->timeout_heap[parent]))
+			break;
+
+		heap_set(loop, pos, loop->timeout_heap[parent]);
+		pos = parent;
+	}
+
+	heap_set(loop, pos, slot);
+}
+
+static void heap_sift_down(struct mainloop *loop, unsigned int pos)
+{
+	unsigned int slot = loop->timeout_heap[pos];
+
+	while (1) {
+		unsigned int child = pos * 2 + 1;
+
+		if (child >= loop->timeout_heap_len)
+			break;
+
+		if (child + 1 < loop->timeout_heap_len &&
+				timeout_before(loop, loop->timeout_heap[child + 1],
+						loop->timeout_heap[child]))
+			child++;
+
+		if (!timeout_before(loop, loop->timeout_heap[child], slot))
+			break;
+
+		heap_set(loop, pos, loop->timeout_heap[child]);
+		pos = child;
+	}
+
+	heap_set(loop, pos, slot);
+}
+
+static void heap_remove(struct mainloop *loop, struct timeout_data *data)
+{
+	unsigned int pos = data->heap_index;
+	unsigned int last;
+
+	data->heap_index = -1;
+
+	last = loop->timeout_heap[--loop->timeout_heap_len];
+	if (pos == loop->timeout_heap_len)
+		return;
+
+	heap_set(loop, pos, last);
+	heap_sift_up(loop, pos);
+	heap_sift_down(loop, loop->timeout_slots[last].heap_index);
+}
+
+static int timeout_arm(struct mainloop *loop)
+{
+	struct itimerspec itimer;
+	uint64_t expire;
+
+	/*
+	 * A timer that got removed or pushed back leaves timeout_fd set to
+	 * an earlier time, it then wakes up once for nothing and gets set
+	 * again, which is cheaper than a syscall on every removal.
+	 */
+	if (!loop->timeout_heap_len || loop->timeout_fd < 0)
+		return 0;
+
+	expire = loop->timeout_slots[loop->timeout_heap[0]].expire;
+	if (loop->timeout_armed && loop->timeout_armed <= expire)
+		return 0;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = expire / 1000000000ULL;
+	itimer.it_value.tv_nsec = expire % 1000000000ULL;
+
+	if (timerfd_settime(loop->timeout_fd, TFD_TIMER_ABSTIME,
+							&itimer, NULL) < 0)
+		return -EIO;
+
+	loop->timeout_armed = expire;
+
+	return 0;
+}
+
+static int timeout_schedule(struct mainloop *loop, struct timeout_data *data,
+							unsigned int msec)
+{
+	data->expire = timeout_now() + (uint64_t) msec * 1000000ULL;
+	data->seq = loop->timeout_seq++;
+
+	if (data->heap_index < 0) {
+		loop->timeout_heap[loop->timeout_heap_len] =
+						data - loop->timeout_slots;
+		data->heap_index = loop->timeout_heap_len++;
+	}
+
+	heap_sift_up(loop, data->heap_index);
+	heap_sift_down(loop, data->heap_index);
+
+	return timeout_arm(loop);
+}
+
+static void timeout_release(struct mainloop *loop, struct timeout_data *data)
+{
+	mainloop_destroy_func destroy = data->destroy;
+	void *user_data = data->user_data;
+
+	if (data->heap_index >= 0)
+		heap_remove(loop, data);
+
+	data->callback = NULL;
+	data->gen = (data->gen + 1) & TIMEOUT_GEN_MASK;
+	data->next_free = loop->timeout_free;
+	loop->timeout_free = data - loop->timeout_slots;
+
+	/* The slot may be reused or the slots moved from here on */
+	if (destroy)
+		destroy(user_data);
+}
+
+static void timeout_expire(struct mainloop *loop)
+{
+	uint64_t now;
+
+	if (!loop->timeout_heap_len)
+		return;
+
+	now = timeout_now();
+
+	/*
+	 * Callbacks may add, modify or remove any timeout, so nothing is
+	 * held across them. A timeout re-added from its callback expires
+	 * after now and can't make this loop spin.
+	 */
+	while (loop->timeout_heap_len) {
+		unsigned int slot = loop->timeout_heap[0];
+		struct timeout_data *data = &loop->timeout_slots[slot];
+		int id;
+
+		if (data->expire > now)
+			break;
+
+		heap_remove(loop, data);
+
+		id = (data->gen << TIMEOUT_SLOT_BITS) | (slot + 1);
+		data->callback(id, data->user_data);
+	}
 }
 
 static void timeout_callback(int fd, uint32_t events, void *user_data)
 {
-	struct timeout_data *data = user_data;
+	struct mainloop *loop = user_data;
 	uint64_t expired;
 	ssize_t result;
 
 	if (events & (EPOLLERR | EPOLLHUP))
 		return;
 
-	result = read(data->fd, &expired, sizeof(expired));
+	result = read(fd, &expired, sizeof(expired));
 	if (result != sizeof(expired))
 		return;
 
-	if (data->callback)
-		data->callback(data->fd, data->user_data);
+	loop->timeout_armed = 0;
+
+	timeout_expire(loop);
+	timeout_arm(loop);
 }
 
-static inline int timeout_set(int fd, unsigned int msec)
+static void timeout_clear(struct mainloop *loop)
 {
-	struct itimerspec itimer;
-	unsigned int sec = msec / 1000;
+	unsigned int i;
 
-	memset(&itimer, 0, sizeof(itimer));
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_nsec = 0;
-	itimer.it_value.tv_sec = sec;
-	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
+	if (loop->timeout_fd >= 0)
+		close(loop->timeout_fd);
+
+	loop->timeout_fd = -1;
+	loop->timeout_armed = 0;
+
+	for (i = 0; i < loop->timeout_slots_size; i++) {
+		if (loop->timeout_slots[i].callback)
+			timeout_release(loop, &loop->timeout_slots[i]);
+	}
 
-	return timerfd_settime(fd, 0, &itimer, NULL);
+	free(loop->timeout_slots);
+	loop->timeout_slots = NULL;
+	loop->timeout_slots_size = 0;
+	loop->timeout_free = -1;
+
+	free(loop->timeout_heap);
+	loop->timeout_heap = NULL;
+	loop->timeout_heap_len = 0;
 }
 
-int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+static int timeout_grow(struct mainloop *loop)
+{
+	struct timeout_data *slots;
+	unsigned int *heap;
+	unsigned int i, size;
+
+	size = loop->timeout_slots_size ? loop->timeout_slots_size * 2 : 16;
+	if (size > TIMEOUT_SLOT_MASK)
+		return -ENOMEM;
+
+	heap = realloc(loop->timeout_heap, size * sizeof(*heap));
+	if (!heap)
+		return -ENOMEM;
+
+	loop->timeout_heap = heap;
+
+	slots = realloc(loop->timeout_slots, size * sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	memset(slots + loop->timeout_slots_size, 0,
+			(size - loop->timeout_slots_size) * sizeof(*slots));
+
+	for (i = size; i > loop->timeout_slots_size; i--) {
+		slots[i - 1].heap_index = -1;
+		slots[i - 1].next_free = loop->timeout_free;
+		loop->timeout_free = i - 1;
+	}
+
+	loop->timeout_slots = slots;
+	loop->timeout_slots_size = size;
+
+	return 0;
+}
+
+int mainloop_loop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback,
 				void *user_data, mainloop_destroy_func destroy)
 {
 	struct timeout_data *data;
+	unsigned int slot;
 
-	if (!callback)
+	if (!loop || !callback)
 		return -EINVAL;
 
-	data = malloc(sizeof(*data));
-	if (!data)
+	/* With a ring the next expiry bounds the wait, see above */
+	if (loop->timeout_fd < 0 && !mainloop_uses_uring(loop)) {
+		loop->timeout_fd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_NONBLOCK | TFD_CLOEXEC);
+		if (loop->timeout_fd < 0)
+			return -EIO;
+
+		if (mainloop_loop_add_fd(loop, loop->timeout_fd, EPOLLIN,
+						timeout_callback, loop,
+						NULL) < 0) {
+			close(loop->timeout_fd);
+			loop->timeout_fd = -1;
+			return -EIO;
+		}
+	}
+
+	if (loop->timeout_free < 0 && timeout_grow(loop) < 0)
 		return -ENOMEM;
 
-	memset(data, 0, sizeof(*data));
+	slot = loop->timeout_free;
+	data = &loop->timeout_slots[slot];
+	loop->timeout_free = data->next_free;
+
 	data->callback = callback;
 	data->destroy = destroy;
 	data->user_data = user_data;
 
-	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (data->fd < 0) {
-		free(data);
+	if (msec > 0 && timeout_schedule(loop, data, msec) < 0) {
+		data->destroy = NULL;
+		timeout_release(loop, data);
 		return -EIO;
 	}
 
-	if (msec > 0) {
-		if (timeout_set(data->fd, msec) < 0) {
-			close(data->fd);
-			free(data);
-			return -EIO;
-		}
-	}
+	return (data->gen << TIMEOUT_SLOT_BITS) | (slot + 1);
+}
 
-	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
-				timeout_callback, data, timeout_destroy) < 0) {
-		close(data->fd);
-		free(data);
+int mainloop_loop_modify_timeout(struct mainloop *loop, int id,
+							unsigned int msec)
+{
+	struct timeout_data *data;
+
+	data = timeout_lookup(loop, id);
+	if (!data)
 		return -EIO;
+
+	if (msec > 0) {
+		if (timeout_schedule(loop, data, msec) < 0)
+			return -EIO;
 	}
 
-	return data->fd;
+	return 0;
 }
 
-int mainloop_modify_timeout(int id, unsigned int msec)
+int mainloop_loop_remove_timeout(struct mainloop *loop, int id)
 {
-	if (msec > 0) {
-		if (timeout_set(id, msec) < 0)
-			return -EIO;
-	}
+	struct timeout_data *data;
 
-	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
-		return -EIO;
+	data = timeout_lookup(loop, id);
+	if (!data)
+		return -ENXIO;
+
+	timeout_release(loop, data);
 
 	return 0;
 }
 
+/*
+ * The calls below keep the original single loop API working, they act on
+ * the calling thread's default loop. mainloop_init() creates it and
+ * mainloop_run() tears it down once it returns.
+ */
+void mainloop_init(void)
+{
+	mainloop_free(default_loop);
+
+	default_loop = mainloop_new();
+
+	// mainloop_notify_init();
+}
+
+void mainloop_quit(void)
+{
+	if (default_loop)
+		mainloop_loop_quit(default_loop);
+
+	// mainloop_sd_notify("STOPPING=1");
+}
+
+void mainloop_exit_success(void)
+{
+	if (default_loop)
+		mainloop_loop_exit(default_loop, EXIT_SUCCESS);
+}
+
+void mainloop_exit_failure(void)
+{
+	if (default_loop)
+		mainloop_loop_exit(default_loop, EXIT_FAILURE);
+}
+
+int mainloop_set_max_events(unsigned int max_events)
+{
+	if (!default_loop)
+		return -EINVAL;
+
+	return mainloop_loop_set_max_events(default_loop, max_events);
+}
+
+int mainloop_run(void)
+{
+	int status;
+
+	if (!default_loop)
+		return EXIT_FAILURE;
+
+	status = mainloop_loop_run(default_loop);
+
+	mainloop_free(default_loop);
+
+	// mainloop_notify_exit();
+
+	return status;
+}
+
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_loop_add_fd(default_loop, fd, events, callback,
+							user_data, destroy);
+}
+
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	return mainloop_loop_modify_fd(default_loop, fd, events);
+}
+
+int mainloop_remove_fd(int fd)
+{
+	return mainloop_loop_remove_fd(default_loop, fd);
+}
+
+int mainloop_defer_fd(int fd, uint32_t events)
+{
+	return mainloop_loop_defer_fd(default_loop, fd, events);
+}
+
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	return mainloop_loop_add_timeout(default_loop, msec, callback,
+							user_data, destroy);
+}
+
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	return mainloop_loop_modify_timeout(default_loop, id, msec);
+}
+
 int mainloop_remove_timeout(int id)
 {
-	return mainloop_remove_fd(id);
+	return mainloop_loop_remove_timeout(default_loop, id);
 }
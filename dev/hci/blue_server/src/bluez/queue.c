@@ -28,11 +28,31 @@
 #include "bluez/util.h"
 #include "bluez/queue.h"
 
+/*
+ * Entries are carved out of per-queue chunks and recycled through a free
+ * list instead of being malloc'ed and freed one by one, so the usual
+ * push_tail/pop_head cycle (ATT send ops, pending requests) does no heap
+ * allocation once the queue has reached its working size. Chunks grow
+ * geometrically and are only released together with the queue itself,
+ * which also keeps entries valid memory for queue_foreach() callbacks that
+ * remove elements or destroy the queue.
+ */
+#define QUEUE_CHUNK_MIN		4
+#define QUEUE_CHUNK_MAX		64
+
+struct queue_chunk {
+	struct queue_chunk *next;
+	unsigned int size;
+	struct queue_entry entries[];
+};
+
 struct queue {
 	int ref_count;
 	struct queue_entry *head;
 	struct queue_entry *tail;
 	unsigned int entries;
+	struct queue_entry *free_entries;
+	struct queue_chunk *chunks;
 };
 
 static struct queue *queue_ref(struct queue *queue)
@@ -47,9 +67,17 @@ static struct queue *queue_ref(struct queue *queue)
 
 static void queue_unref(struct queue *queue)
 {
+	struct queue_chunk *chunk;
+
 	if (__sync_sub_and_fetch(&queue->ref_count, 1))
 		return;
 
+	while (queue->chunks) {
+		chunk = queue->chunks;
+		queue->chunks = chunk->next;
+		free(chunk);
+	}
+
 	free(queue);
 }
 
@@ -61,6 +89,8 @@ struct queue *queue_new(void)
 	queue->head = NULL;
 	queue->tail = NULL;
 	queue->entries = 0;
+	queue->free_entries = NULL;
+	queue->chunks = NULL;
 
 	return queue_ref(queue);
 }
@@ -75,16 +105,50 @@ void queue_destroy(struct queue *queue, queue_destroy_func_t destroy)
 	queue_unref(queue);
 }
 
-static struct queue_entry *queue_entry_new(void *data)
+static void queue_grow(struct queue *queue)
+{
+	struct queue_chunk *chunk;
+	unsigned int size, i;
+
+	size = queue->chunks ? queue->chunks->size * 2 : QUEUE_CHUNK_MIN;
+	if (size > QUEUE_CHUNK_MAX)
+		size = QUEUE_CHUNK_MAX;
+
+	chunk = btd_malloc(sizeof(*chunk) + size * sizeof(struct queue_entry));
+
+	chunk->size = size;
+	chunk->next = queue->chunks;
+	queue->chunks = chunk;
+
+	for (i = 0; i < size; i++) {
+		chunk->entries[i].next = queue->free_entries;
+		queue->free_entries = &chunk->entries[i];
+	}
+}
+
+static struct queue_entry *queue_entry_new(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
+	if (!queue->free_entries)
+		queue_grow(queue);
+
+	entry = queue->free_entries;
+	queue->free_entries = entry->next;
+
 	entry->data = data;
+	entry->next = NULL;
 
 	return entry;
 }
 
+static void queue_entry_free(struct queue *queue, struct queue_entry *entry)
+{
+	entry->data = NULL;
+	entry->next = queue->free_entries;
+	queue->free_entries = entry;
+}
+
 bool queue_push_tail(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
@@ -92,7 +156,7 @@ bool queue_push_tail(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 
 	if (queue->tail)
 		queue->tail->next = entry;
@@ -114,7 +178,7 @@ bool queue_push_head(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 
 	entry->next = queue->head;
 
@@ -147,7 +211,7 @@ bool queue_push_after(struct queue *queue, void *entry, void *data)
 	if (!qentry)
 		return false;
 
-	new_entry = queue_entry_new(data);
+	new_entry = queue_entry_new(queue, data);
 
 	new_entry->next = qentry->next;
 
@@ -178,7 +242,7 @@ void *queue_pop_head(struct queue *queue)
 
 	data = entry->data;
 
-	free(entry);
+	queue_entry_free(queue, entry);
 	queue->entries--;
 
 	return data;
@@ -266,7 +330,7 @@ bool queue_remove(struct queue *queue, void *data)
 		if (!entry->next)
 			queue->tail = prev;
 
-		free(entry);
+		queue_entry_free(queue, entry);
 		queue->entries--;
 
 		return true;
@@ -302,7 +366,7 @@ void *queue_remove_if(struct queue *queue, queue_match_func_t function,
 
 			data = entry->data;
 
-			free(entry);
+			queue_entry_free(queue, entry);
 			queue->entries--;
 
 			return data;
@@ -353,7 +417,7 @@ unsigned int queue_remove_all(struct queue *queue, queue_match_func_t function,
 			if (destroy)
 				destroy(tmp->data);
 
-			free(tmp);
+			queue_entry_free(queue, tmp);
 			count++;
 		}
 	}
@@ -24,6 +24,7 @@
 #include "bluez/timeout.h"
 
 struct timeout_data {
+	struct mainloop *loop;
 	int id;
 	timeout_func_t func;
 	timeout_destroy_func_t destroy;
@@ -34,12 +35,18 @@ struct timeout_data {
 static void timeout_callback(int id, void *user_data)
 {
 	struct timeout_data *data = user_data;
+	struct mainloop *loop = data->loop;
+	unsigned int timeout = data->timeout;
 
+	/*
+	 * func may remove its own timeout, which frees data. A removed id
+	 * never matches a reused slot, so the calls below then do nothing.
+	 */
 	if (data->func(data->user_data) &&
-			!mainloop_modify_timeout(data->id, data->timeout))
+			!mainloop_loop_modify_timeout(loop, id, timeout))
 		return;
 
-	mainloop_remove_timeout(data->id);
+	mainloop_loop_remove_timeout(loop, id);
 }
 
 static void timeout_destroy(void *user_data)
@@ -52,19 +59,24 @@ static void timeout_destroy(void *user_data)
 	free(data);
 }
 
-unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
-			void *user_data, timeout_destroy_func_t destroy)
+unsigned int timeout_add_loop(struct mainloop *loop, unsigned int timeout,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy)
 {
 	struct timeout_data *data;
 
+	if (!loop)
+		return 0;
+
 	data = new0(struct timeout_data, 1);
+	data->loop = loop;
 	data->func = func;
 	data->user_data = user_data;
 	data->timeout = timeout;
 	data->destroy = destroy;
 
-	data->id = mainloop_add_timeout(timeout, timeout_callback, data,
-							timeout_destroy);
+	data->id = mainloop_loop_add_timeout(loop, timeout, timeout_callback,
+						data, timeout_destroy);
 	if (data->id < 0) {
 		free(data);
 		return 0;
@@ -73,10 +85,22 @@ unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
 	return (unsigned int) data->id;
 }
 
-void timeout_remove(unsigned int id)
+void timeout_remove_loop(struct mainloop *loop, unsigned int id)
 {
 	if (!id)
 		return;
 
-	mainloop_remove_timeout((int) id);
+	mainloop_loop_remove_timeout(loop, (int) id);
+}
+
+unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
+			void *user_data, timeout_destroy_func_t destroy)
+{
+	return timeout_add_loop(mainloop_get_default(), timeout, func,
+							user_data, destroy);
+}
+
+void timeout_remove(unsigned int id)
+{
+	timeout_remove_loop(mainloop_get_default(), id);
 }
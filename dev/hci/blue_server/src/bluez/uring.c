@@ -0,0 +1,268 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Minimal io_uring ring handling for the mainloop
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "bluez/uring.h"
+
+struct uring {
+	int fd;
+	unsigned int features;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sqe_tail;		/* Queued, not yet published */
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned int entries,
+					struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags,
+				const void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+							flags, arg, argsz);
+}
+
+static void uring_unmap(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+						ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+struct uring *uring_new(unsigned int entries)
+{
+	struct io_uring_params params;
+	struct uring *ring;
+	unsigned int *array;
+	unsigned int i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	/* Completions are only reaped by the thread running the loop */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+
+	ring->fd = sys_io_uring_setup(entries, &params);
+	if (ring->fd < 0 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params));
+		ring->fd = sys_io_uring_setup(entries, &params);
+	}
+
+	if (ring->fd < 0)
+		goto fail;
+
+	/* The timeout is passed to io_uring_enter instead of a timerfd */
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	ring->features = params.features;
+
+	ring->sq_ring_size = params.sq_off.array +
+					params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (ring->features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+					PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ring->fd,
+					IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto fail;
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = ring->sq_ring + params.sq_off.head;
+	ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+	ring->sq_mask = *(unsigned int *) (ring->sq_ring +
+						params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	/* Submission slots map 1:1 to sqes, set the indirection up once */
+	array = ring->sq_ring + params.sq_off.array;
+	for (i = 0; i < ring->sq_entries; i++)
+		array[i] = i;
+
+	ring->cq_head = ring->cq_ring + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+	ring->cq_mask = *(unsigned int *) (ring->cq_ring +
+						params.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+	return ring;
+
+fail:
+	uring_unmap(ring);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring);
+
+	return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+}
+
+static unsigned int uring_flush(struct uring *ring)
+{
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	return ring->sqe_tail - __atomic_load_n(ring->sq_head,
+							__ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int pending;
+
+	pending = ring->sqe_tail - __atomic_load_n(ring->sq_head,
+							__ATOMIC_ACQUIRE);
+	if (pending >= ring->sq_entries) {
+		pending = uring_flush(ring);
+		sys_io_uring_enter(ring->fd, pending, 0, 0, NULL, 0);
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+int uring_submit_and_wait(struct uring *ring, const struct timespec *timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, wait_nr, flags;
+	int err;
+
+	to_submit = uring_flush(ring);
+
+	/* Completions left from the last batch are reaped first */
+	wait_nr = 1;
+	if (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != *ring->cq_head)
+		wait_nr = 0;
+
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+
+	if (timeout && wait_nr) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_nsec;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+
+	err = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+				flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (err < 0)
+		return -errno;
+
+	return err;
+}
+
+unsigned int uring_get_cqes(struct uring *ring, struct io_uring_cqe *cqes,
+							unsigned int max)
+{
+	unsigned int head, tail, n;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (n = 0; head != tail && n < max; head++, n++)
+		cqes[n] = ring->cqes[head & ring->cq_mask];
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
@@ -0,0 +1,164 @@
+#include "bond_store.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+// group.key -> value of a bluetoothd key file
+static std::map<std::string, std::string> readKeyFile(const std::string &path) {
+  std::map<std::string, std::string> values;
+  std::ifstream in(path);
+  std::string line;
+  std::string group;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (line[0] == '[') {
+      group = line.substr(1, line.find(']') - 1);
+      continue;
+    }
+    size_t eq = line.find('=');
+    if (eq != std::string::npos) {
+      values[group + "." + line.substr(0, eq)] = line.substr(eq + 1);
+    }
+  }
+  return values;
+}
+
+// keys are stored as 32 hex digits in the order the kernel hands them out
+static bool parseKey(const std::string &hex, uint8_t key[16]) {
+  if (hex.size() != 32) {
+    return false;
+  }
+  for (int i = 0; i < 16; ++i) {
+    if (!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1])) {
+      return false;
+    }
+    key[i] = std::stoi(hex.substr(i * 2, 2), nullptr, 16);
+  }
+  return true;
+}
+
+// zero for a path that does not exist
+static struct timespec mtimeOf(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    return timespec();
+  }
+  return st.st_mtim;
+}
+
+BondStore::BondStore() : localIrk_(), dd_(-1), timeout_(0) {
+}
+
+bool BondStore::load(const std::string &adapter, const std::string &storage) {
+  dir_ = storage + "/" + adapter;
+
+  auto identity = readKeyFile(dir_ + "/identity");
+  if (!parseKey(identity["General.IdentityResolvingKey"], localIrk_)) {
+    memset(localIrk_, 0, sizeof(localIrk_));
+  }
+
+  if (!reload()) {
+    std::cerr << "Failed to read bonds from " << dir_ << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  std::cout << bonds_.size() << " bonded peers, " << resolver_.irkCount() << " with an irk" << std::endl;
+  return true;
+}
+
+bool BondStore::reload() {
+  DIR *dir = opendir(dir_.c_str());
+  if (!dir) {
+    return false;
+  }
+
+  bonds_.clear();
+  resolver_.clear();
+  mtimes_.clear();
+  // taken before reading, so a change made meanwhile is read by the next reload
+  mtimes_[dir_] = mtimeOf(dir_);
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    // peers are the directories named by address, next to settings, cache and identity
+    bdaddr_t addr;
+    if (strlen(entry->d_name) != 17 || str2ba(entry->d_name, &addr) < 0) {
+      continue;
+    }
+
+    std::string path = dir_ + "/" + entry->d_name + "/info";
+    mtimes_[path] = mtimeOf(path);
+    auto info = readKeyFile(path);
+    if (!info.count("LongTermKey.Key") && !info.count("PeripheralLongTermKey.Key") &&
+        !info.count("SlaveLongTermKey.Key")) {
+      continue;
+    }
+
+    RpaIdentity identity;
+    bacpy(&identity.addr, &addr);
+    identity.type = info["General.AddressType"] == "static" ? BDADDR_LE_RANDOM : BDADDR_LE_PUBLIC;
+    bonds_.push_back(identity);
+
+    uint8_t irk[16];
+    if (parseKey(info["IdentityResolvingKey.Key"], irk)) {
+      resolver_.addIrk(identity, irk);
+    }
+    memset(irk, 0, sizeof(irk));
+  }
+  closedir(dir);
+  return true;
+}
+
+bool BondStore::lookup(const bdaddr_t &addr, uint8_t type, RpaIdentity *identity) {
+  RpaIdentity id;
+  bacpy(&id.addr, &addr);
+  id.type = type;
+  // a private address names nobody until one of the irks resolves it
+  if (type == BDADDR_LE_RANDOM && RpaResolver::isResolvable(addr) && !resolver_.resolve(addr, &id)) {
+    return false;
+  }
+
+  for (auto &bond : bonds_) {
+    if (bond.type == id.type && !bacmp(&bond.addr, &id.addr)) {
+      *identity = id;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BondStore::changedOnDisk() const {
+  for (auto &entry : mtimes_) {
+    struct timespec mtime = mtimeOf(entry.first);
+    if (mtime.tv_sec != entry.second.tv_sec || mtime.tv_nsec != entry.second.tv_nsec) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BondStore::identify(const bdaddr_t &addr, uint8_t type, RpaIdentity *identity) {
+  if (lookup(addr, type, identity)) {
+    return true;
+  }
+  // unbonded peers miss on every ccc write, only new bonds on disk are worth reading
+  if (dir_.empty() || !changedOnDisk() || !reload()) {
+    return false;
+  }
+  std::cout << bonds_.size() << " bonded peers after reload, " << resolver_.irkCount() << " with an irk"
+            << std::endl;
+  // the controller resolves the new peer's address from now on as well
+  if (dd_ >= 0) {
+    programResolvingList(dd_, timeout_);
+  }
+  return lookup(addr, type, identity);
+}
+
+int BondStore::programResolvingList(int dd, int timeout) {
+  return resolver_.programResolvingList(dd, localIrk_, timeout);
+}
@@ -0,0 +1,187 @@
+#include "ccc_store.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+static const uint32_t kStoreMagic = 0x53434342; // "BCCS"
+static const uint32_t kStoreVersion = 2;
+
+struct StoreHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+#pragma pack(push)
+#pragma pack(1)
+struct CccStore::Record {
+  bdaddr_t addr;
+  uint8_t type;
+  uint8_t features;
+  uint16_t ccc[kMaxCccs];
+  uint8_t hash[16];
+  uint32_t lastUsed; // 0 marks a free slot
+  uint32_t check;
+};
+#pragma pack(pop)
+
+// FNV-1a over everything but the check itself, catches torn or stale slots
+static uint32_t recordCheck(const void *record, size_t len) {
+  const uint8_t *data = (const uint8_t *)record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+CccStore::CccStore() : fd_(-1), clock_(0) {
+  static_assert(sizeof(Record) == 48, "record layout changed");
+}
+
+CccStore::~CccStore() {
+  close();
+}
+
+bool CccStore::open(const std::string &path) {
+  if (fd_ >= 0) {
+    return false;
+  }
+
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
+    std::cerr << "Failed to open ccc store " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  records_.assign(kMaxPeers, Record());
+  memset(records_.data(), 0, kMaxPeers * sizeof(Record));
+
+  StoreHeader header;
+  if (pread(fd_, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      header.magic != kStoreMagic || header.version != kStoreVersion) {
+    // new or unreadable, start over with every slot free
+    header.magic = kStoreMagic;
+    header.version = kStoreVersion;
+    if (ftruncate(fd_, sizeof(header) + kMaxPeers * sizeof(Record)) < 0 ||
+        pwrite(fd_, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        pwrite(fd_, records_.data(), kMaxPeers * sizeof(Record), sizeof(header)) < 0) {
+      std::cerr << "Failed to initialize ccc store: " << strerror(errno) << std::endl;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  if (pread(fd_, records_.data(), kMaxPeers * sizeof(Record), sizeof(header)) < 0) {
+    std::cerr << "Failed to read ccc store: " << strerror(errno) << std::endl;
+    close();
+    return false;
+  }
+
+  for (auto &record : records_) {
+    if (record.lastUsed && recordCheck(&record, offsetof(Record, check)) != record.check) {
+      memset(&record, 0, sizeof(record));
+    }
+    clock_ = std::max(clock_, record.lastUsed);
+  }
+  return true;
+}
+
+void CccStore::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  records_.clear();
+}
+
+bool CccStore::isIdentity(const bdaddr_t &addr, uint8_t type) {
+  if (type == BDADDR_LE_PUBLIC) {
+    return true;
+  }
+  // static random addresses have both top bits set, private ones change
+  return type == BDADDR_LE_RANDOM && (addr.b[5] & 0xc0) == 0xc0;
+}
+
+int CccStore::find(const bdaddr_t &addr, uint8_t type) {
+  for (int i = 0; i < (int)records_.size(); ++i) {
+    const Record &record = records_[i];
+    if (record.lastUsed && record.type == type && !bacmp(&record.addr, &addr)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool CccStore::write(int slot) {
+  Record &record = records_[slot];
+  record.check = recordCheck(&record, offsetof(Record, check));
+  off_t offset = sizeof(StoreHeader) + slot * sizeof(Record);
+  if (pwrite(fd_, &record, sizeof(record), offset) != (ssize_t)sizeof(record)) {
+    std::cerr << "Failed to write ccc store: " << strerror(errno) << std::endl;
+    return false;
+  }
+  // subscriptions change rarely, make each one survive a power cut
+  fdatasync(fd_);
+  return true;
+}
+
+bool CccStore::load(const bdaddr_t &addr, uint8_t type, Peer *peer) {
+  int slot = find(addr, type);
+  if (slot < 0) {
+    return false;
+  }
+
+  Record &record = records_[slot];
+  peer->features = record.features;
+  memcpy(peer->ccc, record.ccc, sizeof(peer->ccc));
+  memcpy(peer->hash, record.hash, sizeof(peer->hash));
+  // only kept in memory, the next store() persists it
+  record.lastUsed = ++clock_;
+  return true;
+}
+
+bool CccStore::store(const bdaddr_t &addr, uint8_t type, const Peer &peer) {
+  if (fd_ < 0 || !isIdentity(addr, type)) {
+    return false;
+  }
+
+  int slot = find(addr, type);
+  if (slot < 0) {
+    // a free slot, or else the peer seen least recently
+    slot = 0;
+    for (int i = 1; i < (int)records_.size() && records_[slot].lastUsed; ++i) {
+      if (records_[i].lastUsed < records_[slot].lastUsed) {
+        slot = i;
+      }
+    }
+  }
+
+  Record &record = records_[slot];
+  if (record.lastUsed && record.type == type && !bacmp(&record.addr, &addr) &&
+      record.features == peer.features && !memcmp(record.ccc, peer.ccc, sizeof(record.ccc)) &&
+      !memcmp(record.hash, peer.hash, sizeof(record.hash))) {
+    return true;
+  }
+
+  bacpy(&record.addr, &addr);
+  record.type = type;
+  record.features = peer.features;
+  memcpy(record.ccc, peer.ccc, sizeof(record.ccc));
+  memcpy(record.hash, peer.hash, sizeof(record.hash));
+  record.lastUsed = ++clock_;
+  return write(slot);
+}
+
+void CccStore::remove(const bdaddr_t &addr, uint8_t type) {
+  int slot = find(addr, type);
+  if (slot < 0) {
+    return;
+  }
+  memset(&records_[slot], 0, sizeof(Record));
+  write(slot);
+}
@@ -3,26 +3,38 @@
 #include <chrono>
 #include <unistd.h>
 
+std::mutex FifoCom::mutex_;
 FifoCom* FifoCom::ins_ = nullptr;
+std::shared_ptr<BleServer> FifoCom::server_;
+OutboundJournal* FifoCom::journal_ = nullptr;
 
 void FifoCom::startFifoThread(const std::string &fifoName)
 {
   std::thread t([fifoName] {
     FifoCom fifo(fifoName);
-    ins_ = &fifo;
-    ins_->readFifo();
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      ins_ = &fifo;
+    }
     std::cout << "fifo thread start" << std::endl;
+    fifo.readFifo();
+    std::lock_guard<std::mutex> guard(mutex_);
+    ins_ = nullptr;
   });
   t.detach();
 }
 
 void FifoCom::initServer(std::shared_ptr<BleServer> server) {
-  if (ins_) {
-    ins_->server_ = server;
-  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  server_ = server;
+}
+
+void FifoCom::initJournal(OutboundJournal *journal) {
+  journal_ = journal;
 }
 
 void FifoCom::sendFifo(const std::string &data) {
+  std::lock_guard<std::mutex> guard(mutex_);
   if (ins_) {
     std::fstream fs;
     fs.open(ins_->fifoName_, std::ios::out);
@@ -39,12 +51,14 @@ void FifoCom::sendFifo(const std::string &data) {
 }
 
 void FifoCom::closeFifo() {
+  std::lock_guard<std::mutex> guard(mutex_);
   if (ins_) {
-    ins_->fifoStream_.close();
+    // the reader closes its stream itself once the current writer is done
+    ins_->isReading_ = false;
     // 删除FIFO文件
     unlink(ins_->fifoName_.c_str());
-    ins_->server_ = nullptr;
   }
+  server_ = nullptr;
 }
 
 FifoCom::FifoCom(const std::string &fifoName) : fifoName_(fifoName), isReading_(true) {
@@ -65,12 +79,31 @@ void FifoCom::readFifo()
     }
     std::cout << "fifo open successfully" << std::endl;
 
+    // every line the writer sends until it closes its end
     std::string data;
-    if (fifoStream_) {
-      std::getline(fifoStream_, data);
+    while (std::getline(fifoStream_, data)) {
+      std::cout << "recv from fifo: " << data << std::endl;
+      dispatch(data);
+    }
+    fifoStream_.close();
+    fifoStream_.clear();
+  }
+}
+
+void FifoCom::dispatch(const std::string &data)
+{
+  std::shared_ptr<BleServer> server;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    server = server_;
+  }
+  if (server && server->connectionEstablished()) {
+    server->processFifo(data);
+  } else if (journal_) {
+    std::vector<uint8_t> payload;
+    int stream = BleServer::journalStream(data, &payload);
+    if (stream >= 0) {
+      journal_->append(stream, payload.data(), payload.size());
     }
-    std::cout << "recv from fifo: " << data << std::endl;
-    server_->processFifo(data);
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
   }
 }
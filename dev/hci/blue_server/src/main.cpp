@@ -8,6 +8,7 @@
 
 #include "ble_server.h"
 #include "hci_helper.h"
+#include "bond_store.h"
 #include "fifo_com.h"
 
 static bool timeout_hander(void *user_data) {
@@ -19,32 +20,56 @@ static bool timeout_hander(void *user_data) {
 int main(int argc, const char* argv[]) {
   std::string advName(argv[1]);
 
+  // events produced between connections are replayed to the next client
+  OutboundJournal journal;
+  if (journal.open("bluetooth_journal", 256 * 1024)) {
+    FifoCom::initJournal(&journal);
+  }
+
+  // subscriptions of bonded peers, so they need not rewrite every ccc on reconnect
+  CccStore cccStore;
+  cccStore.open("bluetooth_ccc");
+
+  // started once, messages sent while nobody is connected go to the journal
+  FifoCom::startFifoThread("bluetooth_fifo");
+
   HciHelper hci;
   if (!hci.valid()) {
     std::cerr << "failed to open hci device";
     return -1;
   }
 
+  // bonds made through bluetoothd, resolved in the controller where it can and by us otherwise
+  BondStore bonds;
+  if (bonds.load(hci.getMacAddress())) {
+    bonds.setController(hci.fd(), 1000);
+    if (bonds.count()) {
+      bonds.programResolvingList(hci.fd(), 1000);
+    }
+  }
+
   do
   {
     auto hciVersion = hci.getHciVersion();
     std::cout << "Using advertising name: " << advName << std::endl;;
-    hci.setLeAdvertisingData(0x0a0a, advName.c_str());
+    hci.setLeAdvertisingData(BleServer::advertisedService(), advName.c_str());
 
     mainloop_init();
     // timeout_add(1000, timeout_hander, nullptr, nullptr);
     std::shared_ptr<BleServer> server = std::make_shared<BleServer>(advName, 512);
     if (server->connectionEstablished()) {
       std::cout << "connection established" << std::endl;;
+      server->setJournal(journal.isOpen() ? &journal : nullptr);
+      server->setCccStore(cccStore.isOpen() ? &cccStore : nullptr);
+      server->setBondStore(&bonds);
       server->initServices();
     } else {
       return -1;
     }
-    FifoCom::startFifoThread("bluetooth_fifo");
     FifoCom::initServer(server);
     
     mainloop_run();
-    FifoCom::closeFifo();
+    FifoCom::initServer(nullptr);
     sleep(1);
   } while (true);
 
@@ -0,0 +1,305 @@
+#include "outbound_journal.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+
+static const uint32_t kJournalMagic = 0x4a4e4c42; // "BLNJ"
+static const uint32_t kJournalVersion = 1;
+static const size_t kHeaderSize = 4096;
+
+struct OutboundJournal::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t head; // logical position of the oldest record
+  uint64_t tail; // logical position the next record goes to
+  uint32_t nextSeq[kMaxStreams];
+  uint32_t acked[kMaxStreams];
+};
+
+#pragma pack(push)
+#pragma pack(1)
+struct RecordHeader {
+  uint16_t len;
+  uint16_t stream;
+  uint32_t seq;
+  uint32_t check;
+};
+#pragma pack(pop)
+
+// FNV-1a over the record header fields and the payload
+static uint32_t recordCheck(const RecordHeader &rh, const uint8_t *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  const uint8_t *fields = (const uint8_t *)&rh;
+  for (size_t i = 0; i < offsetof(RecordHeader, check); ++i) {
+    hash = (hash ^ fields[i]) * 16777619u;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// sequence numbers wrap, a is newer than b if it is less than 2^31 ahead
+static bool seqAfter(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+OutboundJournal::OutboundJournal()
+  : fd_(-1), header_(nullptr), ring_(nullptr), mapSize_(0), capacity_(0) {
+}
+
+OutboundJournal::~OutboundJournal() {
+  close();
+}
+
+bool OutboundJournal::open(const std::string &path, size_t capacity) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (header_) {
+    return false;
+  }
+
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
+    std::cerr << "Failed to open journal " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) < 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  // an existing log keeps its own capacity so nothing stored is lost
+  bool fresh = true;
+  if ((size_t)st.st_size >= kHeaderSize) {
+    Header header;
+    if (pread(fd_, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        header.magic == kJournalMagic && header.version == kJournalVersion &&
+        (uint64_t)st.st_size == kHeaderSize + header.capacity) {
+      capacity = header.capacity;
+      fresh = false;
+    }
+  }
+
+  mapSize_ = kHeaderSize + capacity;
+  if (fresh && ftruncate(fd_, mapSize_) < 0) {
+    std::cerr << "Failed to size journal: " << strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  void *map = mmap(NULL, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    std::cerr << "Failed to map journal: " << strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  header_ = (Header *)map;
+  ring_ = (uint8_t *)map + kHeaderSize;
+  capacity_ = capacity;
+
+  if (fresh) {
+    memset(header_, 0, sizeof(*header_));
+    header_->magic = kJournalMagic;
+    header_->version = kJournalVersion;
+    header_->capacity = capacity_;
+    for (auto &seq : header_->nextSeq) {
+      seq = 1;
+    }
+  }
+
+  recover();
+  return true;
+}
+
+void OutboundJournal::close() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (header_) {
+    munmap(header_, mapSize_);
+    header_ = nullptr;
+    ring_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool OutboundJournal::isOpen() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return header_ != nullptr;
+}
+
+void OutboundJournal::copyIn(uint64_t pos, const void *src, size_t len) {
+  size_t offset = pos % capacity_;
+  size_t first = std::min<size_t>(len, capacity_ - offset);
+  memcpy(ring_ + offset, src, first);
+  memcpy(ring_, (const uint8_t *)src + first, len - first);
+}
+
+void OutboundJournal::copyOut(uint64_t pos, void *dst, size_t len) {
+  size_t offset = pos % capacity_;
+  size_t first = std::min<size_t>(len, capacity_ - offset);
+  memcpy(dst, ring_ + offset, first);
+  memcpy((uint8_t *)dst + first, ring_, len - first);
+}
+
+size_t OutboundJournal::recordSize(uint64_t pos) {
+  RecordHeader rh;
+  copyOut(pos, &rh, sizeof(rh));
+  return sizeof(rh) + rh.len;
+}
+
+bool OutboundJournal::readRecord(uint64_t pos, Record *record) {
+  RecordHeader rh;
+  if (header_->tail - pos < sizeof(rh)) {
+    return false;
+  }
+  copyOut(pos, &rh, sizeof(rh));
+  if (rh.len > kMaxPayload || rh.stream >= kMaxStreams ||
+      header_->tail - pos - sizeof(rh) < rh.len) {
+    return false;
+  }
+  record->data.resize(rh.len);
+  copyOut(pos + sizeof(rh), record->data.data(), rh.len);
+  if (recordCheck(rh, record->data.data(), rh.len) != rh.check) {
+    return false;
+  }
+  record->stream = rh.stream;
+  record->seq = rh.seq;
+  return true;
+}
+
+void OutboundJournal::recover() {
+  if (header_->tail < header_->head || header_->tail - header_->head > capacity_) {
+    std::cerr << "journal header is corrupt, starting empty" << std::endl;
+    header_->head = header_->tail;
+  }
+
+  // keep everything up to the first record a crash left half written
+  Record record;
+  uint64_t pos = header_->head;
+  size_t count = 0;
+  while (pos < header_->tail && readRecord(pos, &record)) {
+    if (!seqAfter(header_->nextSeq[record.stream], record.seq)) {
+      header_->nextSeq[record.stream] = record.seq + 1;
+    }
+    pos += sizeof(RecordHeader) + record.data.size();
+    ++count;
+  }
+  if (pos != header_->tail) {
+    std::cerr << "journal truncated after " << count << " records" << std::endl;
+    header_->tail = pos;
+  }
+}
+
+uint32_t OutboundJournal::append(uint16_t stream, const uint8_t *data, size_t len) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!header_ || stream >= kMaxStreams) {
+    return 0;
+  }
+
+  uint32_t seq = 0;
+  do {
+    RecordHeader rh;
+    rh.len = std::min<size_t>(len, kMaxPayload);
+    rh.stream = stream;
+    size_t size = sizeof(rh) + rh.len;
+    if (size > capacity_) {
+      break;
+    }
+
+    // make room first, the new record overwrites the oldest ones
+    while (header_->tail + size - header_->head > capacity_) {
+      header_->head += recordSize(header_->head);
+    }
+
+    seq = header_->nextSeq[stream];
+    rh.seq = seq;
+    rh.check = recordCheck(rh, data, rh.len);
+    copyIn(header_->tail, &rh, sizeof(rh));
+    copyIn(header_->tail + sizeof(rh), data, rh.len);
+
+    // publish only once the record is complete, recover() catches the
+    // sequence number up if we die before it is bumped
+    __atomic_store_n(&header_->tail, header_->tail + size, __ATOMIC_RELEASE);
+    if (!++header_->nextSeq[stream]) {
+      header_->nextSeq[stream] = 1;
+    }
+
+    data += rh.len;
+    len -= rh.len;
+  } while (len);
+
+  return seq;
+}
+
+bool OutboundJournal::read(uint64_t *cursor, Record *record) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!header_) {
+    return false;
+  }
+
+  uint64_t pos = std::max(*cursor, header_->head);
+  while (pos < header_->tail && readRecord(pos, record)) {
+    pos += sizeof(RecordHeader) + record->data.size();
+    if (seqAfter(record->seq, header_->acked[record->stream])) {
+      *cursor = pos;
+      return true;
+    }
+  }
+  *cursor = pos;
+  return false;
+}
+
+void OutboundJournal::ack(uint16_t stream, uint32_t seq) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!header_ || stream >= kMaxStreams) {
+    return;
+  }
+  if (seqAfter(seq, header_->acked[stream])) {
+    header_->acked[stream] = seq;
+  }
+  reclaim();
+}
+
+void OutboundJournal::reclaim() {
+  // frees acked records from the front, stops at the first one still owed
+  while (header_->head < header_->tail) {
+    RecordHeader rh;
+    copyOut(header_->head, &rh, sizeof(rh));
+    if (rh.stream >= kMaxStreams || seqAfter(rh.seq, header_->acked[rh.stream])) {
+      break;
+    }
+    header_->head += sizeof(rh) + rh.len;
+  }
+}
+
+size_t OutboundJournal::pending() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!header_) {
+    return 0;
+  }
+
+  Record record;
+  size_t count = 0;
+  uint64_t pos = header_->head;
+  while (pos < header_->tail && readRecord(pos, &record)) {
+    pos += sizeof(RecordHeader) + record.data.size();
+    if (seqAfter(record.seq, header_->acked[record.stream])) {
+      ++count;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,244 @@
+#include "rpa_resolver.h"
+#include "bluez/hci.h"
+#include "bluez/hci_lib.h"
+
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+
+/* HCI peer identity address types */
+#define HCI_ADDR_PUBLIC 0x00
+#define HCI_ADDR_RANDOM 0x01
+
+RpaResolver::RpaResolver(std::chrono::milliseconds cacheTtl, size_t cacheSize)
+  : cacheTtl_(cacheTtl), cacheSize_(cacheSize) {
+  cache_.reserve(cacheSize_);
+}
+
+RpaResolver::~RpaResolver() {
+  clear();
+}
+
+uint64_t RpaResolver::addrKey(const bdaddr_t &addr) {
+  uint64_t key = 0;
+  memcpy(&key, addr.b, sizeof(addr.b));
+  return key;
+}
+
+bool RpaResolver::addIrk(const RpaIdentity &identity, const uint8_t irk[16]) {
+  uint8_t msb[16];
+  removeIrk(identity);
+
+  Irk entry;
+  entry.identity = identity;
+  memcpy(entry.key, irk, 16);
+  // bt_aes128 takes the key most significant octet first
+  for (int i = 0; i < 16; ++i) {
+    msb[i] = irk[15 - i];
+  }
+  bt_aes128_set_key(&entry.aes, msb);
+  memset(msb, 0, sizeof(msb));
+  irks_.push_back(entry);
+  bt_aes128_clear(&entry.aes);
+  memset(entry.key, 0, sizeof(entry.key));
+
+  // cached misses may resolve now, and irk indexes have moved
+  cache_.clear();
+  cacheOrder_.clear();
+  return true;
+}
+
+bool RpaResolver::removeIrk(const RpaIdentity &identity) {
+  for (auto it = irks_.begin(); it != irks_.end(); ++it) {
+    if (!bacmp(&it->identity.addr, &identity.addr) && it->identity.type == identity.type) {
+      bt_aes128_clear(&it->aes);
+      memset(it->key, 0, sizeof(it->key));
+      irks_.erase(it);
+      cache_.clear();
+      cacheOrder_.clear();
+      return true;
+    }
+  }
+  return false;
+}
+
+void RpaResolver::clear() {
+  for (auto &entry : irks_) {
+    bt_aes128_clear(&entry.aes);
+    memset(entry.key, 0, sizeof(entry.key));
+  }
+  irks_.clear();
+  cache_.clear();
+  cacheOrder_.clear();
+}
+
+bool RpaResolver::lookupCache(uint64_t key, Clock::time_point now, RpaResult *result) {
+  auto it = cache_.find(key);
+  if (it == cache_.end() || it->second.expires <= now) {
+    return false;
+  }
+  result->resolved = it->second.irk >= 0;
+  if (result->resolved) {
+    result->identity = irks_[it->second.irk].identity;
+  }
+  return true;
+}
+
+void RpaResolver::storeCache(uint64_t key, int irk, Clock::time_point now) {
+  if (!cacheSize_) {
+    return;
+  }
+  auto expires = now + cacheTtl_;
+  cache_[key] = CacheEntry{ irk, expires };
+  cacheOrder_.emplace_back(key, expires);
+
+  while (cache_.size() > cacheSize_ && !cacheOrder_.empty()) {
+    auto front = cacheOrder_.front();
+    cacheOrder_.pop_front();
+    auto it = cache_.find(front.first);
+    if (it != cache_.end() && it->second.expires == front.second) {
+      cache_.erase(it);
+    }
+  }
+}
+
+void RpaResolver::expireCache(Clock::time_point now) {
+  while (!cacheOrder_.empty() && cacheOrder_.front().second <= now) {
+    auto front = cacheOrder_.front();
+    cacheOrder_.pop_front();
+    auto it = cache_.find(front.first);
+    if (it != cache_.end() && it->second.expires == front.second) {
+      cache_.erase(it);
+    }
+  }
+}
+
+bool RpaResolver::resolve(const bdaddr_t &rpa, RpaIdentity *identity) {
+  RpaResult result;
+  if (!resolveBatch(&rpa, 1, &result)) {
+    return false;
+  }
+  if (identity) {
+    *identity = result.identity;
+  }
+  return true;
+}
+
+size_t RpaResolver::resolveBatch(const bdaddr_t *rpas, size_t count, RpaResult *results) {
+  auto now = Clock::now();
+  size_t resolved = 0;
+
+  expireCache(now);
+  pending_.clear();
+  for (size_t i = 0; i < count; ++i) {
+    results[i].resolved = false;
+    ++stats_.lookups;
+    if (!isResolvable(rpas[i])) {
+      continue;
+    }
+    if (lookupCache(addrKey(rpas[i]), now, &results[i])) {
+      ++stats_.cacheHits;
+      resolved += results[i].resolved;
+      continue;
+    }
+    pending_.push_back(i);
+  }
+
+  size_t n = pending_.size();
+  if (!n) {
+    stats_.resolved += resolved;
+    return resolved;
+  }
+
+  /*
+   * ah(k, prand) = e(k, 0^104 || prand) mod 2^24. With the blocks laid out
+   * most significant octet first, prand lands in the last three octets and
+   * the hash is compared against the last three octets of the output.
+   * All pending addresses go through one IRK before the next, so each key
+   * schedule is loaded once per batch and the blocks can be pipelined.
+   */
+  blocks_.assign(n * 32, 0);
+  uint8_t *in = blocks_.data();
+  uint8_t *out = in + n * 16;
+  for (size_t j = 0; j < n; ++j) {
+    const bdaddr_t &addr = rpas[pending_[j]];
+    in[j * 16 + 13] = addr.b[5];
+    in[j * 16 + 14] = addr.b[4];
+    in[j * 16 + 15] = addr.b[3];
+  }
+
+  for (size_t k = 0; k < irks_.size() && n; ++k) {
+    bt_aes128_encrypt_blocks(&irks_[k].aes, in, out, n);
+    stats_.aesBlocks += n;
+
+    for (size_t j = 0; j < n;) {
+      const bdaddr_t &addr = rpas[pending_[j]];
+      const uint8_t *hash = out + j * 16;
+      if (hash[15] != addr.b[0] || hash[14] != addr.b[1] || hash[13] != addr.b[2]) {
+        ++j;
+        continue;
+      }
+
+      RpaResult &result = results[pending_[j]];
+      result.resolved = true;
+      result.identity = irks_[k].identity;
+      storeCache(addrKey(addr), (int)k, now);
+      ++resolved;
+
+      // drop it from the batch so later IRKs skip it
+      --n;
+      pending_[j] = pending_[n];
+      memcpy(in + j * 16, in + n * 16, 16);
+      memcpy(out + j * 16, out + n * 16, 16);
+    }
+  }
+
+  for (size_t j = 0; j < n; ++j) {
+    storeCache(addrKey(rpas[pending_[j]]), -1, now);
+  }
+
+  stats_.resolved += resolved;
+  return resolved;
+}
+
+int RpaResolver::programResolvingList(int dd, const uint8_t *localIrk, int timeout) {
+  // the resolving list can not be changed while address resolution is enabled
+  if (hci_le_set_address_resolution_enable(dd, 0x00, timeout) < 0) {
+    std::cerr << "failed to disable address resolution, error: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  if (hci_le_clear_resolving_list(dd, timeout) < 0) {
+    std::cerr << "failed to clear resolving list, error: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  uint8_t size = 0;
+  if (hci_le_read_resolving_list_size(dd, &size, timeout) < 0) {
+    std::cerr << "failed to read resolving list size, error: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  int written = 0;
+  for (auto &entry : irks_) {
+    if (written >= size) {
+      std::cerr << "resolving list full, " << irks_.size() - written
+                << " irks left to host resolution" << std::endl;
+      break;
+    }
+    uint8_t type = entry.identity.type == BDADDR_LE_RANDOM ? HCI_ADDR_RANDOM : HCI_ADDR_PUBLIC;
+    if (hci_le_add_resolving_list(dd, &entry.identity.addr, type, entry.key,
+                                  const_cast<uint8_t *>(localIrk), timeout) < 0) {
+      std::cerr << "failed to add resolving list entry, error: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    ++written;
+  }
+
+  if (written && hci_le_set_address_resolution_enable(dd, 0x01, timeout) < 0) {
+    std::cerr << "failed to enable address resolution, error: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  return written;
+}
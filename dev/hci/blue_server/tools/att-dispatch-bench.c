@@ -0,0 +1,233 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  ATT receive dispatch with server and client registrations
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Builds att.c into itself to reach the per-opcode registration index
+ * and handle_pdu(), so that dispatch is timed without any socket I/O.
+ *
+ * First checks that a BT_ATT_ALL_REQUESTS registration is indexed under
+ * every request and command opcode, that bt_att_unregister() takes it
+ * out of every slot again, and that the registrations left keep their
+ * order. Then puts a bt_gatt_server and a bt_gatt_client on one bt_att,
+ * as a device that is both does, and feeds alternating notifications and
+ * write commands straight to the receive dispatcher.
+ *
+ *	att-dispatch-bench [pdus]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/bluez/att.c"
+
+#include "bluez/mainloop.h"
+#include "bluez/gatt-db.h"
+#include "bluez/gatt-server.h"
+#include "bluez/gatt-client.h"
+
+static unsigned int calls[2];
+static unsigned int order;
+
+/* Each is counted only when it runs in registration order */
+static void count_first(struct bt_att_chan *chan, uint8_t opcode,
+					const void *pdu, uint16_t length,
+					void *user_data)
+{
+	if (order++ == 0)
+		calls[0]++;
+}
+
+static void count_second(struct bt_att_chan *chan, uint8_t opcode,
+					const void *pdu, uint16_t length,
+					void *user_data)
+{
+	if (order++ == 1)
+		calls[1]++;
+}
+
+static unsigned int slots_with(struct bt_att *att, unsigned int id,
+						unsigned int *expected)
+{
+	struct att_notify *notify;
+	unsigned int i, n = 0;
+
+	notify = queue_find(att->notify_list, match_notify_id,
+							UINT_TO_PTR(id));
+
+	for (i = 0, *expected = 0; i < 256; i++) {
+		if (opcode_match(BT_ATT_ALL_REQUESTS, i))
+			(*expected)++;
+
+		if (notify && queue_find(att->notify_index[i], NULL, notify))
+			n++;
+	}
+
+	return n;
+}
+
+static bool check_unregister(void)
+{
+	uint8_t pdu[] = { BT_ATT_OP_WRITE_CMD, 0x10, 0x00, 0x01 };
+	struct bt_att_chan *chan;
+	struct bt_att *att;
+	struct att_notify *notify;
+	unsigned int all, other, later, expected, stale, i;
+	bool ok = true;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return false;
+
+	att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(att, true);
+	chan = queue_peek_tail(att->chans);
+
+	all = bt_att_register(att, BT_ATT_ALL_REQUESTS, count_first, NULL,
+									NULL);
+	other = bt_att_register(att, BT_ATT_OP_WRITE_CMD, count_first, NULL,
+									NULL);
+	later = bt_att_register(att, BT_ATT_ALL_REQUESTS, count_second, NULL,
+									NULL);
+
+	if (slots_with(att, all, &expected) != expected || expected < 2) {
+		fprintf(stderr, "All requests not indexed under %u opcodes\n",
+								expected);
+		ok = false;
+	}
+
+	notify = queue_find(att->notify_list, match_notify_id,
+							UINT_TO_PTR(all));
+	bt_att_unregister(att, all);
+
+	for (i = 0, stale = 0; i < 256; i++) {
+		if (queue_find(att->notify_index[i], NULL, notify))
+			stale++;
+	}
+
+	if (stale) {
+		fprintf(stderr, "Unregistered handler left under %u of %u "
+					"opcodes\n", stale, expected);
+		ok = false;
+	}
+
+	if (slots_with(att, later, &expected) != expected ||
+			queue_length(att->notify_index[BT_ATT_OP_WRITE_CMD]) != 2) {
+		fprintf(stderr, "Unregister removed other handlers\n");
+		ok = false;
+	}
+
+	/* Dispatching to a stale entry would use freed memory */
+	if (!ok)
+		goto done;
+
+	/* The write command handler, then the later all requests one */
+	handle_pdu(chan, pdu, sizeof(pdu));
+	if (calls[0] != 1 || calls[1] != 1) {
+		fprintf(stderr, "Write command dispatched to %u + %u "
+					"handlers\n", calls[0], calls[1]);
+		ok = false;
+	}
+
+	bt_att_unregister(att, other);
+	bt_att_unregister(att, later);
+
+	for (i = 0; i < 256; i++) {
+		if (!queue_isempty(att->notify_index[i])) {
+			fprintf(stderr, "Opcode 0x%02x still indexed\n", i);
+			ok = false;
+		}
+	}
+
+done:
+	bt_att_unref(att);
+	close(sv[1]);
+
+	return ok;
+}
+
+static void bench_dispatch(int total)
+{
+	uint8_t nfy[] = { BT_ATT_OP_HANDLE_NFY, 0x10, 0x00, 1, 2, 3, 4 };
+	uint8_t cmd[] = { BT_ATT_OP_WRITE_CMD, 0x00, 0x00, 1 };
+	struct bt_gatt_server *server;
+	struct bt_gatt_client *client;
+	struct gatt_db *db, *client_db;
+	struct bt_att_chan *chan;
+	struct bt_att *att;
+	struct timespec start, end;
+	uint8_t buf[sizeof(nfy)];
+	double secs;
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return;
+
+	att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(att, true);
+	chan = queue_peek_tail(att->chans);
+
+	db = gatt_db_new();
+	client_db = gatt_db_new();
+	server = bt_gatt_server_new(db, att, 247, 0);
+	client = bt_gatt_client_new(client_db, att, 247, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* handle_pdu() may modify the PDU in place */
+	for (i = 0; i < total; i++) {
+		if (i & 1) {
+			memcpy(buf, nfy, sizeof(nfy));
+			handle_pdu(chan, buf, sizeof(nfy));
+		} else {
+			memcpy(buf, cmd, sizeof(cmd));
+			handle_pdu(chan, buf, sizeof(cmd));
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%u registrations: %.1f ns per received PDU "
+			"(notifications and write commands)\n",
+			queue_length(att->notify_list), secs * 1e9 / total);
+
+	bt_gatt_client_unref(client);
+	bt_gatt_server_unref(server);
+	gatt_db_unref(client_db);
+	gatt_db_unref(db);
+	bt_att_unref(att);
+	close(sv[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	int total = argc > 1 ? atoi(argv[1]) : 5000000;
+
+	mainloop_init();
+
+	if (!check_unregister())
+		return EXIT_FAILURE;
+
+	bench_dispatch(total);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Starvation bound of the ATT send scheduler under a notification burst
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A bt_att queues a burst of notifications and then keeps one Read
+ * Request outstanding for as long as the burst lasts, queueing the next
+ * one from the response callback. The peer on the other end of the
+ * socketpair reads a single PDU per wakeup, so the socket stays full and
+ * most write batches only partly go out; the ops left over are put back.
+ *
+ * Nothing is queued in the control class, so every request must go out
+ * within the bulk quantum, counted in PDUs written after it was queued.
+ * An op that is picked and put back must not use up its class's turn
+ * either, otherwise a request that lands in the unwritten part of a batch
+ * waits for another round. The run is repeated with two bulk quanta and
+ * send buffer sizes, which put the request there in different ways.
+ *
+ *	att-prio-check [notifications]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluez/att.h"
+#include "bluez/mainloop.h"
+#include "bluez/util.h"
+
+struct check {
+	struct bt_att *att;
+	int peer;
+	int notifications;
+	int received;			/* Notifications the peer got */
+	int pdus;			/* PDUs the peer got */
+	int requests;
+	uint64_t queued_at;		/* tx_pdus when the request was queued */
+	uint64_t max_wait;
+	bool failed;
+};
+
+static void send_request(struct check *check);
+
+static void read_rsp(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct check *check = user_data;
+
+	if (opcode != BT_ATT_OP_READ_RSP) {
+		fprintf(stderr, "Read failed: opcode 0x%02x\n", opcode);
+		check->failed = true;
+		mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	if (check->received < check->notifications)
+		send_request(check);
+}
+
+static void send_request(struct check *check)
+{
+	struct bt_att_stats stats;
+	uint8_t pdu[2];
+
+	put_le16(0x0003, pdu);
+	bt_att_get_stats(check->att, &stats);
+	check->queued_at = stats.tx_pdus;
+
+	if (!bt_att_send(check->att, BT_ATT_OP_READ_REQ, pdu, sizeof(pdu),
+						read_rsp, check, NULL))
+		check->failed = true;
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct check *check = user_data;
+	static const uint8_t rsp[] = { BT_ATT_OP_READ_RSP, 0x01 };
+	uint8_t pdu[32];
+	uint64_t wait;
+	ssize_t len;
+
+	/* One PDU per wakeup keeps the sender's socket full */
+	len = read(fd, pdu, sizeof(pdu));
+	if (len <= 0)
+		return;
+
+	check->pdus++;
+
+	if (pdu[0] == BT_ATT_OP_HANDLE_NFY) {
+		if (++check->received == check->notifications)
+			mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	if (pdu[0] != BT_ATT_OP_READ_REQ)
+		return;
+
+	/* PDUs written after the request was queued, the request included */
+	wait = check->pdus - check->queued_at - 1;
+	if (wait > check->max_wait)
+		check->max_wait = wait;
+
+	check->requests++;
+
+	if (write(fd, rsp, sizeof(rsp)) < 0)
+		check->failed = true;
+}
+
+static bool run(int notifications, unsigned int quantum, int sndbuf)
+{
+	static const uint8_t nfy[] = { 0x10, 0x00, 0xaa, 0xbb, 0xcc, 0xdd };
+	struct check check;
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	memset(&check, 0, sizeof(check));
+	check.notifications = notifications;
+	check.peer = sv[1];
+	check.att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(check.att, true);
+	bt_att_set_prio_quantum(check.att, BT_ATT_PRIO_BULK, quantum);
+	mainloop_add_fd(check.peer, EPOLLIN, peer_read, &check, NULL);
+
+	for (i = 0; i < notifications; i++)
+		bt_att_send(check.att, BT_ATT_OP_HANDLE_NFY, nfy, sizeof(nfy),
+							NULL, NULL, NULL);
+
+	send_request(&check);
+	mainloop_loop_run(mainloop_get_default());
+
+	printf("bulk quantum %2u sndbuf %5d: %d read requests, at most %llu "
+			"PDUs ahead of one\n", quantum, sndbuf, check.requests,
+			(unsigned long long) check.max_wait);
+
+	mainloop_remove_fd(check.peer);
+	bt_att_unref(check.att);
+	close(check.peer);
+
+	if (check.failed)
+		return false;
+
+	if (check.requests < 2) {
+		fprintf(stderr, "No read request went out during the burst\n");
+		return false;
+	}
+
+	if (check.max_wait > quantum) {
+		fprintf(stderr, "A read request waited past the bulk quantum\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int notifications = argc > 1 ? atoi(argv[1]) : 10000;
+
+	mainloop_init();
+
+	/* A send buffer of 1 byte is raised to the kernel's minimum */
+	if (!run(notifications, 8, 1) || !run(notifications, 12, 4000))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
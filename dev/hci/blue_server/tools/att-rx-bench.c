@@ -0,0 +1,206 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Receive syscalls per PDU on a local ATT bearer
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A peer on one end of an AF_UNIX seqpacket pair, which bt_att takes as
+ * a BT_ATT_LOCAL bearer, sends 23 byte write commands in bursts of 1, 8
+ * and 64; the next burst goes out once bt_att has dispatched the last
+ * one. The binary is linked with --wrap for epoll_wait, read and
+ * recvmmsg to count what receiving costs per PDU, and fails if a burst
+ * of 64 is not read in batches.
+ *
+ *	att-rx-bench [commands]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "bluez/att.h"
+#include "bluez/mainloop.h"
+
+#define PDU_LEN		23
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout);
+ssize_t __real_read(int fd, void *buf, size_t count);
+int __real_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+					int flags, struct timespec *timeout);
+
+static unsigned long waits, rx_calls;
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout)
+{
+	waits++;
+	return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	rx_calls++;
+	return __real_read(fd, buf, count);
+}
+
+int __wrap_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+					int flags, struct timespec *timeout)
+{
+	rx_calls++;
+	return __real_recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
+struct bench {
+	int peer;
+	int burst;
+	int total;
+	int sent;
+	int received;
+	bool failed;
+};
+
+static void send_burst(struct bench *bench)
+{
+	uint8_t pdu[PDU_LEN];
+	int i;
+
+	memset(pdu, 0, sizeof(pdu));
+	pdu[0] = BT_ATT_OP_WRITE_CMD;
+	pdu[1] = 0x10;
+
+	for (i = 0; i < bench->burst && bench->sent < bench->total; i++) {
+		pdu[3] = bench->sent;
+
+		if (send(bench->peer, pdu, sizeof(pdu), 0) != sizeof(pdu)) {
+			bench->failed = true;
+			return;
+		}
+
+		bench->sent++;
+	}
+}
+
+static void write_cmd(struct bt_att_chan *chan, uint8_t opcode,
+					const void *pdu, uint16_t length,
+					void *user_data)
+{
+	struct bench *bench = user_data;
+	const uint8_t *value = pdu;
+
+	/* Dispatched in order, without the opcode */
+	if (length != PDU_LEN - 1 || value[2] != (uint8_t) bench->received)
+		bench->failed = true;
+
+	if (bench->failed || ++bench->received == bench->total) {
+		mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	if (bench->received == bench->sent)
+		send_burst(bench);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool run(int burst, int total)
+{
+	struct bt_att_stats stats;
+	struct bench bench;
+	struct bt_att *att;
+	unsigned long waits_start, rx_start;
+	int sndbuf = 1 << 20;
+	double start, secs;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return false;
+
+	/* Room for the largest burst */
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	memset(&bench, 0, sizeof(bench));
+	bench.peer = sv[1];
+	bench.burst = burst;
+	bench.total = total;
+
+	att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(att, true);
+	bt_att_register(att, BT_ATT_OP_WRITE_CMD, write_cmd, &bench, NULL);
+
+	if (bt_att_get_link_type(att) != BT_ATT_LOCAL) {
+		fprintf(stderr, "Not a local bearer\n");
+		bench.failed = true;
+	}
+
+	waits_start = waits;
+	rx_start = rx_calls;
+	start = now();
+
+	send_burst(&bench);
+	if (!bench.failed)
+		mainloop_loop_run(mainloop_get_default());
+
+	secs = now() - start;
+	bt_att_get_stats(att, &stats);
+
+	bt_att_unref(att);
+	close(sv[1]);
+
+	if (bench.failed) {
+		fprintf(stderr, "Burst %d: commands lost or out of order\n",
+									burst);
+		return false;
+	}
+
+	printf("bursts of %2d: %5.3f epoll_wait %5.3f receive syscalls per "
+		"PDU, at most %2u PDUs per wakeup, %7.0f PDUs/s\n", burst,
+		(double) (waits - waits_start) / total,
+		(double) (rx_calls - rx_start) / total,
+		stats.rx_max_batch, total / secs);
+
+	if (burst >= 64 && rx_calls - rx_start >= (unsigned long) total / 2) {
+		fprintf(stderr, "Bursts are not read in batches\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int total = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	mainloop_init();
+
+	if (!run(1, total) || !run(8, total) || !run(64, total))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
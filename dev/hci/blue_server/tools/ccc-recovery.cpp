@@ -0,0 +1,273 @@
+// Checks that CccStore only ever hands back subscriptions it wrote whole.
+//
+// Records torn halfway through an update, or whose check no longer matches
+// their contents, must be dropped at open while the other peers survive. Once
+// every slot is taken the peer seen least recently must lose its slot, also
+// across a reopen, and a file with another magic, version or a cut header
+// must be started over instead of being misread.
+//
+//   ccc-recovery [store file]
+
+#include "ccc_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(EXIT_FAILURE);                                               \
+    }                                                                   \
+  } while (0)
+
+// layout of the file as ccc_store.cpp writes it
+static const long kHeaderSize = 8;
+static const long kRecordSize = 48;
+static const long kCccOffset = 8;
+static const long kCheckOffset = 44;
+
+static bdaddr_t peerAddr(int i) {
+  bdaddr_t addr = {{(uint8_t)i, (uint8_t)(i >> 8), 0x33, 0x44, 0x55, 0x66}};
+  return addr;
+}
+
+static CccStore::Peer peerState(int i) {
+  CccStore::Peer peer = {};
+  peer.features = 0x01;
+  for (int j = 0; j < CccStore::kMaxCccs; ++j) {
+    peer.ccc[j] = (i + j) & 0x0003;
+  }
+  memset(peer.hash, i, sizeof(peer.hash));
+  return peer;
+}
+
+static bool hasPeer(CccStore *store, int i) {
+  bdaddr_t addr = peerAddr(i);
+  CccStore::Peer peer;
+  if (!store->load(addr, BDADDR_LE_PUBLIC, &peer)) {
+    return false;
+  }
+  CccStore::Peer expected = peerState(i);
+  CHECK(peer.features == expected.features);
+  CHECK(!memcmp(peer.ccc, expected.ccc, sizeof(peer.ccc)));
+  CHECK(!memcmp(peer.hash, expected.hash, sizeof(peer.hash)));
+  return true;
+}
+
+static void storePeer(CccStore *store, int i) {
+  bdaddr_t addr = peerAddr(i);
+  CHECK(store->store(addr, BDADDR_LE_PUBLIC, peerState(i)));
+}
+
+static std::vector<uint8_t> readFile(const char *path) {
+  FILE *f = fopen(path, "rb");
+  CHECK(f);
+  fseek(f, 0, SEEK_END);
+  std::vector<uint8_t> data(ftell(f));
+  fseek(f, 0, SEEK_SET);
+  CHECK(fread(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+  return data;
+}
+
+static void writeFile(const char *path, const std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "wb");
+  CHECK(f);
+  CHECK(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+}
+
+// offset of the record of peer i in the file
+static long recordOffset(const std::vector<uint8_t> &data, int i) {
+  bdaddr_t addr = peerAddr(i);
+  for (long offset = kHeaderSize; offset + kRecordSize <= (long)data.size(); offset += kRecordSize) {
+    if (!memcmp(&data[offset], &addr, sizeof(addr))) {
+      return offset;
+    }
+  }
+  return -1;
+}
+
+// a record torn mid-update or with a stale check is dropped, its neighbours are kept
+static void checkTorn(const char *path) {
+  unlink(path);
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    for (int i = 0; i < 4; ++i) {
+      storePeer(&store, i);
+    }
+  }
+  std::vector<uint8_t> before = readFile(path);
+
+  // peer 1 updated again, new ccc values, hash and check
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    bdaddr_t addr = peerAddr(1);
+    CccStore::Peer peer = peerState(1);
+    peer.ccc[0] = 0x0002;
+    memset(peer.hash, 0xaa, sizeof(peer.hash));
+    CHECK(store.store(addr, BDADDR_LE_PUBLIC, peer));
+  }
+  std::vector<uint8_t> after = readFile(path);
+
+  // only the first half of peer 1's update reached the disk
+  std::vector<uint8_t> torn = before;
+  long offset = recordOffset(after, 1);
+  CHECK(offset > 0 && offset == recordOffset(before, 1));
+  memcpy(&torn[offset], &after[offset], kRecordSize / 2);
+  writeFile(path, torn);
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(hasPeer(&store, 0) && hasPeer(&store, 2) && hasPeer(&store, 3));
+    CHECK(!hasPeer(&store, 1));
+  }
+
+  // the contents of the update without its check
+  std::vector<uint8_t> stale = before;
+  memcpy(&stale[offset], &after[offset], kCheckOffset);
+  writeFile(path, stale);
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(!hasPeer(&store, 1));
+    CHECK(hasPeer(&store, 0) && hasPeer(&store, 3));
+  }
+
+  // one flipped ccc bit
+  std::vector<uint8_t> flipped = before;
+  flipped[recordOffset(before, 2) + kCccOffset] ^= 0x01;
+  writeFile(path, flipped);
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(!hasPeer(&store, 2));
+    CHECK(hasPeer(&store, 1) && hasPeer(&store, 3));
+  }
+  printf("torn: torn, stale and flipped records dropped, the rest kept\n");
+}
+
+// with every slot taken the least recently seen peer makes room, in memory and on disk
+static void checkEviction(const char *path) {
+  unlink(path);
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    for (int i = 0; i < CccStore::kMaxPeers; ++i) {
+      storePeer(&store, i);
+    }
+  }
+
+  // seen again after a reopen, so the order survives it
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(hasPeer(&store, 0));
+    storePeer(&store, CccStore::kMaxPeers);
+    CHECK(hasPeer(&store, 0) && hasPeer(&store, CccStore::kMaxPeers));
+    CHECK(!hasPeer(&store, 1));
+    for (int i = 2; i < CccStore::kMaxPeers; ++i) {
+      CHECK(hasPeer(&store, i));
+    }
+  }
+
+  // load() only touched peer 0 in memory, on disk it is the oldest now
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(!hasPeer(&store, 1));
+    storePeer(&store, CccStore::kMaxPeers + 1);
+    CHECK(!hasPeer(&store, 0));
+    CHECK(hasPeer(&store, CccStore::kMaxPeers) && hasPeer(&store, CccStore::kMaxPeers + 1));
+  }
+
+  // a removed peer frees its slot for the next one instead of evicting anybody
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    bdaddr_t addr = peerAddr(5);
+    store.remove(addr, BDADDR_LE_PUBLIC);
+    storePeer(&store, CccStore::kMaxPeers + 2);
+    CHECK(!hasPeer(&store, 5));
+    CHECK(hasPeer(&store, 2) && hasPeer(&store, CccStore::kMaxPeers + 2));
+  }
+  printf("eviction: %d peers, least recently seen evicted first\n", CccStore::kMaxPeers);
+}
+
+// anything but this version's header starts an empty store of the right size
+static void checkHeader(const char *path) {
+  static const struct {
+    const char *name;
+    long offset;
+    uint8_t value;
+  } cases[] = {
+    {"magic", 0, 0x00},
+    {"version", 4, 0x01},
+    {"version", 4, 0x03},
+  };
+
+  for (auto &c : cases) {
+    unlink(path);
+    {
+      CccStore store;
+      CHECK(store.open(path));
+      storePeer(&store, 7);
+    }
+    std::vector<uint8_t> data = readFile(path);
+    data[c.offset] = c.value;
+    writeFile(path, data);
+
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(!hasPeer(&store, 7));
+    storePeer(&store, 8);
+    CHECK(readFile(path).size() == kHeaderSize + CccStore::kMaxPeers * kRecordSize);
+    printf("header: %s 0x%02x at %ld, store started over\n", c.name, c.value, c.offset);
+  }
+
+  // cut inside the header
+  unlink(path);
+  writeFile(path, std::vector<uint8_t>(kHeaderSize - 3, 0));
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    storePeer(&store, 9);
+  }
+  {
+    CccStore store;
+    CHECK(store.open(path));
+    CHECK(hasPeer(&store, 9));
+  }
+  printf("header: cut header, store started over\n");
+}
+
+// private addresses change, nothing is stored under them
+static void checkIdentity(const char *path) {
+  unlink(path);
+  CccStore store;
+  CHECK(store.open(path));
+  bdaddr_t addr = peerAddr(1);
+  addr.b[5] = 0x46;
+  CHECK(!store.store(addr, BDADDR_LE_RANDOM, peerState(1)));
+  addr.b[5] = 0xc6;
+  CHECK(store.store(addr, BDADDR_LE_RANDOM, peerState(1)));
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : "ccc-recovery.bin";
+
+  checkTorn(path);
+  checkEviction(path);
+  checkHeader(path);
+  checkIdentity(path);
+  unlink(path);
+
+  printf("OK\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  bt_crypto throughput per operation
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Runs each bt_crypto primitive the server uses in a loop on whichever
+ * backend the build selected: in-process (BT_CRYPTO_SOFT, AES-NI when the
+ * CPU has it) or AF_ALG. The results are first checked against the spec
+ * sample data, so a broken backend cannot post a good number.
+ *
+ *	crypto-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "bluez/aes.h"
+#include "bluez/crypto.h"
+
+/* Core Vol 3 Part H D.7, little-endian as bt_crypto takes them */
+static const uint8_t irk[16] = {
+	0x9b, 0x7d, 0x39, 0x0a, 0xa6, 0x10, 0x10, 0x34,
+	0x05, 0xad, 0xc8, 0x57, 0xa3, 0x34, 0x02, 0xec
+};
+static const uint8_t prand[3] = { 0x94, 0x81, 0x70 };
+static const uint8_t ah_hash[3] = { 0xaa, 0xfb, 0x0d };
+
+/* RFC 4493 example key and 64 byte message, as in unit/test-crypto.c */
+static const uint8_t sign_key[16] = {
+	0x3c, 0x4f, 0xcf, 0x09, 0x88, 0x15, 0xf7, 0xab,
+	0xa6, 0xd2, 0xae, 0x28, 0x16, 0x15, 0x7e, 0x2b
+};
+static const uint8_t sign_msg[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const uint8_t sign_t64[12] = {
+	0x00, 0x00, 0x00, 0x00, 0x44, 0xe1, 0xe6, 0xce,
+	0x1d, 0xf5, 0x13, 0x68
+};
+
+/* Core Vol 3 Part G 7.3 database hash sample */
+static const uint8_t hash_msg[7][16] = {
+	{ 0x01, 0x00, 0x00, 0x28, 0x00, 0x18, 0x02, 0x00,
+	  0x03, 0x28, 0x0A, 0x03, 0x00, 0x00, 0x2A, 0x04 },
+	{ 0x00, 0x03, 0x28, 0x02, 0x05, 0x00, 0x01, 0x2A,
+	  0x06, 0x00, 0x00, 0x28, 0x01, 0x18, 0x07, 0x00 },
+	{ 0x03, 0x28, 0x20, 0x08, 0x00, 0x05, 0x2A, 0x09,
+	  0x00, 0x02, 0x29, 0x0A, 0x00, 0x03, 0x28, 0x0A },
+	{ 0x0B, 0x00, 0x29, 0x2B, 0x0C, 0x00, 0x03, 0x28,
+	  0x02, 0x0D, 0x00, 0x2A, 0x2B, 0x0E, 0x00, 0x00 },
+	{ 0x28, 0x08, 0x18, 0x0F, 0x00, 0x02, 0x28, 0x14,
+	  0x00, 0x16, 0x00, 0x0F, 0x18, 0x10, 0x00, 0x03 },
+	{ 0x28, 0xA2, 0x11, 0x00, 0x18, 0x2A, 0x12, 0x00,
+	  0x02, 0x29, 0x13, 0x00, 0x00, 0x29, 0x00, 0x00 },
+	{ 0x14, 0x00, 0x01, 0x28, 0x0F, 0x18, 0x15, 0x00,
+	  0x03, 0x28, 0x02, 0x16, 0x00, 0x19, 0x2A }
+};
+static const uint8_t hash_exp[16] = {
+	0xF1, 0xCA, 0x2D, 0x48, 0xEC, 0xF5, 0x8B, 0xAC,
+	0x8A, 0x88, 0x30, 0xBB, 0xB9, 0xFB, 0xA9, 0x90
+};
+
+static struct iovec hash_iov[7];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool check(struct bt_crypto *crypto)
+{
+	uint8_t hash[3], sign[12], db_hash[16];
+
+	if (!bt_crypto_ah(crypto, irk, prand, hash) ||
+					memcmp(hash, ah_hash, sizeof(hash))) {
+		fprintf(stderr, "ah does not match the sample data\n");
+		return false;
+	}
+
+	if (!bt_crypto_sign_att(crypto, sign_key, sign_msg, sizeof(sign_msg),
+							0, sign) ||
+				memcmp(sign, sign_t64, sizeof(sign))) {
+		fprintf(stderr, "sign_att does not match RFC 4493\n");
+		return false;
+	}
+
+	if (!bt_crypto_gatt_hash(crypto, hash_iov, 7, db_hash) ||
+				memcmp(db_hash, hash_exp, sizeof(db_hash))) {
+		fprintf(stderr, "gatt_hash does not match the sample data\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void report(const char *name, int n, double start)
+{
+	printf("%-14s %10.0f ops/s\n", name, n / (now() - start));
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 200000;
+	uint8_t u[32] = {}, v[32] = {}, x[16] = {}, block[16] = {};
+	uint8_t out[16], sign[12], rnd[16];
+	struct bt_crypto *crypto;
+	double start;
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		hash_iov[i].iov_base = (void *) hash_msg[i];
+		hash_iov[i].iov_len = i == 6 ? 15 : 16;
+	}
+
+	crypto = bt_crypto_new();
+	if (!crypto) {
+		fprintf(stderr, "Failed to set up bt_crypto\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!check(crypto)) {
+		bt_crypto_unref(crypto);
+		return EXIT_FAILURE;
+	}
+
+#ifdef BT_CRYPTO_SOFT
+	printf("backend: in-process, %s\n", bt_aes_has_hw() ? "AES-NI" :
+								"portable");
+#else
+	printf("backend: AF_ALG\n");
+#endif
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_e(crypto, irk, block, out);
+	report("e", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_ah(crypto, irk, prand, out);
+	report("ah", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_sign_att(crypto, sign_key, sign_msg,
+						sizeof(sign_msg), 0, sign);
+	report("sign_att(64)", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_f4(crypto, u, v, x, 0, out);
+	report("f4", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_gatt_hash(crypto, hash_iov, 7, out);
+	report("gatt_hash", n, start);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bt_crypto_random_bytes(crypto, rnd, sizeof(rnd));
+	report("random(16)", n, start);
+
+	bt_crypto_unref(crypto);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,338 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Concurrent attribute lookups against a gatt_db that keeps changing
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Reader threads look up random handles, their type and permissions, and
+ * every 16th time the CCCs of the service a handle belongs to, while the
+ * mainloop thread deactivates and reactivates one service every
+ * millisecond. "mutex" serializes both sides on one lock, the only option
+ * with the plain gatt_db API; "snapshot" reads published snapshots, taking
+ * a new one every BATCH lookups as a reactor would per wakeup.
+ *
+ *	gatt-db-bench [max threads] [ms per run]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bluez/queue.h"
+#include "bluez/att.h"
+#include "bluez/gatt-db.h"
+#include "bluez/mainloop.h"
+#include "bluez/timeout.h"
+
+#define SERVICES 48
+#define CHARS 8
+#define SERVICE_HANDLES (1 + CHARS * 3)
+#define BATCH 64
+
+struct bench {
+	struct gatt_db *db;
+	struct gatt_db_attribute *toggled;
+	pthread_mutex_t lock;
+	bool use_snapshot;
+	bool stop;
+	unsigned long toggles;
+};
+
+struct reader {
+	struct bench *bench;
+	pthread_t thread;
+	uint32_t seed;
+	unsigned long ops;
+	unsigned long bad;
+} __attribute__((aligned(64)));
+
+static const bt_uuid_t ccc_uuid = { .type = BT_UUID16,
+				.value.u16 = GATT_CLIENT_CHARAC_CFG_UUID };
+
+static uint32_t next_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+/* What the layout below puts at a handle of an active service */
+static uint16_t expected_type(uint16_t handle)
+{
+	unsigned int offset = (handle - 1) % SERVICE_HANDLES;
+
+	if (!offset)
+		return GATT_PRIM_SVC_UUID;
+
+	switch ((offset - 1) % 3) {
+	case 0:
+		return GATT_CHARAC_UUID;
+	case 1:
+		return 0x2b00 + (offset - 1) / 3;
+	default:
+		return GATT_CLIENT_CHARAC_CFG_UUID;
+	}
+}
+
+static void count_attr(struct gatt_db_attribute *attrib, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static void lookup_locked(struct reader *reader, uint16_t handle, bool ccc)
+{
+	struct bench *bench = reader->bench;
+	struct gatt_db_attribute *attrib;
+	uint16_t start, end;
+	unsigned int count = CHARS;
+	uint32_t perm;
+	bt_uuid_t type;
+
+	pthread_mutex_lock(&bench->lock);
+
+	/* Same answers as a snapshot: inactive services do not exist */
+	attrib = gatt_db_get_attribute(bench->db, handle);
+	if (attrib && !gatt_db_service_get_active(attrib))
+		attrib = NULL;
+
+	if (attrib) {
+		perm = gatt_db_attribute_get_permissions(attrib);
+		type = *gatt_db_attribute_get_type(attrib);
+	}
+
+	if (ccc && attrib && gatt_db_attribute_get_service_handles(attrib,
+								&start, &end)) {
+		count = 0;
+		gatt_db_find_by_type(bench->db, start, end, &ccc_uuid,
+							count_attr, &count);
+	}
+
+	pthread_mutex_unlock(&bench->lock);
+
+	if (!attrib)
+		return;
+
+	if (type.value.u16 != expected_type(handle) || !perm ||
+							count != CHARS)
+		reader->bad++;
+}
+
+static void lookup_snapshot(struct reader *reader,
+					const struct gatt_db_snapshot *snap,
+					uint16_t handle, bool ccc)
+{
+	uint16_t handles[CHARS];
+	uint16_t start, end;
+	uint32_t perm;
+	bt_uuid_t type;
+
+	/* The toggled service is simply missing from some snapshots */
+	if (!gatt_db_snapshot_get_attribute(snap, handle, &type, &perm))
+		return;
+
+	if (type.value.u16 != expected_type(handle) || !perm)
+		reader->bad++;
+
+	if (ccc && gatt_db_snapshot_get_service_handles(snap, handle, &start,
+								&end) &&
+			gatt_db_snapshot_find_by_type(snap, start, end,
+						&ccc_uuid, handles,
+						CHARS) != CHARS)
+		reader->bad++;
+}
+
+static void *reader_run(void *user_data)
+{
+	struct reader *reader = user_data;
+	struct bench *bench = reader->bench;
+	uint16_t last = SERVICES * SERVICE_HANDLES;
+
+	while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+		struct gatt_db_snapshot *snap = NULL;
+		int i;
+
+		if (bench->use_snapshot)
+			snap = gatt_db_snapshot_get(bench->db);
+
+		for (i = 0; i < BATCH; i++) {
+			uint32_t r = next_rand(&reader->seed);
+			uint16_t handle = 1 + r % last;
+			bool ccc = !(r & 0xf0000);
+
+			if (snap)
+				lookup_snapshot(reader, snap, handle, ccc);
+			else
+				lookup_locked(reader, handle, ccc);
+		}
+
+		gatt_db_snapshot_unref(snap);
+		reader->ops += BATCH;
+	}
+
+	return NULL;
+}
+
+static bool toggle_service(void *user_data)
+{
+	struct bench *bench = user_data;
+	bool active = gatt_db_service_get_active(bench->toggled);
+
+	if (!bench->use_snapshot)
+		pthread_mutex_lock(&bench->lock);
+
+	gatt_db_service_set_active(bench->toggled, !active);
+	/* Hash now, its deferred update would walk the db outside the lock */
+	gatt_db_get_hash(bench->db);
+
+	if (!bench->use_snapshot)
+		pthread_mutex_unlock(&bench->lock);
+
+	bench->toggles++;
+	return true;
+}
+
+static bool stop_run(void *user_data)
+{
+	mainloop_loop_quit(mainloop_get_default());
+	return false;
+}
+
+static void service_changed(struct gatt_db_attribute *attrib, void *user_data)
+{
+}
+
+static struct gatt_db *build_db(struct gatt_db_attribute **toggled)
+{
+	struct gatt_db *db = gatt_db_new();
+	bt_uuid_t uuid;
+	int i, j;
+
+	for (i = 0; i < SERVICES; i++) {
+		struct gatt_db_attribute *svc;
+
+		bt_uuid16_create(&uuid, 0x1000 + i);
+		svc = gatt_db_add_service(db, &uuid, true, SERVICE_HANDLES);
+
+		for (j = 0; j < CHARS; j++) {
+			bt_uuid16_create(&uuid, 0x2b00 + j);
+			gatt_db_service_add_characteristic(svc, &uuid,
+					BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_NOTIFY,
+					NULL, NULL, NULL);
+			gatt_db_service_add_descriptor(svc, &ccc_uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					NULL, NULL, NULL);
+		}
+
+		gatt_db_service_set_active(svc, true);
+
+		if (i == SERVICES / 2)
+			*toggled = svc;
+	}
+
+	/* Something listens, as gatt-server would */
+	gatt_db_register(db, service_changed, service_changed, NULL, NULL);
+
+	return db;
+}
+
+static double run(bool use_snapshot, int threads, unsigned int ms)
+{
+	struct bench bench;
+	struct reader *readers;
+	struct timespec start, end;
+	unsigned long ops = 0, bad = 0;
+	double secs;
+	unsigned int toggle_id;
+	int i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.db = build_db(&bench.toggled);
+	bench.use_snapshot = use_snapshot;
+	pthread_mutex_init(&bench.lock, NULL);
+
+	if (use_snapshot && !gatt_db_enable_snapshots(bench.db)) {
+		fprintf(stderr, "Failed to enable snapshots\n");
+		exit(EXIT_FAILURE);
+	}
+
+	readers = aligned_alloc(__alignof__(struct reader),
+					threads * sizeof(*readers));
+	memset(readers, 0, threads * sizeof(*readers));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < threads; i++) {
+		readers[i].bench = &bench;
+		readers[i].seed = 0x9e3779b9 * (i + 1);
+		pthread_create(&readers[i].thread, NULL, reader_run,
+								&readers[i]);
+	}
+
+	toggle_id = timeout_add(1, toggle_service, &bench, NULL);
+	timeout_add(ms, stop_run, NULL, NULL);
+	mainloop_loop_run(mainloop_get_default());
+	timeout_remove(toggle_id);
+
+	__atomic_store_n(&bench.stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		ops += readers[i].ops;
+		bad += readers[i].bad;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%-8s %2d threads %8.2f Mlookups/s %6lu changes %lu bad\n",
+			use_snapshot ? "snapshot" : "mutex", threads,
+			ops / secs / 1e6, bench.toggles, bad);
+
+	gatt_db_unref(bench.db);
+	pthread_mutex_destroy(&bench.lock);
+	free(readers);
+
+	return ops / secs;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	unsigned int ms = argc > 2 ? atoi(argv[2]) : 1000;
+	int threads;
+
+	mainloop_init();
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double locked = run(false, threads, ms);
+		double snapshot = run(true, threads, ms);
+
+		printf("%-8s %2d threads %8.2fx\n", "speedup", threads,
+							snapshot / locked);
+	}
+
+	return EXIT_SUCCESS;
+}
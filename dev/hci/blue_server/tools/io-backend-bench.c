@@ -0,0 +1,305 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Syscalls and CPU per notification on the epoll and io_uring backends
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A bt_att streams 200 byte notifications to a peer on the other end of
+ * a socketpair, in bursts of 1 and of 4 that are only queued once the
+ * peer has read the previous one, and saturated, with every notification
+ * read replaced by a new one. The peer reads with recv(), which is not
+ * counted; the binary is linked with --wrap for the loop's and bt_att's
+ * syscalls to count what the server side costs per notification, and
+ * getrusage() gives the CPU time of both sides.
+ *
+ * It is built twice, as io-backend-bench-epoll and io-backend-bench-uring,
+ * the latter with HAVE_IO_URING. The uring one fails if mainloop_new()
+ * fell back to epoll. The window never fills the socket, so bt_att's
+ * writes must all go out without arming EPOLLOUT: any epoll_ctl() while
+ * streaming fails the run.
+ *
+ *	io-backend-bench-{epoll,uring} [notifications]
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "bluez/att.h"
+#include "bluez/mainloop.h"
+#include "bluez/util.h"
+
+#define VALUE_LEN	200
+#define WINDOW		32
+
+#ifdef HAVE_IO_URING
+#define BACKEND		"uring"
+#else
+#define BACKEND		"epoll"
+#endif
+
+enum {
+	COUNT_EPOLL_WAIT,
+	COUNT_EPOLL_CTL,
+	COUNT_URING_ENTER,
+	COUNT_SENDMMSG,
+	COUNT_RECVMMSG,
+	COUNT_OTHER,			/* read(), writev() */
+	COUNT_MAX
+};
+
+static unsigned long counts[COUNT_MAX];
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+long __real_syscall(long number, ...);
+int __real_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+								int flags);
+int __real_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+					int flags, struct timespec *timeout);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout)
+{
+	counts[COUNT_EPOLL_WAIT]++;
+	return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	counts[COUNT_EPOLL_CTL]++;
+	return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+long __wrap_syscall(long number, ...)
+{
+	long args[6];
+	va_list ap;
+	int i;
+
+	/* uring.c passes at most six arguments */
+	va_start(ap, number);
+	for (i = 0; i < 6; i++)
+		args[i] = va_arg(ap, long);
+	va_end(ap);
+
+	if (number == __NR_io_uring_enter)
+		counts[COUNT_URING_ENTER]++;
+
+	return __real_syscall(number, args[0], args[1], args[2], args[3],
+							args[4], args[5]);
+}
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+								int flags)
+{
+	counts[COUNT_SENDMMSG]++;
+	return __real_sendmmsg(fd, msgvec, vlen, flags);
+}
+
+int __wrap_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+					int flags, struct timespec *timeout)
+{
+	counts[COUNT_RECVMMSG]++;
+	return __real_recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	counts[COUNT_OTHER]++;
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	counts[COUNT_OTHER]++;
+	return __real_writev(fd, iov, iovcnt);
+}
+
+struct bench {
+	struct bt_att *att;
+	int burst;			/* 0 keeps a window queued */
+	int total;
+	int sent;
+	int received;
+	bool failed;
+};
+
+static uint8_t value[VALUE_LEN];
+
+static void send_one(struct bench *bench)
+{
+	uint8_t handle[2];
+	struct iovec iov[2];
+
+	put_le16(0x0010, handle);
+	iov[0].iov_base = handle;
+	iov[0].iov_len = sizeof(handle);
+	iov[1].iov_base = value;
+	iov[1].iov_len = sizeof(value);
+
+	if (!bt_att_sendv_ref(bench->att, BT_ATT_OP_HANDLE_NFY, iov, 2, NULL,
+									NULL))
+		bench->failed = true;
+
+	bench->sent++;
+}
+
+static void send_burst(struct bench *bench)
+{
+	int i, n = bench->burst ? bench->burst : WINDOW;
+
+	for (i = 0; i < n && bench->sent < bench->total; i++)
+		send_one(bench);
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint8_t pdu[VALUE_LEN + 8];
+	ssize_t len;
+
+	while ((len = recv(fd, pdu, sizeof(pdu), MSG_DONTWAIT)) > 0) {
+		if (len != 3 + VALUE_LEN || pdu[0] != BT_ATT_OP_HANDLE_NFY ||
+					memcmp(pdu + 3, value, VALUE_LEN)) {
+			fprintf(stderr, "Unexpected PDU\n");
+			bench->failed = true;
+		}
+
+		if (bench->failed || ++bench->received == bench->total) {
+			mainloop_loop_quit(mainloop_get_default());
+			return;
+		}
+
+		if (!bench->burst && bench->sent < bench->total)
+			send_one(bench);
+		else if (bench->burst && bench->received == bench->sent)
+			send_burst(bench);
+	}
+}
+
+static double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool run(int burst, int total)
+{
+	unsigned long start[COUNT_MAX], n[COUNT_MAX], loop_calls;
+	struct bench bench;
+	double cpu;
+	char name[16];
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.burst = burst;
+	bench.total = total;
+
+	bench.att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(bench.att, true);
+	bt_att_set_mtu(bench.att, VALUE_LEN + 3);
+	mainloop_add_fd(sv[1], EPOLLIN, peer_read, &bench, NULL);
+
+	memcpy(start, counts, sizeof(start));
+	cpu = cpu_secs();
+
+	send_burst(&bench);
+	mainloop_loop_run(mainloop_get_default());
+
+	cpu = cpu_secs() - cpu;
+	for (i = 0; i < COUNT_MAX; i++)
+		n[i] = counts[i] - start[i];
+
+	mainloop_remove_fd(sv[1]);
+	bt_att_unref(bench.att);
+	close(sv[1]);
+
+	if (bench.failed)
+		return false;
+
+	loop_calls = n[COUNT_EPOLL_WAIT] + n[COUNT_EPOLL_CTL] +
+						n[COUNT_URING_ENTER];
+
+	if (burst)
+		snprintf(name, sizeof(name), "bursts of %d", burst);
+	else
+		snprintf(name, sizeof(name), "saturated");
+
+	printf("%s %-12s %6.0f syscalls/1000 (loop %5.0f: epoll_wait %5.0f "
+		"epoll_ctl %5.0f io_uring_enter %5.0f; sendmmsg %5.0f "
+		"recvmmsg %3.0f other %3.0f) %5.2f us CPU/notification\n",
+		BACKEND, name,
+		(loop_calls + n[COUNT_SENDMMSG] + n[COUNT_RECVMMSG] +
+				n[COUNT_OTHER]) * 1000.0 / total,
+		loop_calls * 1000.0 / total,
+		n[COUNT_EPOLL_WAIT] * 1000.0 / total,
+		n[COUNT_EPOLL_CTL] * 1000.0 / total,
+		n[COUNT_URING_ENTER] * 1000.0 / total,
+		n[COUNT_SENDMMSG] * 1000.0 / total,
+		n[COUNT_RECVMMSG] * 1000.0 / total,
+		n[COUNT_OTHER] * 1000.0 / total,
+		cpu * 1e6 / total);
+
+	if (n[COUNT_EPOLL_CTL]) {
+		fprintf(stderr, "Writes to a writable socket armed EPOLLOUT\n");
+		return false;
+	}
+
+#ifdef HAVE_IO_URING
+	if (!n[COUNT_URING_ENTER] || n[COUNT_EPOLL_WAIT]) {
+		fprintf(stderr, "The mainloop fell back to epoll\n");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int total = argc > 1 ? atoi(argv[1]) : 200000;
+	int i;
+
+	for (i = 0; i < VALUE_LEN; i++)
+		value[i] = i * 7;
+
+	mainloop_init();
+
+	if (!run(1, total) || !run(4, total) || !run(0, total))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
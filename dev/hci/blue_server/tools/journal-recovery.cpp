@@ -0,0 +1,166 @@
+// Checks that OutboundJournal survives its process being killed mid-append.
+//
+// A child appends to the journal until it is SIGKILLed, then the log is
+// reopened and every record left must be intact, numbered contiguously per
+// stream, and numbering must carry on where it stopped. Ring wrap, acks and
+// a torn last record are checked as well.
+//
+//   journal-recovery [journal file]
+
+#include "outbound_journal.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <map>
+#include <vector>
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(EXIT_FAILURE);                                               \
+    }                                                                   \
+  } while (0)
+
+static const int kStreams = 4;
+static const int kRounds = 20;
+
+// records come back oldest first with growing seqs per stream, however the ring wrapped
+static void checkWrap(const char *path) {
+  unlink(path);
+  OutboundJournal journal;
+  CHECK(journal.open(path, 4096));
+
+  uint8_t buf[300];
+  for (int i = 0; i < 300; ++i) {
+    buf[i] = i;
+  }
+  for (int i = 0; i < 200; ++i) {
+    journal.append(i % 3, buf, 1 + (i * 7) % 100);
+  }
+
+  uint64_t cursor = 0;
+  OutboundJournal::Record record;
+  std::map<uint16_t, uint32_t> last;
+  size_t count = 0;
+  while (journal.read(&cursor, &record)) {
+    CHECK(!last.count(record.stream) || record.seq > last[record.stream]);
+    last[record.stream] = record.seq;
+    ++count;
+  }
+  printf("wrap: %zu of 200 records kept\n", count);
+  CHECK(count == journal.pending() && count > 10 && count < 200);
+
+  // a payload over kMaxPayload becomes two records
+  CHECK(journal.append(5, buf, sizeof(buf)) == 2);
+  for (uint16_t stream = 0; stream < 3; ++stream) {
+    journal.ack(stream, 1000);
+  }
+  CHECK(journal.pending() == 2);
+  journal.ack(5, 2);
+  CHECK(journal.pending() == 0);
+  journal.close();
+}
+
+// SIGKILL a writer at a different point every round and reopen after it
+static void checkKilled(const char *path) {
+  unlink(path);
+  uint32_t next[kStreams] = {1, 1, 1, 1};
+  for (int round = 0; round < kRounds; ++round) {
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+      OutboundJournal journal;
+      if (!journal.open(path, 64 * 1024)) {
+        _exit(EXIT_FAILURE);
+      }
+      uint8_t buf[OutboundJournal::kMaxPayload];
+      for (uint32_t i = 0;; ++i) {
+        memset(buf, i & 0xff, sizeof(buf));
+        journal.append(i % kStreams, buf, 16 + i % 200);
+      }
+    }
+    usleep(20000 + round * 3000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    // the capacity is that of the existing log, whatever is passed
+    OutboundJournal journal;
+    CHECK(journal.open(path, 1234));
+    uint64_t cursor = 0;
+    OutboundJournal::Record record;
+    std::map<uint16_t, uint32_t> last;
+    size_t count = 0;
+    while (journal.read(&cursor, &record)) {
+      CHECK(record.stream < kStreams);
+      CHECK(!last.count(record.stream) || record.seq == last[record.stream] + 1);
+      last[record.stream] = record.seq;
+      for (uint8_t b : record.data) {
+        CHECK(b == record.data[0]);
+      }
+      ++count;
+    }
+    CHECK(count == journal.pending());
+
+    for (uint16_t stream = 0; stream < kStreams; ++stream) {
+      uint32_t seq = journal.append(stream, (const uint8_t *)"x", 1);
+      CHECK(!last.count(stream) || seq == last[stream] + 1);
+      CHECK(seq >= next[stream]);
+      next[stream] = seq + 1;
+    }
+    if (round % 5 == 4) {
+      for (uint16_t stream = 0; stream < kStreams; ++stream) {
+        journal.ack(stream, next[stream] - 1);
+      }
+      CHECK(journal.pending() == 0);
+    }
+    printf("round %d: %zu intact records\n", round, count);
+  }
+}
+
+// a record whose payload no longer matches its checksum is cut off at open
+static void checkTorn(const char *path) {
+  OutboundJournal journal;
+  CHECK(journal.open(path, 0));
+  journal.append(0, (const uint8_t *)"good", 4);
+  journal.append(0, (const uint8_t *)"torn", 4);
+  size_t before = journal.pending();
+  journal.close();
+
+  FILE *f = fopen(path, "r+b");
+  CHECK(f);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  std::vector<char> data(size);
+  fseek(f, 0, SEEK_SET);
+  CHECK(fread(data.data(), 1, size, f) == (size_t)size);
+  for (long i = size - 4; i >= 0; --i) {
+    if (!memcmp(&data[i], "torn", 4)) {
+      fseek(f, i, SEEK_SET);
+      fputc('T', f);
+      break;
+    }
+  }
+  fclose(f);
+
+  CHECK(journal.open(path, 0));
+  printf("torn: %zu -> %zu records\n", before, journal.pending());
+  CHECK(journal.pending() == before - 1);
+  journal.close();
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : "journal-recovery.bin";
+
+  checkWrap(path);
+  checkKilled(path);
+  checkTorn(path);
+  unlink(path);
+
+  printf("OK\n");
+  return EXIT_SUCCESS;
+}
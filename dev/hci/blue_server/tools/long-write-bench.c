@@ -0,0 +1,236 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Long write throughput and allocations by MTU
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A peer on the other end of a socketpair writes a 512 byte value with
+ * Prepare Write chunks of MTU - 5 bytes and an Execute Write, as a client
+ * doing a long write would, over and over. The server side is a plain
+ * bt_gatt_server; its write callback checks every value it gets. The
+ * binary is linked with --wrap for malloc, calloc and realloc so the
+ * allocations and realloc'd bytes each write costs can be counted.
+ *
+ *	long-write-bench [writes per MTU]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "bluez/bluetooth.h"
+#include "bluez/uuid.h"
+#include "bluez/att.h"
+#include "bluez/queue.h"
+#include "bluez/gatt-db.h"
+#include "bluez/gatt-server.h"
+#include "bluez/mainloop.h"
+#include "bluez/util.h"
+
+#define VALUE_LEN 512
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long allocs, realloc_bytes;
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	realloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+struct bench {
+	int peer;
+	uint16_t handle;
+	int chunk;
+	int offset;
+	int writes;
+	int total;
+	bool failed;
+};
+
+static uint8_t value[VALUE_LEN];
+
+static void send_next(struct bench *bench)
+{
+	uint8_t pdu[5 + VALUE_LEN];
+	int len;
+
+	if (bench->offset == VALUE_LEN) {
+		pdu[0] = BT_ATT_OP_EXEC_WRITE_REQ;
+		pdu[1] = 0x01;
+		bench->offset = 0;
+		bench->writes++;
+		if (write(bench->peer, pdu, 2) < 0)
+			bench->failed = true;
+		return;
+	}
+
+	len = VALUE_LEN - bench->offset;
+	if (len > bench->chunk)
+		len = bench->chunk;
+
+	pdu[0] = BT_ATT_OP_PREP_WRITE_REQ;
+	put_le16(bench->handle, pdu + 1);
+	put_le16(bench->offset, pdu + 3);
+	memcpy(pdu + 5, value + bench->offset, len);
+	bench->offset += len;
+
+	if (write(bench->peer, pdu, 5 + len) < 0)
+		bench->failed = true;
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint8_t pdu[5 + VALUE_LEN];
+	ssize_t len;
+
+	while ((len = read(fd, pdu, sizeof(pdu))) > 0) {
+		if (pdu[0] == BT_ATT_OP_ERROR_RSP) {
+			fprintf(stderr, "Error response 0x%02x\n", pdu[4]);
+			bench->failed = true;
+		}
+
+		if (bench->failed || (pdu[0] == BT_ATT_OP_EXEC_WRITE_RSP &&
+					bench->writes == bench->total)) {
+			mainloop_loop_quit(mainloop_get_default());
+			return;
+		}
+
+		send_next(bench);
+	}
+}
+
+static void value_write(struct gatt_db_attribute *attrib, unsigned int id,
+				uint16_t offset, const uint8_t *data,
+				size_t len, uint8_t opcode, struct bt_att *att,
+				void *user_data)
+{
+	struct bench *bench = user_data;
+
+	/* Each Prepare Write comes by first with no data, to authorize it */
+	if (opcode == BT_ATT_OP_EXEC_WRITE_REQ &&
+			(len != VALUE_LEN || memcmp(data, value, len))) {
+		fprintf(stderr, "Value written does not match\n");
+		bench->failed = true;
+	}
+
+	gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static bool run(uint16_t mtu, int writes)
+{
+	struct bench bench;
+	struct gatt_db *db;
+	struct gatt_db_attribute *svc, *chr;
+	struct bt_att *att;
+	struct bt_gatt_server *server;
+	struct timespec start, end;
+	unsigned long allocs_start, realloc_start;
+	bt_uuid_t uuid;
+	double secs;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.peer = sv[1];
+	bench.chunk = mtu - 5;
+	bench.total = writes;
+
+	db = gatt_db_new();
+	bt_uuid16_create(&uuid, 0x1800);
+	svc = gatt_db_add_service(db, &uuid, true, 4);
+	bt_uuid16_create(&uuid, GATT_CHARAC_DEVICE_NAME);
+	chr = gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_WRITE,
+						BT_GATT_CHRC_PROP_WRITE,
+						NULL, value_write, &bench);
+	gatt_db_service_set_active(svc, true);
+	bench.handle = gatt_db_attribute_get_handle(chr);
+
+	att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(att, true);
+	bt_att_set_mtu(att, mtu);
+	server = bt_gatt_server_new(db, att, mtu, 0);
+	mainloop_add_fd(bench.peer, EPOLLIN, peer_read, &bench, NULL);
+
+	allocs_start = allocs;
+	realloc_start = realloc_bytes;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	send_next(&bench);
+	mainloop_loop_run(mainloop_get_default());
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (!bench.failed)
+		printf("MTU %3u %6d writes %8.0f KB/s %6.1f us/write "
+			"%5.1f allocs/write %6.0f realloc bytes/write\n",
+			mtu, bench.writes, bench.writes * VALUE_LEN / secs / 1024,
+			secs * 1e6 / bench.writes,
+			(double) (allocs - allocs_start) / bench.writes,
+			(double) (realloc_bytes - realloc_start) / bench.writes);
+
+	mainloop_remove_fd(bench.peer);
+	bt_gatt_server_unref(server);
+	bt_att_unref(att);
+	gatt_db_unref(db);
+	close(bench.peer);
+
+	return !bench.failed;
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint16_t mtus[] = { 23, 64, 185, 247, 517 };
+	int writes = argc > 1 ? atoi(argv[1]) : 2000;
+	unsigned int i;
+
+	for (i = 0; i < VALUE_LEN; i++)
+		value[i] = i * 7;
+
+	mainloop_init();
+
+	for (i = 0; i < sizeof(mtus) / sizeof(mtus[0]); i++) {
+		if (!run(mtus[i], writes))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Mainloop dispatch with hundreds of registered fds
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Registers the read ends of a few hundred pipes, which puts fds well
+ * past the old 128 entry table, and makes all of them readable at once,
+ * round after round. Every seventh callback removes the next pipe and
+ * closes it, which is often readable later in the same batch, and
+ * registers a new pipe in its place that usually gets the same fd
+ * numbers. A removed pipe's callback must never run and the new one
+ * must not see the old one's event; every other pipe must be dispatched
+ * exactly once per round. This runs with the smallest and the largest
+ * event batch. The binary is linked with --wrap for epoll_wait to count
+ * the waits each round takes.
+ *
+ *	mainloop-load-check [pipes] [rounds]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "bluez/mainloop.h"
+#include "bluez/queue.h"
+#include "bluez/util.h"
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout);
+
+static unsigned long waits;
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+								int timeout)
+{
+	waits++;
+	return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+struct pipe_end {
+	int fds[2];
+	unsigned int index;
+	bool armed;			/* A byte was written and not read */
+	bool removed;
+};
+
+static struct pipe_end **pipes;
+static unsigned int pipes_len;
+static struct queue *retired;
+static unsigned int expected, seen, removed;
+static int max_fd;
+static bool failed;
+
+static void pipe_read(int fd, uint32_t events, void *user_data);
+
+static struct pipe_end *pipe_new(unsigned int index)
+{
+	struct pipe_end *p = new0(struct pipe_end, 1);
+
+	p->index = index;
+
+	if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0 ||
+			mainloop_add_fd(p->fds[0], EPOLLIN, pipe_read, p,
+								NULL) < 0) {
+		fprintf(stderr, "Failed to add pipe %u\n", index);
+		failed = true;
+	}
+
+	if (p->fds[0] > max_fd)
+		max_fd = p->fds[0];
+
+	return p;
+}
+
+static void pipe_remove(struct pipe_end *p)
+{
+	mainloop_remove_fd(p->fds[0]);
+	close(p->fds[0]);
+	close(p->fds[1]);
+
+	p->removed = true;
+	removed++;
+
+	/* Its event will not be dispatched any more */
+	if (p->armed)
+		expected--;
+
+	/* Kept so that a stale dispatch still finds it marked removed */
+	queue_push_tail(retired, p);
+}
+
+static void pipe_read(int fd, uint32_t events, void *user_data)
+{
+	struct pipe_end *p = user_data;
+	struct pipe_end *next;
+	char c;
+
+	if (p->removed) {
+		fprintf(stderr, "Callback ran for removed pipe %u\n", p->index);
+		failed = true;
+		mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	if (!p->armed || read(fd, &c, 1) != 1) {
+		fprintf(stderr, "Pipe %u dispatched without data\n", p->index);
+		failed = true;
+		mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	p->armed = false;
+	seen++;
+
+	if (p->index % 7 == 0) {
+		next = pipes[(p->index + 1) % pipes_len];
+		pipe_remove(next);
+		pipes[next->index] = pipe_new(next->index);
+	}
+
+	if (seen == expected)
+		mainloop_loop_quit(mainloop_get_default());
+}
+
+static bool run(unsigned int max_events, unsigned int rounds)
+{
+	unsigned int i, r;
+	unsigned long start;
+
+	if (mainloop_set_max_events(max_events) < 0)
+		return false;
+
+	expected = seen = removed = 0;
+	start = waits;
+
+	for (r = 0; r < rounds && !failed; r++) {
+		for (i = 0; i < pipes_len; i++) {
+			if (write(pipes[i]->fds[1], "x", 1) != 1)
+				return false;
+
+			pipes[i]->armed = true;
+			expected++;
+		}
+
+		mainloop_loop_run(mainloop_get_default());
+
+		if (seen != expected) {
+			fprintf(stderr, "Round %u: %u of %u pipes dispatched\n",
+							r, seen, expected);
+			failed = true;
+		}
+	}
+
+	printf("%u pipes up to fd %d, %4u events per wait: %u dispatched, "
+			"%u removed, %.1f waits per round\n", pipes_len,
+			max_fd, max_events, seen, removed,
+			(double) (waits - start) / (r ? r : 1));
+
+	return !failed;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rounds;
+	struct rlimit rl;
+	unsigned int i;
+	bool ok;
+
+	pipes_len = argc > 1 ? atoi(argv[1]) : 400;
+	rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+	/* Two fds per pipe */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	mainloop_init();
+
+	retired = queue_new();
+	pipes = new0(struct pipe_end *, pipes_len);
+	for (i = 0; i < pipes_len; i++)
+		pipes[i] = pipe_new(i);
+
+	ok = !failed && run(1, rounds) && run(1024, rounds);
+
+	for (i = 0; i < pipes_len; i++)
+		pipe_remove(pipes[i]);
+
+	queue_destroy(retired, free);
+	free(pipes);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
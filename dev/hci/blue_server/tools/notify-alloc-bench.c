@@ -0,0 +1,209 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Allocations per notification while streaming
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A bt_att streams notifications to a peer on the other end of a
+ * socketpair, keeping a window of them queued: every notification the
+ * peer reads is replaced by a new one. Values are sent copied, with
+ * bt_att_send(), and by reference, with bt_att_sendv_ref() as BleServer
+ * does. Once the op and PDU pools have warmed up the stream must not
+ * allocate at all; the binary is linked with --wrap for malloc, calloc
+ * and realloc to count it, and fails on any steady state allocation.
+ *
+ *	notify-alloc-bench [notifications]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "bluez/att.h"
+#include "bluez/mainloop.h"
+#include "bluez/util.h"
+
+#define WINDOW		32
+#define WARMUP		1000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+struct bench {
+	struct bt_att *att;
+	bool ref;
+	uint16_t len;
+	int total;
+	int sent;
+	int received;
+	unsigned long allocs_start;
+	struct timespec start;
+	bool failed;
+};
+
+static uint8_t value[517 - 3];		/* Fills the largest MTU */
+
+static void send_one(struct bench *bench)
+{
+	uint8_t handle[2];
+	struct iovec iov[2];
+	unsigned int id;
+
+	put_le16(0x0010, handle);
+	iov[0].iov_base = handle;
+	iov[0].iov_len = sizeof(handle);
+	iov[1].iov_base = value;
+	iov[1].iov_len = bench->len;
+
+	if (bench->ref)
+		id = bt_att_sendv_ref(bench->att, BT_ATT_OP_HANDLE_NFY, iov, 2,
+								NULL, NULL);
+	else
+		id = bt_att_sendv(bench->att, BT_ATT_OP_HANDLE_NFY, iov, 2,
+							NULL, NULL, NULL);
+
+	if (!id)
+		bench->failed = true;
+
+	bench->sent++;
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint8_t pdu[600];
+	ssize_t len;
+
+	while ((len = read(fd, pdu, sizeof(pdu))) > 0) {
+		if (pdu[0] != BT_ATT_OP_HANDLE_NFY ||
+					len != 3 + bench->len ||
+					memcmp(pdu + 3, value, bench->len)) {
+			fprintf(stderr, "Unexpected PDU\n");
+			bench->failed = true;
+		}
+
+		if (++bench->received == WARMUP) {
+			bench->allocs_start = allocs;
+			clock_gettime(CLOCK_MONOTONIC, &bench->start);
+		}
+
+		if (bench->failed || bench->received == bench->total) {
+			mainloop_loop_quit(mainloop_get_default());
+			return;
+		}
+
+		if (bench->sent < bench->total)
+			send_one(bench);
+	}
+}
+
+static bool run(uint16_t mtu, uint16_t len, bool ref, int total)
+{
+	struct bench bench;
+	struct timespec end;
+	unsigned long steady;
+	double secs;
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.ref = ref;
+	bench.len = len;
+	bench.total = WARMUP + total;
+
+	bench.att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(bench.att, true);
+	bt_att_set_mtu(bench.att, mtu);
+	mainloop_add_fd(sv[1], EPOLLIN, peer_read, &bench, NULL);
+
+	for (i = 0; i < WINDOW; i++)
+		send_one(&bench);
+
+	mainloop_loop_run(mainloop_get_default());
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - bench.start.tv_sec) +
+			(end.tv_nsec - bench.start.tv_nsec) / 1e9;
+	steady = allocs - bench.allocs_start;
+
+	if (!bench.failed)
+		printf("MTU %3u %3u bytes %-6s %8.0f notifications/s "
+			"%lu allocs in %d notifications\n", mtu, len,
+			ref ? "ref" : "copied", total / secs, steady, total);
+
+	mainloop_remove_fd(sv[1]);
+	bt_att_unref(bench.att);
+	close(sv[1]);
+
+	if (bench.failed)
+		return false;
+
+	if (steady) {
+		fprintf(stderr, "Streaming allocated in steady state\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint16_t mtus[] = { 23, 247, 517 };
+	int total = argc > 1 ? atoi(argv[1]) : 100000;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(value); i++)
+		value[i] = i * 7;
+
+	mainloop_init();
+
+	for (i = 0; i < sizeof(mtus) / sizeof(mtus[0]); i++) {
+		if (!run(mtus[i], mtus[i] - 3, false, total) ||
+				!run(mtus[i], mtus[i] - 3, true, total))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  PDUs per telemetry update cycle, with and without multiple notifications
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Every cycle updates the four telemetry characteristics of BleServer
+ * (pose, battery, blade and errors: 24, 1, 8 and 4 bytes) the way
+ * sendTelemetry() does, and the next cycle starts once the peer on the
+ * other end of the socketpair has seen all four values. "single" sends
+ * plain notifications, "multiple" lets gatt-server pack them into Handle
+ * Value Multiple Notifications. With a window of 0 each cycle is flushed
+ * right away, as BleServer does by default.
+ *
+ *	notify-bench [window ms] [cycles]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluez/att.h"
+#include "bluez/queue.h"
+#include "bluez/gatt-db.h"
+#include "bluez/gatt-server.h"
+#include "bluez/mainloop.h"
+#include "bluez/util.h"
+
+#define CHARS 4
+
+static const uint16_t sizes[CHARS] = { 24, 1, 8, 4 };
+
+struct bench {
+	struct bt_gatt_server *server;
+	bool multiple;
+	unsigned int window;
+	int cycles;
+	int cycle;
+	int pdus;
+	int values;
+};
+
+static void update(struct bench *bench)
+{
+	static const uint8_t value[24];
+	int i;
+
+	for (i = 0; i < CHARS; i++)
+		bt_gatt_server_send_notification(bench->server, 0x0010 + i * 3,
+							value, sizes[i],
+							bench->multiple);
+
+	if (!bench->window)
+		bt_gatt_server_flush_notifications(bench->server);
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct bench *bench = user_data;
+	uint8_t pdu[600];
+	ssize_t len;
+
+	while ((len = read(fd, pdu, sizeof(pdu))) > 0) {
+		ssize_t offset = 1;
+
+		bench->pdus++;
+
+		if (pdu[0] == BT_ATT_OP_HANDLE_NFY) {
+			bench->values++;
+			continue;
+		}
+
+		/* handle and length ahead of every value */
+		while (pdu[0] == BT_ATT_OP_HANDLE_NFY_MULT && offset + 4 <= len) {
+			offset += 4 + get_le16(pdu + offset + 2);
+			bench->values++;
+		}
+	}
+
+	if (bench->values < (bench->cycle + 1) * CHARS)
+		return;
+
+	if (++bench->cycle == bench->cycles) {
+		mainloop_loop_quit(mainloop_get_default());
+		return;
+	}
+
+	update(bench);
+}
+
+static bool run(uint16_t mtu, bool multiple, unsigned int window, int cycles)
+{
+	struct bench bench;
+	struct gatt_db *db;
+	struct bt_att *att;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.multiple = multiple;
+	bench.window = window;
+	bench.cycles = cycles;
+
+	db = gatt_db_new();
+	att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(att, true);
+	bt_att_set_mtu(att, mtu);
+	bench.server = bt_gatt_server_new(db, att, mtu, 0);
+	if (window)
+		bt_gatt_server_set_nfy_mult_window(bench.server, window);
+	mainloop_add_fd(sv[1], EPOLLIN, peer_read, &bench, NULL);
+
+	update(&bench);
+	mainloop_loop_run(mainloop_get_default());
+
+	printf("MTU %3u %-8s %.2f PDUs per update cycle (%d values)\n", mtu,
+			multiple ? "multiple" : "single",
+			(double) bench.pdus / cycles, bench.values);
+
+	mainloop_remove_fd(sv[1]);
+	bt_gatt_server_unref(bench.server);
+	bt_att_unref(att);
+	gatt_db_unref(db);
+	close(sv[1]);
+
+	return bench.values == cycles * CHARS;
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint16_t mtus[] = { 23, 247 };
+	unsigned int window = argc > 1 ? atoi(argv[1]) : 0;
+	int cycles = argc > 2 ? atoi(argv[2]) : 2000;
+	unsigned int i;
+
+	mainloop_init();
+
+	for (i = 0; i < sizeof(mtus) / sizeof(mtus[0]); i++) {
+		if (!run(mtus[i], false, window, cycles) ||
+					!run(mtus[i], true, window, cycles))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
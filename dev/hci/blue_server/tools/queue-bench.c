@@ -0,0 +1,176 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Queue churn as bt_att drives its send queues
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Replays the queue traffic of bt_att send ops without any I/O:
+ *
+ *  burst   8 notifications onto the write queue and a request onto the
+ *          request queue, then both drained, as one write wakeup does,
+ *  cancel  16 ops queued, every other one removed by pointer as
+ *          bt_att_cancel() does, the rest drained,
+ *  window  32 ops kept queued, one popped and one pushed at a time, as
+ *          streaming does.
+ *
+ * The binary is linked with --wrap for malloc, calloc and realloc; after
+ * a warm-up round the queues must not allocate at all.
+ *
+ *	queue-bench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bluez/queue.h"
+
+#define WARMUP		1000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static int ops[32];
+
+/* Returns the push/pop/remove calls made */
+static unsigned int burst(struct queue *write_queue, struct queue *req_queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		queue_push_tail(write_queue, &ops[i]);
+
+	queue_push_tail(req_queue, &ops[8]);
+
+	while (queue_pop_head(write_queue))
+		;
+
+	queue_pop_head(req_queue);
+
+	return 18;
+}
+
+static unsigned int cancel(struct queue *write_queue,
+						struct queue *req_queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		queue_push_tail(write_queue, &ops[i]);
+
+	for (i = 1; i < 16; i += 2)
+		queue_remove(write_queue, &ops[i]);
+
+	while (queue_pop_head(write_queue))
+		;
+
+	return 32;
+}
+
+static unsigned int window(struct queue *write_queue,
+						struct queue *req_queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < 32; i++) {
+		queue_pop_head(write_queue);
+		queue_push_tail(write_queue, &ops[i]);
+	}
+
+	return 64;
+}
+
+static bool run(const char *name,
+		unsigned int (*func)(struct queue *, struct queue *),
+		unsigned int rounds)
+{
+	struct queue *write_queue = queue_new();
+	struct queue *req_queue = queue_new();
+	struct timespec start, end;
+	unsigned long calls = 0, steady;
+	unsigned int i;
+	double secs;
+
+	for (i = 0; i < 32; i++)
+		queue_push_tail(write_queue, &ops[i]);
+
+	if (func != window) {
+		while (queue_pop_head(write_queue))
+			;
+	}
+
+	for (i = 0; i < WARMUP; i++)
+		func(write_queue, req_queue);
+
+	steady = allocs;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < rounds; i++)
+		calls += func(write_queue, req_queue);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9;
+	steady = allocs - steady;
+
+	printf("%-7s %6.1fM queue ops/s, %lu allocations in %lu ops\n",
+				name, calls / secs / 1e6, steady, calls);
+
+	queue_destroy(write_queue, NULL);
+	queue_destroy(req_queue, NULL);
+
+	if (steady) {
+		fprintf(stderr, "%s allocated in steady state\n", name);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rounds = argc > 1 ? atoi(argv[1]) : 2000000;
+	bool ok = true;
+
+	ok &= run("burst", burst, rounds);
+	ok &= run("cancel", cancel, rounds);
+	ok &= run("window", window, rounds);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,260 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Aggregate notification throughput over 1, 2 and 4 reactor threads
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A number of bt_att channels, each over its own socketpair, stream 200
+ * byte notifications to a peer that checks them, with a window of them
+ * queued per channel. The channels are split over 1, 2 and 4 reactor
+ * threads; each thread makes its own mainloop its default one and sets up
+ * its channels on it, as a server pinning connection groups to cores
+ * would. Every reactor also runs a repeating timeout that must fire on
+ * its own thread.
+ *
+ * The reactors share nothing, so a build with -fsanitize=thread in
+ * CMAKE_C_FLAGS must run this without reports.
+ *
+ *	reactor-bench [channels] [notifications per channel]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "bluez/att.h"
+#include "bluez/mainloop.h"
+#include "bluez/timeout.h"
+#include "bluez/util.h"
+
+#define VALUE_LEN	200
+#define WINDOW		32
+#define MAX_REACTORS	4
+
+struct reactor;
+
+struct channel {
+	struct reactor *reactor;
+	struct bt_att *att;
+	int peer;
+	int sent;
+	int received;
+};
+
+struct reactor {
+	pthread_t thread;
+	pthread_t self;			/* As seen from the reactor thread */
+	struct mainloop *loop;
+	struct channel *channels;
+	int channels_len;
+	int per_channel;
+	int done;			/* Channels that got everything */
+	unsigned int ticks;
+	bool failed;
+};
+
+static uint8_t value[VALUE_LEN];
+
+static void send_one(struct channel *chan)
+{
+	uint8_t handle[2];
+	struct iovec iov[2];
+
+	put_le16(0x0010, handle);
+	iov[0].iov_base = handle;
+	iov[0].iov_len = sizeof(handle);
+	iov[1].iov_base = value;
+	iov[1].iov_len = sizeof(value);
+
+	if (!bt_att_sendv_ref(chan->att, BT_ATT_OP_HANDLE_NFY, iov, 2, NULL,
+									NULL))
+		chan->reactor->failed = true;
+
+	chan->sent++;
+}
+
+static void peer_read(int fd, uint32_t events, void *user_data)
+{
+	struct channel *chan = user_data;
+	struct reactor *reactor = chan->reactor;
+	uint8_t pdu[VALUE_LEN + 8];
+	ssize_t len;
+
+	while ((len = read(fd, pdu, sizeof(pdu))) > 0) {
+		if (len != 3 + VALUE_LEN || pdu[0] != BT_ATT_OP_HANDLE_NFY ||
+					memcmp(pdu + 3, value, VALUE_LEN))
+			reactor->failed = true;
+
+		if (++chan->received == reactor->per_channel) {
+			if (++reactor->done == reactor->channels_len)
+				mainloop_loop_quit(reactor->loop);
+			return;
+		}
+
+		if (chan->sent < reactor->per_channel)
+			send_one(chan);
+	}
+}
+
+static bool tick(void *user_data)
+{
+	struct reactor *reactor = user_data;
+
+	/* timeout_add() bound it to the loop of the thread that added it */
+	if (!pthread_equal(pthread_self(), reactor->self))
+		reactor->failed = true;
+
+	reactor->ticks++;
+
+	return true;
+}
+
+static void *reactor_run(void *user_data)
+{
+	struct reactor *reactor = user_data;
+	unsigned int id;
+	int i, j, sv[2];
+
+	reactor->self = pthread_self();
+	reactor->loop = mainloop_new();
+	if (!reactor->loop) {
+		reactor->failed = true;
+		return NULL;
+	}
+
+	mainloop_set_default(reactor->loop);
+
+	for (i = 0; i < reactor->channels_len; i++) {
+		struct channel *chan = &reactor->channels[i];
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0,
+								sv) < 0) {
+			reactor->failed = true;
+			break;
+		}
+
+		chan->reactor = reactor;
+		chan->peer = sv[1];
+		chan->att = bt_att_new(sv[0], false);
+		bt_att_set_close_on_unref(chan->att, true);
+		bt_att_set_mtu(chan->att, VALUE_LEN + 3);
+		mainloop_add_fd(chan->peer, EPOLLIN, peer_read, chan, NULL);
+
+		for (j = 0; j < WINDOW; j++)
+			send_one(chan);
+	}
+
+	id = timeout_add(1, tick, reactor, NULL);
+
+	if (!reactor->failed)
+		mainloop_loop_run(reactor->loop);
+
+	timeout_remove(id);
+
+	for (i = 0; i < reactor->channels_len; i++) {
+		struct channel *chan = &reactor->channels[i];
+
+		if (!chan->att)
+			continue;
+
+		mainloop_remove_fd(chan->peer);
+		bt_att_unref(chan->att);
+		close(chan->peer);
+	}
+
+	mainloop_set_default(NULL);
+	mainloop_free(reactor->loop);
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool run(int reactors, int channels, int per_channel)
+{
+	struct reactor reactor[MAX_REACTORS];
+	struct channel *chans;
+	unsigned int ticks = 0;
+	bool failed = false;
+	double start;
+	int i, first;
+
+	chans = new0(struct channel, channels);
+	memset(reactor, 0, sizeof(reactor));
+
+	for (i = 0, first = 0; i < reactors; i++) {
+		int n = channels / reactors + (i < channels % reactors);
+
+		reactor[i].channels = chans + first;
+		reactor[i].channels_len = n;
+		reactor[i].per_channel = per_channel;
+		first += n;
+	}
+
+	start = now();
+
+	for (i = 0; i < reactors; i++)
+		pthread_create(&reactor[i].thread, NULL, reactor_run,
+								&reactor[i]);
+
+	for (i = 0; i < reactors; i++) {
+		pthread_join(reactor[i].thread, NULL);
+		failed |= reactor[i].failed;
+		ticks += reactor[i].ticks;
+	}
+
+	printf("%d reactors, %d channels: %9.0f notifications/s, "
+			"%u timeouts\n", reactors, channels,
+			(double) channels * per_channel / (now() - start),
+			ticks);
+
+	free(chans);
+
+	if (failed)
+		fprintf(stderr, "A reactor failed or ran another's timeout\n");
+
+	return !failed;
+}
+
+int main(int argc, char *argv[])
+{
+	int channels = argc > 1 ? atoi(argv[1]) : 8;
+	int per_channel = argc > 2 ? atoi(argv[2]) : 200000;
+	int reactors, i;
+
+	for (i = 0; i < VALUE_LEN; i++)
+		value[i] = i * 7;
+
+	for (reactors = 1; reactors <= MAX_REACTORS; reactors *= 2) {
+		if (!run(reactors, channels, per_channel))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Requests a caching client makes before it is ready, per connection
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * A bt_gatt_client connects to a bt_gatt_server with BleServer's attribute
+ * layout over a socketpair, three times, keeping its gatt_db as the cache
+ * between connections. "sc only" leaves out Client Supported Features and
+ * Database Hash so the client can only rely on Service Changed; "hash+csf"
+ * has them, with change-awareness handled as BleServer does. The number of
+ * requests the server saw before the client was ready is also given as the
+ * time it takes with one request per 30 ms connection interval.
+ *
+ * The last hash+csf connection then adds a service: the client's first
+ * read must fail with Database Out Of Sync and its second must succeed.
+ *
+ *	reconnect-bench
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluez/att.h"
+#include "bluez/uuid.h"
+#include "bluez/queue.h"
+#include "bluez/gatt-db.h"
+#include "bluez/gatt-server.h"
+#include "bluez/gatt-client.h"
+#include "bluez/mainloop.h"
+#include "bluez/timeout.h"
+
+#define CONNECTIONS 3
+#define INTERVAL_MS 30
+
+struct server_state {
+	struct gatt_db *db;
+	uint8_t cli_feat;
+	bool aware;
+	bool oos_sent;
+};
+
+static void hash_read(struct gatt_db_attribute *attrib, unsigned int id,
+				uint16_t offset, uint8_t opcode,
+				struct bt_att *att, void *user_data)
+{
+	struct server_state *state = user_data;
+
+	state->aware = true;
+	state->oos_sent = false;
+	gatt_db_attribute_read_result(attrib, id, 0,
+					gatt_db_get_hash(state->db), 16);
+}
+
+static void feat_read(struct gatt_db_attribute *attrib, unsigned int id,
+				uint16_t offset, uint8_t opcode,
+				struct bt_att *att, void *user_data)
+{
+	struct server_state *state = user_data;
+
+	gatt_db_attribute_read_result(attrib, id, 0, &state->cli_feat, 1);
+}
+
+static void feat_write(struct gatt_db_attribute *attrib, unsigned int id,
+				uint16_t offset, const uint8_t *value,
+				size_t len, uint8_t opcode, struct bt_att *att,
+				void *user_data)
+{
+	struct server_state *state = user_data;
+
+	if (len)
+		state->cli_feat |= value[0] &
+				(BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING |
+				BT_GATT_CHRC_CLI_FEAT_NFY_MULTI);
+
+	gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static uint8_t authorize(struct bt_att *att, uint8_t opcode, uint16_t handle,
+							void *user_data)
+{
+	struct server_state *state = user_data;
+
+	if (state->aware ||
+			!(state->cli_feat & BT_GATT_CHRC_CLI_FEAT_ROBUST_CACHING))
+		return 0;
+
+	if (state->oos_sent) {
+		state->aware = true;
+		state->oos_sent = false;
+		return 0;
+	}
+
+	state->oos_sent = true;
+	return BT_ATT_ERROR_DB_OUT_OF_SYNC;
+}
+
+static void db_changed(struct gatt_db_attribute *attrib, void *user_data)
+{
+	struct server_state *state = user_data;
+
+	state->aware = false;
+	state->oos_sent = false;
+}
+
+static void add_chrc(struct gatt_db_attribute *svc, uint16_t uuid16,
+						uint8_t props, bool ccc)
+{
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, uuid16);
+	gatt_db_service_add_characteristic(svc, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					props, NULL, NULL, NULL);
+	if (!ccc)
+		return;
+
+	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+	gatt_db_service_add_descriptor(svc, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					NULL, NULL, NULL);
+}
+
+/* The services and characteristics of BleServer's kSchema */
+static void build_db(struct server_state *state, bool robust)
+{
+	static const uint8_t ext_prop[2] = { 0x01, 0x00 };
+	struct gatt_db_attribute *svc, *attrib;
+	bt_uuid_t uuid;
+	int i;
+
+	bt_uuid16_create(&uuid, 0x1800);
+	svc = gatt_db_add_service(state->db, &uuid, true, 4);
+	add_chrc(svc, GATT_CHARAC_DEVICE_NAME, BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_EXT_PROP, false);
+	bt_uuid16_create(&uuid, GATT_CHARAC_EXT_PROPER_UUID);
+	attrib = gatt_db_service_add_descriptor(svc, &uuid, BT_ATT_PERM_READ,
+							NULL, NULL, NULL);
+	gatt_db_attribute_set_value(attrib, ext_prop, sizeof(ext_prop));
+	gatt_db_service_set_active(svc, true);
+
+	bt_uuid16_create(&uuid, 0x1801);
+	svc = gatt_db_add_service(state->db, &uuid, true, robust ? 7 : 4);
+	add_chrc(svc, GATT_CHARAC_SERVICE_CHANGED, BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_INDICATE, false);
+	if (robust) {
+		bt_uuid16_create(&uuid, GATT_CHARAC_CLI_FEAT);
+		gatt_db_service_add_characteristic(svc, &uuid,
+					BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+					BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_WRITE,
+					feat_read, feat_write, state);
+		bt_uuid16_create(&uuid, GATT_CHARAC_DB_HASH);
+		gatt_db_service_add_characteristic(svc, &uuid,
+					BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ,
+					hash_read, NULL, state);
+	}
+	gatt_db_service_set_active(svc, true);
+
+	bt_uuid16_create(&uuid, 0x180a);
+	svc = gatt_db_add_service(state->db, &uuid, true, 1);
+	gatt_db_service_set_active(svc, true);
+
+	bt_uuid16_create(&uuid, 0x0a0a);
+	svc = gatt_db_add_service(state->db, &uuid, true, 3);
+	add_chrc(svc, 0x0001, BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE |
+					BT_GATT_CHRC_PROP_NOTIFY, false);
+	gatt_db_service_set_active(svc, true);
+
+	bt_uuid16_create(&uuid, 0x0b0b);
+	svc = gatt_db_add_service(state->db, &uuid, true, 13);
+	for (i = 0; i < 4; i++)
+		add_chrc(svc, 0x0b01 + i, BT_GATT_CHRC_PROP_READ |
+					BT_GATT_CHRC_PROP_NOTIFY, true);
+	gatt_db_service_set_active(svc, true);
+
+	bt_uuid16_create(&uuid, 0x0c0c);
+	svc = gatt_db_add_service(state->db, &uuid, true, 4);
+	add_chrc(svc, 0x0c01, BT_GATT_CHRC_PROP_WRITE |
+				BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP |
+				BT_GATT_CHRC_PROP_NOTIFY, true);
+	gatt_db_service_set_active(svc, true);
+}
+
+static void client_ready(bool success, uint8_t att_ecode, void *user_data)
+{
+	bool *ready = user_data;
+
+	*ready = success;
+	mainloop_loop_quit(mainloop_get_default());
+}
+
+static void read_done(bool success, uint8_t att_ecode, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	uint8_t *status = user_data;
+
+	*status = success ? 0 : att_ecode;
+	mainloop_loop_quit(mainloop_get_default());
+}
+
+static bool stop_run(void *user_data)
+{
+	mainloop_loop_quit(mainloop_get_default());
+	return false;
+}
+
+static uint8_t read_once(struct bt_gatt_client *client, uint16_t handle)
+{
+	uint8_t status = 0xff;
+
+	if (!bt_gatt_client_read_value(client, handle, read_done, &status,
+									NULL))
+		return status;
+
+	mainloop_loop_run(mainloop_get_default());
+
+	return status;
+}
+
+/* A service appears under a connected client that uses robust caching */
+static bool check_out_of_sync(struct server_state *state,
+						struct bt_gatt_client *client)
+{
+	struct gatt_db_attribute *svc;
+	uint8_t first, second;
+	bt_uuid_t uuid;
+
+	/* gives the client time to write its features after ready */
+	timeout_add(50, stop_run, NULL, NULL);
+	mainloop_loop_run(mainloop_get_default());
+
+	bt_uuid16_create(&uuid, 0x0d0d);
+	svc = gatt_db_add_service(state->db, &uuid, true, 2);
+	gatt_db_service_set_active(svc, true);
+
+	first = read_once(client, 0x0003);
+	second = read_once(client, 0x0003);
+	printf("after a change: 1st read 0x%02x, 2nd read 0x%02x\n", first,
+								second);
+
+	return first == BT_ATT_ERROR_DB_OUT_OF_SYNC && !second;
+}
+
+static bool connect_once(struct gatt_db *cache, bool robust, int conn)
+{
+	struct server_state state;
+	struct bt_att *server_att, *client_att;
+	struct bt_gatt_server *server;
+	struct bt_gatt_client *client;
+	struct bt_att_stats stats;
+	bool ready = false, ok = true;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+		return false;
+
+	memset(&state, 0, sizeof(state));
+	state.db = gatt_db_new();
+	state.aware = true;
+	build_db(&state, robust);
+
+	server_att = bt_att_new(sv[0], false);
+	bt_att_set_close_on_unref(server_att, true);
+	server = bt_gatt_server_new(state.db, server_att, 247, 0);
+	bt_gatt_server_set_authorize(server, authorize, &state);
+	gatt_db_register(state.db, db_changed, db_changed, &state, NULL);
+
+	client_att = bt_att_new(sv[1], false);
+	bt_att_set_close_on_unref(client_att, true);
+	client = bt_gatt_client_new(cache, client_att, 247, 0);
+	bt_gatt_client_ready_register(client, client_ready, &ready, NULL);
+	mainloop_loop_run(mainloop_get_default());
+
+	bt_att_get_stats(server_att, &stats);
+	printf("%-8s connection %d: %2llu requests, %4llu ms\n",
+			robust ? "hash+csf" : "sc only", conn + 1,
+			(unsigned long long) stats.rx_pdus,
+			(unsigned long long) stats.rx_pdus * INTERVAL_MS);
+
+	if (!ready) {
+		fprintf(stderr, "Client did not get ready\n");
+		ok = false;
+	} else if (robust && conn == CONNECTIONS - 1) {
+		ok = check_out_of_sync(&state, client);
+	}
+
+	bt_gatt_client_unref(client);
+	bt_gatt_server_unref(server);
+	bt_att_unref(client_att);
+	bt_att_unref(server_att);
+	gatt_db_unref(state.db);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int robust, conn;
+
+	mainloop_init();
+
+	for (robust = 0; robust < 2; robust++) {
+		struct gatt_db *cache = gatt_db_new();
+
+		for (conn = 0; conn < CONNECTIONS; conn++) {
+			if (!connect_once(cache, robust, conn)) {
+				gatt_db_unref(cache);
+				return EXIT_FAILURE;
+			}
+		}
+
+		gatt_db_unref(cache);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+// Scan report resolution rate of RpaResolver.
+//
+// A resolver holding a number of random IRKs plus the one from the spec
+// sample resolves batches of 64 reports drawn from a pool of distinct RPAs,
+// one of which is the sample address, once with the cache off and once
+// with it on.
+//
+//   rpa-bench [irks] [rounds]
+
+#include "rpa_resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+static const size_t kBatch = 64;
+static const size_t kAddresses = 3000;
+
+// Core Vol 3 Part H D.7, irk little-endian and the rpa it resolves
+static const uint8_t kSampleIrk[16] = {
+  0x9b, 0x7d, 0x39, 0x0a, 0xa6, 0x10, 0x10, 0x34,
+  0x05, 0xad, 0xc8, 0x57, 0xa3, 0x34, 0x02, 0xec
+};
+static const bdaddr_t kSampleRpa = {{ 0xaa, 0xfb, 0x0d, 0x94, 0x81, 0x70 }};
+
+static void addIrks(RpaResolver *resolver, int irks, std::mt19937 *rng, const RpaIdentity &owner) {
+  uint8_t key[16];
+  for (int i = 0; i < irks; ++i) {
+    RpaIdentity identity = {};
+    identity.addr.b[0] = i;
+    identity.type = BDADDR_LE_PUBLIC;
+    for (auto &b : key) {
+      b = (*rng)();
+    }
+    resolver->addIrk(identity, key);
+  }
+  resolver->addIrk(owner, kSampleIrk);
+}
+
+int main(int argc, char *argv[]) {
+  int irks = argc > 1 ? atoi(argv[1]) : 35;
+  int rounds = argc > 2 ? atoi(argv[2]) : 200;
+  std::mt19937 rng(1);
+
+  RpaIdentity owner = {};
+  owner.addr.b[0] = 0xaa;
+  owner.type = BDADDR_LE_PUBLIC;
+
+  std::vector<bdaddr_t> addrs(kAddresses);
+  for (auto &addr : addrs) {
+    for (auto &b : addr.b) {
+      b = rng();
+    }
+    addr.b[5] = (addr.b[5] & 0x3f) | 0x40;
+  }
+  addrs[100] = kSampleRpa;
+
+  printf("aes: %s\n", bt_aes_has_hw() ? "AES-NI" : "portable");
+  for (int cached = 0; cached < 2; ++cached) {
+    RpaResolver resolver(std::chrono::milliseconds(cached ? 60000 : 0), cached ? 2 * kAddresses : 0);
+    addIrks(&resolver, irks, &rng, owner);
+
+    RpaIdentity identity;
+    if (!resolver.resolve(kSampleRpa, &identity) || identity.addr.b[0] != owner.addr.b[0]) {
+      fprintf(stderr, "sample rpa does not resolve\n");
+      return EXIT_FAILURE;
+    }
+
+    RpaResult results[kBatch];
+    size_t reports = 0;
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+      for (size_t i = 0; i + kBatch <= addrs.size(); i += kBatch) {
+        found += resolver.resolveBatch(&addrs[i], kBatch, results);
+        reports += kBatch;
+      }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-8s %3d irks %10.0f reports/s, %zu resolved, %llu aes blocks\n",
+           cached ? "cached" : "uncached", irks + 1, reports / secs, found,
+           (unsigned long long)resolver.stats().aesBlocks);
+    if (found != (size_t)rounds) {
+      fprintf(stderr, "expected the sample rpa once per round\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Mainloop timeout add/cancel throughput
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * "bulk" adds a number of timeouts of 1 to 30 s through timeout_add()
+ * and then removes them all, "churn" keeps that many outstanding and
+ * adds and removes one at a time, the way ATT request and gatt-db
+ * pending read/write timeouts come and go. The binary is linked with
+ * --wrap for timerfd_create and timerfd_settime to count the syscalls
+ * the timeouts cost.
+ *
+ *	timeout-bench [outstanding] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "bluez/mainloop.h"
+#include "bluez/timeout.h"
+
+int __real_timerfd_create(int clockid, int flags);
+int __real_timerfd_settime(int fd, int flags,
+				const struct itimerspec *new_value,
+				struct itimerspec *old_value);
+
+static unsigned long syscalls;
+
+int __wrap_timerfd_create(int clockid, int flags)
+{
+	syscalls++;
+	return __real_timerfd_create(clockid, flags);
+}
+
+int __wrap_timerfd_settime(int fd, int flags,
+				const struct itimerspec *new_value,
+				struct itimerspec *old_value)
+{
+	syscalls++;
+	return __real_timerfd_settime(fd, flags, new_value, old_value);
+}
+
+static bool never(void *user_data)
+{
+	return false;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int delay(unsigned int i)
+{
+	return 1000 + (i * 7919) % 29000;
+}
+
+static void report(const char *name, unsigned long ops, double secs,
+						unsigned long calls)
+{
+	printf("%-8s %10.0f ops/s %6.3f timerfd syscalls/op\n", name,
+				ops / secs, (double) calls / ops);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int outstanding = argc > 1 ? atoi(argv[1]) : 10000;
+	unsigned int rounds = argc > 2 ? atoi(argv[2]) : 100;
+	unsigned int *ids, i, r;
+	unsigned long calls, add_calls = 0, remove_calls = 0;
+	double start, add_secs = 0, remove_secs = 0;
+
+	mainloop_init();
+
+	ids = calloc(outstanding, sizeof(*ids));
+	if (!ids)
+		return EXIT_FAILURE;
+
+	/* Grows the slot arrays once, as a running server would have */
+	for (i = 0; i < outstanding; i++)
+		ids[i] = timeout_add(delay(i), never, NULL, NULL);
+	for (i = 0; i < outstanding; i++)
+		timeout_remove(ids[i]);
+
+	for (r = 0; r < rounds; r++) {
+		calls = syscalls;
+		start = now();
+		for (i = 0; i < outstanding; i++) {
+			ids[i] = timeout_add(delay(i + r), never, NULL, NULL);
+			if (!ids[i]) {
+				fprintf(stderr, "Failed to add a timeout\n");
+				return EXIT_FAILURE;
+			}
+		}
+		add_secs += now() - start;
+		add_calls += syscalls - calls;
+
+		calls = syscalls;
+		start = now();
+		for (i = 0; i < outstanding; i++)
+			timeout_remove(ids[i]);
+		remove_secs += now() - start;
+		remove_calls += syscalls - calls;
+	}
+
+	report("add", (unsigned long) outstanding * rounds, add_secs,
+								add_calls);
+	report("remove", (unsigned long) outstanding * rounds, remove_secs,
+								remove_calls);
+
+	for (i = 0; i < outstanding; i++)
+		ids[i] = timeout_add(delay(i), never, NULL, NULL);
+
+	calls = syscalls;
+	start = now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < outstanding; i++) {
+			timeout_remove(ids[i]);
+			ids[i] = timeout_add(delay(i + r + 1), never, NULL,
+									NULL);
+		}
+	}
+	report("churn", (unsigned long) outstanding * rounds * 2,
+					now() - start, syscalls - calls);
+
+	for (i = 0; i < outstanding; i++)
+		timeout_remove(ids[i]);
+
+	free(ids);
+
+	return EXIT_SUCCESS;
+}
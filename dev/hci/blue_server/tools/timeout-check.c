@@ -0,0 +1,229 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Firing accuracy of mainloop timeouts
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Adds a few hundred one-shot timeouts of 1 to 250 ms through
+ * timeout_add(), many of them with the same delay, plus a repeating one,
+ * and checks that:
+ *
+ *  - no timeout fires before its delay has passed,
+ *  - timeouts fire in order of expiry, equal expiries in order of adding,
+ *  - a timeout removed from another one's callback never fires, also when
+ *    it is due in the same batch, and one that removes itself from its own
+ *    callback and returns true is not re-armed,
+ *  - every destroy callback runs exactly once.
+ *
+ * How late they fire is reported but not checked, that depends on the
+ * machine's load.
+ *
+ *	timeout-check
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bluez/mainloop.h"
+#include "bluez/timeout.h"
+
+#define TIMERS		400
+#define PERIOD_MS	10
+#define PERIODS		20
+
+struct timer {
+	unsigned int id;
+	unsigned int delay;
+	uint64_t expect;		/* Earliest it may fire, in ns */
+	struct timer *victims[2];	/* Removed from the callback */
+	bool remove_self;
+	bool cancelled;
+	int fired;
+	int destroyed;
+};
+
+static struct timer timers[TIMERS];
+static struct timer periodic;
+static int pending;
+static uint64_t last_expect;
+static uint64_t late_max, late_sum;
+static int late_count;
+static bool failed;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(const char *msg, struct timer *timer)
+{
+	fprintf(stderr, "%s (timer %ld, %u ms)\n", msg,
+				timer == &periodic ? -1L : (long) (timer - timers),
+				timer->delay);
+	failed = true;
+}
+
+static void check_time(struct timer *timer)
+{
+	uint64_t now = now_ns();
+
+	if (now < timer->expect) {
+		fail("Fired early", timer);
+		return;
+	}
+
+	late_sum += now - timer->expect;
+	late_count++;
+	if (now - timer->expect > late_max)
+		late_max = now - timer->expect;
+}
+
+static void done(void)
+{
+	if (!--pending)
+		mainloop_quit();
+}
+
+static bool timer_fired(void *user_data)
+{
+	struct timer *timer = user_data;
+	int i;
+
+	if (timer->cancelled || timer->fired++)
+		fail("Removed or one-shot timeout fired", timer);
+
+	check_time(timer);
+
+	if (timer->expect < last_expect)
+		fail("Fired out of order", timer);
+	last_expect = timer->expect;
+
+	for (i = 0; i < 2 && timer->victims[i]; i++) {
+		timer->victims[i]->cancelled = true;
+		timeout_remove(timer->victims[i]->id);
+	}
+
+	done();
+
+	if (timer->remove_self) {
+		timer->cancelled = true;
+		timeout_remove(timer->id);
+		/* Would re-arm it if the removal did not stick */
+		return true;
+	}
+
+	return false;
+}
+
+static bool periodic_fired(void *user_data)
+{
+	struct timer *timer = user_data;
+
+	check_time(timer);
+	timer->expect = now_ns() + PERIOD_MS * 1000000ULL;
+
+	if (++timer->fired < PERIODS)
+		return true;
+
+	done();
+
+	return false;
+}
+
+static void timer_destroy(void *user_data)
+{
+	struct timer *timer = user_data;
+
+	timer->destroyed++;
+}
+
+static bool add(struct timer *timer, unsigned int delay,
+						timeout_func_t func)
+{
+	timer->delay = delay;
+	timer->expect = now_ns() + delay * 1000000ULL;
+	timer->id = timeout_add(delay, func, timer, timer_destroy);
+	if (!timer->id) {
+		fail("Failed to add", timer);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	mainloop_init();
+
+	/*
+	 * Every twentieth timeout removes the one added ten after it, which
+	 * has the same delay and is usually due in the same batch, and the
+	 * next one, due 25 ms later. Every tenth from the fifth removes
+	 * itself.
+	 */
+	pending = TIMERS + 1;
+	for (i = 0; i < TIMERS; i += 20) {
+		timers[i].victims[0] = &timers[i + 10];
+		timers[i].victims[1] = &timers[i + 1];
+		pending -= 2;
+	}
+
+	for (i = 5; i < TIMERS; i += 10)
+		timers[i].remove_self = true;
+
+	/* 40 timeouts for each delay from 1 ms in steps of 25 ms */
+	for (i = 0; i < TIMERS; i++) {
+		if (!add(&timers[i], 1 + (i * 25) % 250, timer_fired))
+			return EXIT_FAILURE;
+	}
+
+	if (!add(&periodic, PERIOD_MS, periodic_fired))
+		return EXIT_FAILURE;
+
+	mainloop_run();
+
+	for (i = 0; i < TIMERS; i++) {
+		/* Removed by another timeout, the rest fire once */
+		if (timers[i].cancelled && !timers[i].remove_self) {
+			if (timers[i].fired)
+				fail("Fired after removal", &timers[i]);
+		} else if (timers[i].fired != 1) {
+			fail("Did not fire once", &timers[i]);
+		}
+
+		if (timers[i].destroyed != 1)
+			fail("Not destroyed exactly once", &timers[i]);
+	}
+
+	if (periodic.fired != PERIODS || periodic.destroyed != 1)
+		fail("Repeating timeout did not run its course", &periodic);
+
+	printf("%d timeouts fired, none early, %.2f ms late on average, "
+				"%.2f ms at most\n", late_count,
+				late_sum / 1e6 / (late_count ? late_count : 1),
+				late_max / 1e6);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}